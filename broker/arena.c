@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "epoch.h"
+
+#define ARENA_MIN_BLOCK (4096)
+
+struct ARENA_BLOCK
+{
+  arena_block *next;
+  size_t cap;
+  size_t used;
+  // Allocations not settled yet, and the offset after the last message
+  // settled, the block can't go while there are any or before that
+  uint32_t unsettled;
+  uint32_t end;
+  uint8_t data[];
+};
+
+struct ARENA
+{
+  // Blocks in the order they were added, payloads go at the end of last
+  arena_block *first;
+  arena_block *last;
+  size_t next_cap;
+  pthread_mutex_t lock;
+};
+
+arena *arena_create(void)
+{
+  arena *a = calloc(1, sizeof(*a));
+  if (!a)
+    return 0;
+  a->next_cap = ARENA_MIN_BLOCK;
+  pthread_mutex_init(&a->lock, 0);
+  return a;
+}
+
+void arena_destroy(arena *a)
+{
+  while (a->first)
+  {
+    arena_block *next = a->first->next;
+    free(a->first);
+    a->first = next;
+  }
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+}
+
+static arena_block *block_create(size_t cap)
+{
+  arena_block *b = malloc(sizeof(*b) + cap);
+  if (!b)
+    return 0;
+  b->next = 0;
+  b->cap = cap;
+  b->used = 0;
+  b->unsettled = 0;
+  b->end = 0;
+  return b;
+}
+
+// Payloads that would fill most of a block get one of their own, which
+// goes before the last one so the rest of that one is still used
+static arena_block *alloc_alone(arena *a, size_t len)
+{
+  arena_block *b = block_create(len);
+  if (!b)
+    return 0;
+  arena_block **prev = &a->first;
+  while (*prev && *prev != a->last)
+    prev = &(*prev)->next;
+  b->next = *prev;
+  *prev = b;
+  if (!a->last)
+    a->last = b;
+  return b;
+}
+
+// Adds a block at the end with room for at least len bytes
+static arena_block *add_block(arena *a, size_t len)
+{
+  while (a->next_cap < len)
+    a->next_cap *= 2;
+  arena_block *b = block_create(a->next_cap);
+  if (!b)
+    return 0;
+  if (a->last)
+    a->last->next = b;
+  else
+    a->first = b;
+  a->last = b;
+  if (a->next_cap < ARENA_MAX_BLOCK)
+    a->next_cap *= 2;
+  return b;
+}
+
+void *arena_alloc(arena *a, size_t len, arena_block **b)
+{
+  uint8_t *p = 0;
+  if (!len) // Every payload has its own address
+    len = 1;
+  pthread_mutex_lock(&a->lock);
+  arena_block *blk;
+  if (len > ARENA_MAX_BLOCK / 2)
+    blk = alloc_alone(a, len);
+  else
+  {
+    blk = a->last;
+    if (!blk || blk->cap - blk->used < len)
+      blk = add_block(a, len);
+  }
+  if (blk)
+  {
+    p = blk->data + blk->used;
+    blk->used += len;
+    ++blk->unsettled;
+    *b = blk;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+
+void arena_settle(arena_block *b, int64_t offset)
+{
+  if (offset >= 0)
+  {
+    uint32_t end = __atomic_load_n(&b->end, __ATOMIC_RELAXED);
+    while (end < offset + 1 &&
+           !__atomic_compare_exchange_n(
+               &b->end,
+               &end,
+               offset + 1,
+               0,
+               __ATOMIC_RELAXED,
+               __ATOMIC_RELAXED))
+      ;
+  }
+  // Whoever sees it settled sees its end
+  __atomic_sub_fetch(&b->unsettled, 1, __ATOMIC_RELEASE);
+}
+
+static void block_free(void *b, void *arg)
+{
+  free(b);
+}
+
+void arena_trim(arena *a, uint32_t low)
+{
+  pthread_mutex_lock(&a->lock);
+  // New payloads go in the last one
+  while (a->first && a->first != a->last &&
+         !__atomic_load_n(&a->first->unsettled, __ATOMIC_ACQUIRE) &&
+         __atomic_load_n(&a->first->end, __ATOMIC_RELAXED) <= low)
+  {
+    arena_block *b = a->first;
+    a->first = b->next;
+    if (epoch_retire(b, 0, block_free) < 0)
+      break;
+  }
+  pthread_mutex_unlock(&a->lock);
+}
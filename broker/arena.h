@@ -0,0 +1,41 @@
+/*
+ * Memory for the messages of a topic kept in memory.
+ * Payloads are laid out one after the other in large blocks, so storing a
+ * message takes no heap allocation of its own. Once every message in a
+ * block is below the offsets retention keeps, the block is retired (see
+ * epoch.h) and freed when no reader can still be on it.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocks start small, so topics with few messages take little memory, and
+// double up to this
+#define ARENA_MAX_BLOCK (1024 * 1024)
+
+typedef struct ARENA arena;
+typedef struct ARENA_BLOCK arena_block;
+
+// Returns the arena, or NULL on error
+arena *arena_create(void);
+
+// Frees every block not retired yet
+void arena_destroy(arena *a);
+
+// Returns room for len bytes, or NULL on error. Can be called from any
+// thread. *b is set to the block it is in, which stays there at least until
+// it is given to arena_settle
+void *arena_alloc(arena *a, size_t len, arena_block **b);
+
+// Tells the block of an arena_alloc where it ended up: the last offset
+// of the messages stored there, -1 if they were not appended
+void arena_settle(arena_block *b, int64_t offset);
+
+// Retires the oldest blocks, as long as all their messages are below low
+// Only one thread at a time trims
+void arena_trim(arena *a, uint32_t low);
+
+#endif // _ARENA_H
@@ -1,42 +1,67 @@
+#include <semaphore.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "comun.h"
-#include "queue.h"
-#include "map.h"
-
-#define BACKLOG (5)
+#include "hmap.h"
+#include "ops.h"
+#include "conn.h"
+#include "pool.h"
+#include "evloop.h"
+#ifdef KASKA_URING
+#include "uring.h"
+#endif
+
+#define BACKLOG (SOMAXCONN)
+// Pause after running out of descriptors, for some connections to close
+#define ACCEPT_BACKOFF_US (100000)
+
+// Connection handling modes
+#define MODE_THREAD (0) // One thread per connection
+#define MODE_EPOLL (1)  // Event loops, see evloop.h
+#define MODE_URING (2)  // io_uring loops, see uring.h
+#define MODE_POOL (3)   // Event loops feeding a worker pool, see pool.h
+
+typedef struct ACCEPTOR_INFO acceptor_info;
+struct ACCEPTOR_INFO
+{
+  int sfd;
+  int mode;
+  hmap *topics;
+  char *dir_commit;
+};
 
 typedef struct THREAD_INFO thread_info;
 struct THREAD_INFO
 {
   int cfd;
-  map *topics;
+  hmap *topics;
   char *dir_commit;
 };
 
-typedef struct MESSAGE message;
-struct MESSAGE
-{
-  size_t len;
-  void *base;
-};
-
-static int init_server(int port)
+// With reuseport, several sockets can listen on the same port and the kernel
+// spreads the incomming connections among them
+static int init_server(int port, int backlog, int reuseport)
 {
   int status;
   int reuseaddr_opt = 1;
+  int nodelay_opt = 1;
   int sfd;                 // server file descriptor
   struct sockaddr_in sadr; // server address
 
@@ -59,6 +84,37 @@ static int init_server(int port)
     close(sfd);
     return -2;
   }
+  if (reuseport)
+  {
+    status = setsockopt(
+        sfd,
+        SOL_SOCKET,
+        SO_REUSEPORT,
+        &reuseaddr_opt,
+        sizeof(reuseaddr_opt));
+    if (status < 0)
+    {
+      perror("setsockopt");
+      close(sfd);
+      return -2;
+    }
+  }
+
+  // Accepted sockets inherit it: a response that takes several writes
+  // (a FETCH with many messages) must not wait for the client's ACK of
+  // the first one
+  status = setsockopt(
+      sfd,
+      IPPROTO_TCP,
+      TCP_NODELAY,
+      &nodelay_opt,
+      sizeof(nodelay_opt));
+  if (status < 0)
+  {
+    perror("setsockopt");
+    close(sfd);
+    return -2;
+  }
 
   // Init server address struct (sadr)
   sadr.sin_addr.s_addr = INADDR_ANY;
@@ -75,7 +131,7 @@ static int init_server(int port)
   }
 
   // Listen to incomming connection
-  status = listen(sfd, BACKLOG);
+  status = listen(sfd, backlog);
   if (status < 0)
   {
     perror("listen");
@@ -85,426 +141,357 @@ static int init_server(int port)
   return sfd;
 }
 
-// Lock for the commit directory
-// We don't want two threads to access it at the same time
-// It probably won't cause problems most of the time
-// But if both happen to access the same client/topic, then
-// there is going to be problems, and we don't want them
-pthread_mutex_t dir_commit_lock;
-
-static FILE *open_commit_file(
-    char *dir_commit,
-    char *client,
-    char *topic,
-    char *mode)
+// What a connection thread sleeps on, besides its socket
+typedef struct CONN_THREAD conn_thread;
+struct CONN_THREAD
 {
-  // We need to join th three parameters with '/'
-  size_t dc_len = strlen(dir_commit);
-  size_t client_len = strlen(client);
-  size_t topic_len = strlen(topic);
-  char path[dc_len + client_len + topic_len + 2 + 1]; // + 2 '/' + 1 NULL term
+  sem_t woken; // A long poll can be answered
+  int efd;     // Streams with new messages, once there are streams
+};
 
-  strcpy(path, dir_commit);
-  strcat(path, "/");
-  strcat(path, client);
-  strcat(path, "/");
+static void wake_thread(connection *c)
+{
+  conn_thread *ct = c->owner;
+  sem_post(&ct->woken);
+}
 
-  // path is now the path of the directory of the client
-  DIR *dc = opendir(path);
+static void notify_thread(connection *c)
+{
+  conn_thread *ct = c->owner;
+  uint64_t one = 1;
+  if (write(ct->efd, &one, sizeof(one)) < 0)
+    perror("write");
+}
 
-  if (!dc)
+// Waits for requests or new messages for the streams, whatever comes first
+// Returns 1 if there is something to read, 0 if not, -1 on error
+static int wait_streams(connection *c, conn_thread *ct)
+{
+  struct pollfd pfds[2] = {{c->cfd, POLLIN, 0}, {ct->efd, POLLIN, 0}};
+  while (poll(pfds, 2, -1) < 0)
+    if (errno != EINTR)
+      return -1;
+  if (pfds[1].revents & POLLIN)
   {
-    // Directory does not exist, we need to make it
-    if (mkdir(path, 0700) < 0)
-      return 0;
+    uint64_t n;
+    if (read(ct->efd, &n, sizeof(n)) < 0)
+      return -1;
+    __atomic_store_n(&c->notify_pending, 0, __ATOMIC_RELEASE);
   }
-  else
-    closedir(dc);
-
-  // We are sure the client dir exists
-  strcat(path, topic);
-
-  FILE *f = fopen(path, mode);
-  return f;
+  return pfds[0].revents != 0;
 }
 
 void *handle_connection(void *parg_thinf)
 {
   thread_info *thinf = parg_thinf;
   int cfd = thinf->cfd;
-  map *topics = thinf->topics;
-  char *dir_commit = thinf->dir_commit;
+  uint8_t chunk[READ_CHUNK];
+  conn_thread ct;
+
+  connection *c = conn_create(cfd, thinf->topics, thinf->dir_commit);
+  free(parg_thinf); // The reference servidor.c didn't free the argument, just saying
+  if (!c)
+  {
+    close(cfd);
+    return 0;
+  }
+  sem_init(&ct.woken, 0, 0);
+  ct.efd = -1;
+  c->owner = &ct;
+  c->on_wake = wake_thread;
+  c->on_notify = notify_thread;
 
   printf("[%3d] Connection opened\n", cfd);
 
+  // Each read takes whatever the client sent so far, up to a chunk, and
+  // every complete request in it runs before we read again.
+  // The responses of all of them go back in one go.
+  // A long poll stops everything until it can be answered, the responses
+  // before it leave first
   while (1)
   {
-    uint8_t op;
-    // If any of the receives returns <= 0, we know the connection ended
-    if (recv(cfd, &op, 1, MSG_WAITALL) <= 0)
+    int readable = 1;
+    if (c->streams && (readable = wait_streams(c, &ct)) < 0)
       break;
-    switch (op)
-    {
-    case OP_CREATE_TOPIC: // We do not free() msg here, it will be free()d by map_destroy
-    {
-      // Receive the rest of the message
-      // 4 bytes: topic name length (network order) = N
-      uint32_t topic_len_net;
-      if (recv(cfd, &topic_len_net, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      uint32_t topic_len = ntohl(topic_len_net); // Null termiination also
-                                                 // counted
-      // N bytes topic name
-      char *topic = malloc(topic_len); // free()d in map_destroy
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-
-      uint8_t result;
-      queue *new_topic_queue = queue_create(1); // Use locks
-      if (map_put(topics, topic, new_topic_queue) == -1)
-      {
-        queue_destroy(new_topic_queue, 0);
-        result = OP_CT_EXISTS;
-      }
-      else
-        result = OP_CT_SUCCESS;
-      write(cfd, &result, sizeof(result));
+    if (readable && conn_read(c, chunk, sizeof(chunk)) < 0)
       break;
-    }
-    case OP_NTOPICS:
-    {
-      // NTOPICS only takes the opcode, no further bytes to read from client
-      uint32_t ntopics = map_size(topics);
-      uint32_t ntopics_net = htonl(ntopics);
-      write(cfd, &ntopics_net, sizeof(ntopics_net));
-    }
-    break;
-    case OP_SEND_MSG: // Client wants to send message to a topic
+    if (conn_flush(c) < 0)
+      break;
+    int status;
+    while ((status = conn_settle(c)) == 1)
     {
-      // We need to receive the rest of the message
-      // First we receive the topic name length(0 term counter)
-      // then receive the message length
-      // Then receive the topic name length
-      // Then receive the message
-
-      uint32_t topic_len_net, msg_len_net;
-      if (recv(cfd, &topic_len_net, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      if (recv(cfd, &msg_len_net, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      uint32_t topic_len = ntohl(topic_len_net);
-      uint32_t msg_len = ntohl(msg_len_net);
-
-      char *topic = malloc(topic_len);
-      void *msg = malloc(msg_len);          // free()d in release_message
-      message *m = malloc(sizeof(message)); // free()d in release_message
-
-      m->base = msg;
-      m->len = msg_len;
-
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      if (recv(cfd, msg, msg_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      int result;
-      int err = 0;
-      queue *tq = map_get(topics, topic, &err);
-      if (err == -1)
+      while (sem_wait(&ct.woken) < 0)
+        ;
+      if (conn_resume(c) < 0 || conn_flush(c) < 0)
       {
-        result = OP_SM_NOTOPIC;
-        free(msg);
-        free(m);
+        status = -1;
+        break;
       }
-      else
-      {
-        // tq is a pointer to the target queue
-        result = queue_append(tq, m);
-        if (result < 0)
-        {
-          free(msg);
-          free(m);
-        }
-      }
-      result = htonl(result);
-      free(topic);
-      write(cfd, &result, 4);
     }
-    break;
-    case OP_MSG_LEN:
+    if (status < 0)
+      break;
+    if (c->streams && ct.efd < 0 &&
+        (ct.efd = eventfd(0, EFD_CLOEXEC)) < 0)
+      break;
+    if (conn_pump(c) < 0 || conn_flush(c) < 0)
+      break;
+  }
+
+  printf("[%3d] Connection closed\n", cfd);
+  conn_destroy(c);
+  sem_destroy(&ct.woken);
+  if (ct.efd >= 0)
+    close(ct.efd);
+  return 0;
+}
+
+// Only that connection is lost, keep accepting the next ones
+static void accept_failed(void)
+{
+  int err = errno;
+  perror("accept");
+  // Retrying right away would fail the same way, and spin
+  if (err == EMFILE || err == ENFILE)
+    usleep(ACCEPT_BACKOFF_US);
+}
+
+// Accepts connections on one listening socket, forever
+static void *accept_connections(void *parg_acinf)
+{
+  acceptor_info *acinf = parg_acinf;
+  int sfd = acinf->sfd;
+
+  if (acinf->mode != MODE_THREAD)
+  {
+    while (1)
     {
-      // The rest of the message
-      // 4 bytes topic len = N
-      // 4 bytes offset
-      // N bytes topic
-      uint32_t topic_len;
-      if (recv(cfd, &topic_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      topic_len = ntohl(topic_len);
-      uint32_t offset;
-      if (recv(cfd, &offset, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      offset = htonl(offset);
-
-      char *topic = malloc(topic_len);
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-
-      // Send back result
-      int result;
-      int err = 0;
-      queue *tq = map_get(topics, topic, &err);
-      if (err == -1)
-        result = -1;
-      else
+      int cfd = accept(sfd, 0, 0);
+      if (cfd < 0)
       {
-        err = 0;
-        message *m = queue_get(tq, offset, &err);
-        if (err == -1)
-          result = 0;
-        else
-          result = m->len;
+        accept_failed();
+        continue;
       }
-      free(topic);
-      result = htonl(result);
-      write(cfd, &result, 4);
-    }
-    break;
-    case OP_END_OFF:
-    {
-      int err = 0;
-      // Receive topic len and topic
-      uint32_t topic_len;
-      if (recv(cfd, &topic_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      topic_len = ntohl(topic_len);
-
-      char *topic = malloc(topic_len);
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-
-      // Send result
-      int result;
-      queue *tq = map_get(topics, topic, &err);
-      if (err == -1)
-        result = -1;
-      else
-        result = queue_size(tq);
-      result = htonl(result);
-      free(topic);
-      write(cfd, &result, 4);
+      evloop_add(cfd);
     }
-    break;
-    case OP_POLL:
-    {
-      // The rest of the message, like MSG_LEN
-      // 4 bytes topic len = N
-      // 4 bytes offset
-      // N bytes topic
-      uint32_t topic_len;
-      if (recv(cfd, &topic_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      topic_len = ntohl(topic_len);
-      uint32_t offset;
-      if (recv(cfd, &offset, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      offset = htonl(offset);
-
-      char *topic = malloc(topic_len);
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
-        goto connection_lost;
-
-      uint32_t msg_len;
-
-      int err = 0;
-
-      queue *tq = map_get(topics, topic, &err);
-      void *msg;
-
-      if (err == -1)
-        msg_len = 0;
-      else
-      {
-        err = 0;
-        message *m = queue_get(tq, offset, &err);
-
-        if (err)
-          msg_len = 0;
-        else
-        {
-          msg = m->base;
-          msg_len = m->len;
-        }
-      }
-      uint32_t msg_len_net = htonl(msg_len);
+  }
 
-      struct iovec iov[2];
+  // Init client thread attributes; all clients have the same
+  // attributes for the thread handling them
+  pthread_attr_t cth_attrib;
+  pthread_attr_init(&cth_attrib); // evita pthread_join
+  pthread_attr_setdetachstate(&cth_attrib, PTHREAD_CREATE_DETACHED);
 
-      iove_setup(iov, 0, 4, &msg_len_net);
-      iove_setup(iov, 1, msg_len, msg);
+  // Wait for incomming connections
+  while (1)
+  {
+    int cfd;                 // Next client file descriptor
+    pthread_t cthid;         // Next client's thread ID
+    struct sockaddr_in cadr; // Client address
+    socklen_t cadr_sz = sizeof(cadr);
+    thread_info *thinf; // Pointer to thread info structure for next client
+    int status;
 
-      int iov_count = msg_len ? 2 : 1;
-      writev(cfd, iov, iov_count);
-      printf("[%3d] Poll topic_len=%u, offset=%u, topic='%s' => %u\n", cfd, topic_len, offset, topic, msg_len);
-      free(topic);
-    }
-    break;
-    case OP_COMMIT:
+    // Accept next TCP connection request
+    cfd = accept(sfd, (struct sockaddr *)&cadr, &cadr_sz);
+    if (cfd < 0)
     {
-      uint32_t topic_len;
-      if (recv(cfd, &topic_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      topic_len = ntohl(topic_len);
+      accept_failed();
+      continue;
+    }
 
-      uint32_t client_len;
-      if (recv(cfd, &client_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      client_len = ntohl(client_len);
+    // Init client's thread info
+    thinf = malloc(sizeof(*thinf));
+    if (!thinf)
+    {
+      perror("malloc");
+      exit(-2);
+    }
+    thinf->cfd = cfd;
+    thinf->topics = acinf->topics;
+    thinf->dir_commit = acinf->dir_commit;
 
-      uint32_t offset;
-      if (recv(cfd, &offset, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      offset = ntohl(offset);
+    status = pthread_create(&cthid, &cth_attrib, handle_connection, thinf);
+    if (status)
+    {
+      perror("pthread_create");
+      free(thinf);
+      exit(-3);
+    }
+  }
+}
 
-      char *topic = malloc(topic_len);
-      char *client = malloc(client_len);
+static void usage(char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-m thread|epoll|uring|pool] [-l loops] [-w workers] "
+          "[-a acceptors] [-b backlog] [-s storage_dir]\n"
+          "       [-e file|mmap] [-r max_msgs,max_bytes,max_age_ms] "
+          "[-f records,bytes,ms] port [dir_commited]\n"
+          "  -m  connection handling mode (default thread)\n"
+          "        thread: one thread per connection\n"
+          "        epoll:  connections spread over a few event loops\n"
+          "        uring:  io_uring loops (needs a broker built with URING=1)\n"
+          "        pool:   event loops hand ready connections to a fixed\n"
+          "                pool of workers\n"
+          "  -l  number of event loops (default: cores, 1 in pool mode)\n"
+          "  -w  number of workers in pool mode (default: cores)\n"
+          "  -a  number of listening sockets sharing the port (SO_REUSEPORT),\n"
+          "      each with its own accept thread, or its own loop in uring\n"
+          "      mode, which gets at least that many loops (default 1)\n"
+          "  -b  listen backlog of each socket (default %d)\n"
+          "  -s  keep the messages of each topic in files of storage_dir,\n"
+          "      sent to consumers with sendfile (default: in memory); the\n"
+          "      topics stored there are brought back when it starts, and\n"
+          "      it is created if it is not there\n"
+          "  -e  how -s files are used (default file)\n"
+          "        file: written with calls, sent from the file\n"
+          "        mmap: mapped, messages are written and sent from memory\n"
+          "  -r  how much of each topic is kept unless a client sets it,\n"
+          "      older messages are dropped (default 0,0,0: 0 is no limit)\n"
+          "  -f  how often -s files are synced to disk: once that many\n"
+          "      records (messages, or packed batches) or bytes were\n"
+          "      written, or that many ms went by since the first of them\n"
+          "      (default 0,0,0: only when a file is full). Syncing more\n"
+          "      often loses less in a crash and makes sending slower\n",
+          prog,
+          BACKLOG);
+}
 
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
+int main(int argc, char **argv)
+{
+  int mode = MODE_THREAD;
+  int ncores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nloops = 0; // Depends on the mode if not given
+  int nworkers = ncores;
+  int nacceptors = 1;
+  int backlog = BACKLOG;
+  char *storage_dir = 0;
+  int mapped = 0;
+  retention keep = {0};
+  seglog_sync sync = {0};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:l:w:a:b:s:e:r:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      if (!strcmp(optarg, "thread"))
+        mode = MODE_THREAD;
+      else if (!strcmp(optarg, "epoll"))
+        mode = MODE_EPOLL;
+      else if (!strcmp(optarg, "pool"))
+        mode = MODE_POOL;
+      else if (!strcmp(optarg, "uring"))
       {
-        free(topic);
-        free(client);
-        goto connection_lost;
+#ifdef KASKA_URING
+        mode = MODE_URING;
+#else
+        fprintf(stderr, "This broker was built without io_uring support\n");
+        return 1;
+#endif
       }
-
-      if (recv(cfd, client, client_len, MSG_WAITALL) <= 0)
+      else
       {
-        free(topic);
-        free(client);
-        goto connection_lost;
+        usage(argv[0]);
+        return 1;
       }
-
-      // End receive
-
-      int8_t result;
-
-      if (!client_len ||
-          !topic_len ||
-          client[0] == '.' ||
-          topic[0] == '.' ||
-          strchr(client, '/') ||
-          strchr(topic, '/'))
-        result = -1;
-      else
+      break;
+    case 'l':
+      nloops = atoi(optarg);
+      if (nloops <= 0)
       {
-        pthread_mutex_lock(&dir_commit_lock);
-        FILE *target_file = open_commit_file(dir_commit, client, topic, "w");
-        if (target_file)
-        {
-          fprintf(target_file, "%u", offset);
-          fclose(target_file);
-          result = 0;
-        }
-        else
-          result = -2;
-        pthread_mutex_unlock(&dir_commit_lock);
+        usage(argv[0]);
+        return 1;
       }
-      free(topic);
-      free(client);
-      write(cfd, &result, 1);
-    }
-    break;
-    case OP_COMMITED:
-    {
-      uint32_t topic_len;
-      if (recv(cfd, &topic_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      topic_len = ntohl(topic_len);
-
-      uint32_t client_len;
-      if (recv(cfd, &client_len, 4, MSG_WAITALL) <= 0)
-        goto connection_lost;
-      client_len = ntohl(client_len);
-
-      char *topic = malloc(topic_len);
-      char *client = malloc(client_len);
-
-      if (recv(cfd, topic, topic_len, MSG_WAITALL) <= 0)
+      break;
+    case 'w':
+      nworkers = atoi(optarg);
+      if (nworkers <= 0)
       {
-        free(topic);
-        free(client);
-        goto connection_lost;
+        usage(argv[0]);
+        return 1;
       }
-
-      if (recv(cfd, client, client_len, MSG_WAITALL) <= 0)
+      break;
+    case 'a':
+      nacceptors = atoi(optarg);
+      if (nacceptors <= 0)
       {
-        free(topic);
-        free(client);
-        goto connection_lost;
+        usage(argv[0]);
+        return 1;
       }
-
-      // End receive
-      int32_t result;
-
-      if (!client_len ||
-          !topic_len ||
-          client[0] == '.' ||
-          topic[0] == '.' ||
-          strchr(client, '/') ||
-          strchr(topic, '/'))
-        result = -1;
+      break;
+    case 'b':
+      backlog = atoi(optarg);
+      if (backlog <= 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      storage_dir = optarg;
+      break;
+    case 'e':
+      if (!strcmp(optarg, "file"))
+        mapped = 0;
+      else if (!strcmp(optarg, "mmap"))
+        mapped = 1;
       else
       {
-        pthread_mutex_lock(&dir_commit_lock);
-        FILE *target_file = open_commit_file(dir_commit, client, topic, "r");
-        if (target_file)
-        {
-          fscanf(target_file, "%d", &result);
-          fclose(target_file);
-        }
-        else
-          result = -2;
-        pthread_mutex_unlock(&dir_commit_lock);
+        usage(argv[0]);
+        return 1;
       }
-      free(topic);
-      free(client);
-      result = htonl(result);
-      write(cfd, &result, 4);
+      break;
+    case 'r':
+    {
+      unsigned long long max_bytes;
+      int used = 0;
+      if (sscanf(optarg, "%u,%llu,%u%n", &keep.max_msgs, &max_bytes,
+                 &keep.max_age_ms, &used) != 3 ||
+          optarg[used])
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      keep.max_bytes = max_bytes;
+      break;
+    }
+    case 'f':
+    {
+      unsigned long long bytes;
+      int used = 0;
+      if (sscanf(optarg, "%u,%llu,%u%n", &sync.records, &bytes,
+                 &sync.interval_ms, &used) != 3 ||
+          optarg[used])
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      sync.bytes = bytes;
+      break;
     }
-    break;
-    default: // If we receive an invalid opcode, we break the connection
-      goto connection_lost;
+    default:
+      usage(argv[0]);
+      return 1;
     }
   }
-connection_lost:
-  printf("[%3d] Connection closed\n", cfd);
-  free(parg_thinf); // The reference servidor.c didn't free the argument, just saying
-  close(cfd);
-  return 0;
-}
-
-void release_message(void *value)
-{
-  message *m = value;
-  free(m->base);
-  free(value);
-}
-
-void topic_queue_release(void *key, void *value)
-{
-  queue_destroy(value, release_message);
-  free(key);
-}
-
-int main(int argc, char **argv)
-{
-  if (argc != 2 && argc != 3)
+  if (!nloops)
+    nloops = mode == MODE_POOL ? 1 : ncores;
+  if (nloops <= 0)
+    nloops = 1;
+  if (nworkers <= 0)
+    nworkers = 1;
+
+  if (argc - optind != 1 && argc - optind != 2)
   {
-    fprintf(stderr, "Usage: %s port [dir_commited]\n", argv[0]);
+    usage(argv[0]);
     return 1;
   }
 
   char *dir_commit;
-  if (argc == 3)
-    dir_commit = argv[2];
+  if (argc - optind == 2)
+    dir_commit = argv[optind + 1];
   else
     dir_commit = "commits";
 
@@ -516,91 +503,106 @@ int main(int argc, char **argv)
   }
   closedir(commitdir);
 
-  int port = atoi(argv[1]);
+  // Create a map topic->message queue
+  // Lookups don't take locks, creating topics does
+  hmap *topics = hmap_create();
+  if (!topics)
+  {
+    perror("hmap_create");
+    exit(-5);
+  }
 
-  // Open server on specified port
-  int sfd = init_server(port);
-  if (sfd < 0)
+  // Stored topics come back with the retention they are created with
+  ops_default_retention(&keep);
+  // It says what went wrong
+  if (storage_dir && ops_storage_init(storage_dir, mapped, &sync, topics) < 0)
+    exit(-6);
+  if (ops_reaper_start() < 0)
+    exit(-3);
+
+  int port = atoi(argv[optind]);
+
+  // Open server on specified port, as many times as acceptors we want
+  int sfds[nacceptors];
+  for (int i = 0; i < nacceptors; ++i)
   {
-    char *err_msg;
-    switch (sfd)
+    int sfd = init_server(port, backlog, nacceptors > 1);
+    if (sfd < 0)
     {
-    case -1:
-      err_msg = "Could not create socket";
-      break;
-    case -2:
-      err_msg = "Could not configure socket";
-      break;
-    case -3:
-      err_msg = "Could not use specified port";
-      break;
-    case -4:
-      err_msg = "Could not listen for incomming connections";
-      break;
-    default:
-      err_msg = "Unknown error";
-      break;
+      char *err_msg;
+      switch (sfd)
+      {
+      case -1:
+        err_msg = "Could not create socket";
+        break;
+      case -2:
+        err_msg = "Could not configure socket";
+        break;
+      case -3:
+        err_msg = "Could not use specified port";
+        break;
+      case -4:
+        err_msg = "Could not listen for incomming connections";
+        break;
+      default:
+        err_msg = "Unknown error";
+        break;
+      }
+      fprintf(stderr, "%s\n", err_msg);
+      exit(-sfd);
     }
-    fprintf(stderr, "%s\n", err_msg);
-    exit(-sfd);
+    sfds[i] = sfd;
   }
 
-  // Create a map topic->message queue
-  // This map uses locks
-  map *topics = map_create(key_string, 1);
-  if (!topics)
-  {
-    perror("map_create");
-    close(sfd);
-  }
 
-  // Init client thread attributes; all clients have the same
-  // attributes for the thread handling them
-  pthread_attr_t cth_attrib;
-  pthread_attr_init(&cth_attrib); // evita pthread_join
-  pthread_attr_setdetachstate(&cth_attrib, PTHREAD_CREATE_DETACHED);
+  // A client that goes away while we write to it must not take the broker
+  // down with it
+  signal(SIGPIPE, SIG_IGN);
 
-  // Wait for incomming connections
-  while (1)
+  if (mode == MODE_EPOLL || mode == MODE_POOL)
   {
-    int cfd;                 // Next client file descriptor
-    pthread_t cthid;         // Next client's thread ID
-    struct sockaddr_in cadr; // Client address
-    socklen_t cadr_sz = sizeof(cadr);
-    thread_info *thinf; // Pointer to thread info structure for next client
-    int status;
-
-    // Accept next TCP connection request
-    cfd = accept(sfd, (struct sockaddr *)&cadr, &cadr_sz);
-    if (cfd < 0)
+    pool *workers = 0;
+    if (mode == MODE_POOL && !(workers = pool_create(nworkers)))
     {
-      perror("accept");
-      map_destroy(topics, topic_queue_release);
-      close(sfd);
-      exit(-1);
+      hmap_destroy(topics, topic_release);
+      exit(-3);
     }
-
-    // Init client's thread info
-    thinf = malloc(sizeof(*thinf));
-    if (!thinf)
+    if (evloop_start(nloops, workers, topics, dir_commit) < 0)
     {
-      perror("malloc");
-      map_destroy(topics, topic_queue_release);
-      close(sfd);
-      exit(-2);
+      hmap_destroy(topics, topic_release);
+      exit(-3);
     }
-    thinf->cfd = cfd;
-    thinf->topics = topics;
-    thinf->dir_commit = dir_commit;
+  }
 
-    status = pthread_create(&cthid, &cth_attrib, handle_connection, thinf);
-    if (status)
+#ifdef KASKA_URING
+  if (mode == MODE_URING)
+  {
+    // The rings accept connections themselves
+    uring_run(sfds, nacceptors, nloops, topics, dir_commit);
+    hmap_destroy(topics, topic_release);
+    exit(-3);
+  }
+#endif
+
+  // One accept thread per listening socket, this one being the last
+  acceptor_info acinfs[nacceptors];
+  for (int i = 0; i < nacceptors; ++i)
+  {
+    acinfs[i].sfd = sfds[i];
+    acinfs[i].mode = mode;
+    acinfs[i].topics = topics;
+    acinfs[i].dir_commit = dir_commit;
+  }
+  for (int i = 1; i < nacceptors; ++i)
+  {
+    pthread_t athid;
+    if (pthread_create(&athid, 0, accept_connections, &acinfs[i]))
     {
       perror("pthread_create");
-      map_destroy(topics, topic_queue_release);
-      free(thinf);
-      close(sfd);
       exit(-3);
     }
+    pthread_detach(athid);
   }
+  accept_connections(&acinfs[0]);
+  return 0;
 }
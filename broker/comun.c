@@ -2,11 +2,153 @@
  * Incluya en este fichero todas las implementaciones que pueden
  * necesitar compartir el broker y la biblioteca, si es que las hubiera.
  */
+#include <string.h>
 #include <sys/uio.h>
 #include "comun.h"
 
+// LZ77 in the style of LZ4: a sequence of
+//  1 byte token: literals (high 4 bits), match length - 4 (low 4 bits),
+//    15 in either of them means more length bytes follow
+//  More literals length bytes, each adding up to 255
+//  Literals
+//  2 bytes offset of the match (little endian), back from here
+//  More match length bytes
+// The last sequence only has literals
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_BITS (12)
+#define LZ_MAX_OFFSET (0xFFFF)
+
 void iove_setup(struct iovec *iov, size_t index, size_t len, void *base)
 {
   iov[index].iov_base = base;
   iov[index].iov_len = len;
 }
+
+size_t lz_bound(size_t len)
+{
+  return len + len / 255 + 16;
+}
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *out, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    *out++ = 255;
+  *out++ = len;
+  return out;
+}
+
+// match_len 0 for the last sequence
+static uint8_t *lz_sequence(
+    uint8_t *out,
+    const uint8_t *lit,
+    size_t lit_len,
+    size_t offset,
+    size_t match_len)
+{
+  size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+  *out++ = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+  if (lit_len >= 15)
+    out = lz_put_len(out, lit_len - 15);
+  memcpy(out, lit, lit_len);
+  out += lit_len;
+  if (!match_len)
+    return out;
+  *out++ = offset & 0xFF;
+  *out++ = offset >> 8;
+  if (ml >= 15)
+    out = lz_put_len(out, ml - 15);
+  return out;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+  uint32_t table[1 << LZ_HASH_BITS]; // Last position of each hash
+  memset(table, 0, sizeof(table));
+  uint8_t *out = dst;
+  size_t anchor = 0; // First byte not encoded yet
+  size_t pos = 0;
+
+  while (pos + LZ_MIN_MATCH <= len)
+  {
+    uint32_t h = lz_hash(src + pos);
+    size_t cand = table[h];
+    table[h] = pos;
+    if (cand >= pos || pos - cand > LZ_MAX_OFFSET ||
+        memcmp(src + cand, src + pos, LZ_MIN_MATCH))
+    {
+      ++pos;
+      continue;
+    }
+    size_t match_len = LZ_MIN_MATCH;
+    while (pos + match_len < len &&
+           src[cand + match_len] == src[pos + match_len])
+      ++match_len;
+    out = lz_sequence(out, src + anchor, pos - anchor, pos - cand, match_len);
+    pos += match_len;
+    anchor = pos;
+  }
+  out = lz_sequence(out, src + anchor, len - anchor, 0, 0);
+  return out - dst;
+}
+
+// Reads a length that goes on in more bytes, returns -1 past the end
+static int lz_get_len(const uint8_t **in, const uint8_t *end, size_t *len)
+{
+  uint8_t b;
+  do
+  {
+    if (*in == end)
+      return -1;
+    b = *(*in)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress(
+    const uint8_t *src,
+    size_t len,
+    uint8_t *dst,
+    size_t dst_len)
+{
+  const uint8_t *in = src;
+  const uint8_t *end = src + len;
+  size_t out = 0;
+
+  while (in < end)
+  {
+    uint8_t token = *in++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && lz_get_len(&in, end, &lit_len) < 0)
+      return -1;
+    if (lit_len > (size_t)(end - in) || lit_len > dst_len - out)
+      return -1;
+    memcpy(dst + out, in, lit_len);
+    in += lit_len;
+    out += lit_len;
+    if (in == end) // Last sequence
+      break;
+
+    if (end - in < 2)
+      return -1;
+    size_t offset = in[0] | in[1] << 8;
+    in += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && lz_get_len(&in, end, &match_len) < 0)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (!offset || offset > out || match_len > dst_len - out)
+      return -1;
+    // The match may overlap what it writes
+    for (size_t i = 0; i < match_len; ++i, ++out)
+      dst[out] = dst[out - offset];
+  }
+  return out == dst_len ? 0 : -1;
+}
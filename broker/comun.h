@@ -7,29 +7,90 @@
 #define _COMUN_H        1
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 // All operation codes defined by Kaska
 #define OP_CREATE_TOPIC (0x10)
 #define OP_NTOPICS (0x11)
+#define OP_TOPIC_STATS (0x12) // Bytes received and stored for a topic
+#define OP_TOPIC_ID (0x13)    // ID of a topic, for requests with OP_BY_ID
+#define OP_SET_RETENTION (0x14) // How much of a topic the broker keeps
 
 #define OP_SEND_MSG (0x20)
 #define OP_MSG_LEN (0x21)
 #define OP_END_OFF (0x22)
+#define OP_SEND_BATCH (0x23) // Several messages, for one or more topics
+#define OP_SEND_PACKED (0x24) // SEND_BATCH with each run as a packed batch
+#define OP_LOW_OFF (0x25) // Offset of the oldest message kept
 
 #define OP_POLL (0x40)
+#define OP_POLL_WAIT (0x41) // POLL waiting up to some time for the message
+#define OP_STREAM (0x42)    // Messages of a topic pushed as they arrive
+#define OP_CREDIT (0x43)    // More bytes a stream can push
+#define OP_FETCH (0x44)     // Several messages of a topic at once
+#define OP_FETCH_ALL (0x45) // FETCH for several topics at once
 
 #define OP_COMMIT (0x50)
 #define OP_COMMITED (0x51)
 
+// Set in the opcode of a request to address its topics by ID instead of by
+// name: every topic length in it is the topic ID instead, and the topic name
+// is left out. For every request on topics but CREATE_TOPIC, COMMIT and
+// COMMITED. Topic IDs never change while the broker runs
+#define OP_BY_ID (0x80)
+
 // Create Topic result codes
 #define OP_CT_SUCCESS (0)
 #define OP_CT_EXISTS (1) // topic already exists
+#define OP_CT_FAIL (2)   // could not create it (out of memory, storage...)
+#define OP_CT_FAIL (2)   // could not create it (out of memory, storage...)
 
 // Send message result codes
 #define OP_SM_NOTOPIC (-1)
 #define OP_SM_FAIL (-2)
 
+// Messages older than the retention of their topic are dropped, offsets of
+// the others stay the same. Requests for offsets below the oldest message
+// kept (the low offset) get these, and POLL and FETCH then send the low
+// offset (4 bytes) so the client can go on from there
+#define POLL_GONE (0xFFFFFFFF)  // Instead of the POLL message length
+#define FETCH_GONE (0xFFFFFFFF) // Instead of the FETCH number of items
+#define OP_ML_GONE (-2)         // MSG_LEN result
+// Streams skip them, their frames have the offset of each message
+
+// Length of a stream frame for a topic that does not exist, the stream
+// is closed
+#define STREAM_NOTOPIC (0xFFFFFFFF)
+
+// Index of a FETCH item that is a message on its own, not a packed batch
+#define FETCH_PLAIN (0xFFFFFFFF)
+
+// Packed batches: messages a producer sends together, compressed
+// The broker stores them as they come and sends them as they are to the
+// consumers, who unpack them
+//  4 bytes codec
+//  4 bytes number of messages = N
+//  N * 4 bytes length of each message
+//  Then the messages one after the other, compressed with the codec
+#define CODEC_NONE (0) // Not compressed
+#define CODEC_LZ (1)
+#define PACKED_HDR_SIZE(n) (8 + 4 * (size_t)(n))
+
 // Common functions
 void iove_setup(struct iovec *iov, size_t index, size_t len, void *base);
 
+// LZ codec, for packed batches
+// Most bytes lz_compress may need for len bytes
+size_t lz_bound(size_t len);
+// Compresses the len bytes at src into dst, returns the compressed size
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst);
+// Returns 0 if src decompresses to exactly dst_len bytes, -1 if it is not
+// valid LZ data
+int lz_decompress(
+    const uint8_t *src,
+    size_t len,
+    uint8_t *dst,
+    size_t dst_len);
+
 #endif // _COMUN_H
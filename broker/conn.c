@@ -0,0 +1,1229 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include "comun.h"
+#include "ops.h"
+#include "conn.h"
+
+// Initial size of the buffer holding an incomplete request
+#define IN_MIN_CAP (4096)
+
+// Where a parked connection is, between its owner and the waker
+#define WS_NONE (0)     // Not parked
+#define WS_PARKED (1)   // Parked, the owner is still on it
+#define WS_RELEASED (2) // Parked, the owner let go of it
+#define WS_WOKEN (3)    // Woken while the owner was still on it
+
+// Most messages a FETCH gets, whatever the client asks for
+#define FETCH_MAX_MSGS (1024)
+
+static uint32_t get_u32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+// Strings received from clients are counted with their null termination,
+// we make sure it is really there before using them
+static int valid_str(const uint8_t *s, uint32_t len)
+{
+  return len && s[len - 1] == '\0';
+}
+
+// Requests on a single topic, they have it first
+static int on_topic(uint8_t op)
+{
+  switch (op)
+  {
+  case OP_SEND_MSG:
+  case OP_TOPIC_STATS:
+  case OP_MSG_LEN:
+  case OP_END_OFF:
+  case OP_POLL:
+  case OP_POLL_WAIT:
+  case OP_STREAM:
+  case OP_FETCH:
+  case OP_LOW_OFF:
+  case OP_SET_RETENTION:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Requests that can have OP_BY_ID
+static int takes_id(uint8_t op)
+{
+  return on_topic(op) ||
+         op == OP_SEND_BATCH ||
+         op == OP_SEND_PACKED ||
+         op == OP_FETCH_ALL;
+}
+
+// Size of the fixed part of a request, following the opcode
+// -1 for unknown opcodes
+static int header_size(uint8_t op)
+{
+  // Topic IDs take the place of the topic lengths
+  if (op & OP_BY_ID)
+    return takes_id(op & ~OP_BY_ID) ? header_size(op & ~OP_BY_ID) : -1;
+  switch (op)
+  {
+  case OP_NTOPICS:
+    return 0;
+  case OP_CREATE_TOPIC:
+  case OP_TOPIC_ID:
+  case OP_END_OFF:
+  case OP_LOW_OFF:
+  case OP_TOPIC_STATS:
+    return 4; // topic len
+  case OP_SET_RETENTION:
+    return 20; // topic len, max msgs, max bytes (2), max age (ms)
+  case OP_SEND_MSG:
+    return 8; // topic len, msg len
+  case OP_SEND_BATCH:
+  case OP_SEND_PACKED:
+    return 8; // body len, topics
+  case OP_MSG_LEN:
+  case OP_POLL:
+    return 8; // topic len, offset
+  case OP_FETCH:
+    return 16; // topic len, offset, max msgs, max bytes
+  case OP_FETCH_ALL:
+    return 16; // body len, topics, max msgs (each topic), max bytes
+  case OP_POLL_WAIT:
+    return 12; // topic len, offset, max wait (ms)
+  case OP_STREAM:
+    return 16; // topic len, stream id, offset, credit
+  case OP_CREDIT:
+    return 8; // stream id, credit
+  case OP_COMMIT:
+    return 12; // topic len, client len, offset
+  case OP_COMMITED:
+    return 8; // topic len, client len
+  default:
+    return -1;
+  }
+}
+
+// Size of the variable part of a request, given its fixed part
+static size_t body_size(uint8_t op, const uint8_t *hdr)
+{
+  // The same without the topic names
+  if (op & OP_BY_ID)
+    switch (op & ~OP_BY_ID)
+    {
+    case OP_SEND_MSG:
+      return get_u32(hdr + 4);
+    case OP_SEND_BATCH:
+    case OP_SEND_PACKED:
+    case OP_FETCH_ALL:
+      return get_u32(hdr);
+    default:
+      return 0;
+    }
+  switch (op)
+  {
+  case OP_CREATE_TOPIC:
+  case OP_TOPIC_ID:
+  case OP_END_OFF:
+  case OP_LOW_OFF:
+  case OP_SET_RETENTION:
+  case OP_TOPIC_STATS:
+  case OP_MSG_LEN:
+  case OP_POLL:
+  case OP_POLL_WAIT:
+  case OP_STREAM:
+  case OP_FETCH:
+  case OP_FETCH_ALL:
+  case OP_SEND_BATCH:
+  case OP_SEND_PACKED:
+    return get_u32(hdr);
+  case OP_SEND_MSG:
+  case OP_COMMIT:
+  case OP_COMMITED:
+    return (size_t)get_u32(hdr) + get_u32(hdr + 4);
+  default:
+    return 0;
+  }
+}
+
+// Finds the topic of a request, or of a run in its body: with OP_BY_ID, key
+// is the topic ID, otherwise it is the length of the name at name, which has
+// to fit in avail bytes. *t is 0 if there is no such topic
+// Returns how many bytes the name takes, -1 if it is not valid
+static ssize_t find_topic(
+    connection *c,
+    int by_id,
+    uint32_t key,
+    const uint8_t *name,
+    size_t avail,
+    topic **t)
+{
+  if (by_id)
+  {
+    *t = op_topic_by_id(key);
+    return 0;
+  }
+  if (key > avail || !valid_str(name, key))
+    return -1;
+  *t = op_topic(c->topics, (const char *)name);
+  return key;
+}
+
+static void conn_wake(waiter *w)
+{
+  connection *c = (connection *)((uint8_t *)w - offsetof(connection, w));
+  // If the owner is still on it, it will see it was woken when settling
+  if (__atomic_exchange_n(&c->wait_state, WS_WOKEN, __ATOMIC_ACQ_REL) ==
+      WS_RELEASED)
+    c->on_wake(c);
+}
+
+static void stream_wake(waiter *w)
+{
+  stream *s = (stream *)((uint8_t *)w - offsetof(stream, w));
+  connection *c = s->c;
+  __atomic_store_n(&s->woken, 1, __ATOMIC_RELEASE);
+  if (!__atomic_exchange_n(&c->notify_pending, 1, __ATOMIC_ACQ_REL))
+    c->on_notify(c);
+}
+
+connection *conn_create(int cfd, hmap *topics, char *dir_commit)
+{
+  connection *c = calloc(1, sizeof(*c));
+  if (!c)
+    return 0;
+  c->cfd = cfd;
+  c->topics = topics;
+  c->dir_commit = dir_commit;
+  c->pstate = PS_OPCODE;
+  c->w.wake = conn_wake;
+  epoch_register(&c->reader);
+  return c;
+}
+
+void conn_destroy(connection *c)
+{
+  // Dropped while parked, before anyone woke it
+  if (__atomic_load_n(&c->wait_state, __ATOMIC_ACQUIRE) == WS_PARKED)
+    wait_cancel(&c->w);
+  conn_stop_streams(c);
+  while (c->streams)
+  {
+    stream *s = c->streams;
+    c->streams = s->next;
+    free(s);
+  }
+  if (c->pstate == PS_PAYLOAD)
+    op_unreserve(c->direct_hold);
+  epoch_exit(&c->reader);
+  epoch_unregister(&c->reader);
+  close(c->cfd);
+  free(c->in);
+  free(c->out);
+  free(c->obuf);
+  free(c);
+}
+
+// Enters the current epoch, staying in the one pending output was queued in
+static void conn_enter(connection *c)
+{
+  uint64_t hold = conn_has_output(c) ? c->out[c->out_first].epoch : 0;
+  c->epoch = epoch_enter(&c->reader, hold);
+}
+
+static out_seg *out_new_seg(connection *c)
+{
+  if (c->out_count == c->out_cap)
+  {
+    size_t ncap = c->out_cap ? c->out_cap * 2 : 8;
+    out_seg *nout = realloc(c->out, ncap * sizeof(*nout));
+    if (!nout)
+      return 0;
+    c->out = nout;
+    c->out_cap = ncap;
+  }
+  out_seg *s = &c->out[c->out_count++];
+  s->fd = -1;
+  s->epoch = c->epoch;
+  return s;
+}
+
+// Makes room for len more bytes of response in obuf
+static uint8_t *out_reserve(connection *c, size_t len)
+{
+  if (c->obuf_len + len > c->obuf_cap)
+  {
+    size_t ncap = c->obuf_cap ? c->obuf_cap : 64;
+    while (ncap < c->obuf_len + len)
+      ncap *= 2;
+    uint8_t *nbuf = realloc(c->obuf, ncap);
+    if (!nbuf)
+      return 0;
+    c->obuf = nbuf;
+    c->obuf_cap = ncap;
+  }
+  return c->obuf + c->obuf_len;
+}
+
+// Adds the len bytes placed at the end of obuf to the response
+static int out_commit(connection *c, size_t len)
+{
+  // Responses are small, we try to have them all in a single segment
+  out_seg *last = c->out_count > c->out_first ? &c->out[c->out_count - 1] : 0;
+  if (last && !last->ext && last->fd < 0 &&
+      last->off + last->len == c->obuf_len)
+    last->len += len;
+  else
+  {
+    out_seg *s = out_new_seg(c);
+    if (!s)
+      return -1;
+    s->ext = 0;
+    s->off = c->obuf_len;
+    s->len = len;
+  }
+  c->obuf_len += len;
+  return 0;
+}
+
+// Queues a copy of data in the response
+static int out_copy(connection *c, const void *data, size_t len)
+{
+  uint8_t *dst = out_reserve(c, len);
+  if (!dst)
+    return -1;
+  memcpy(dst, data, len);
+  return out_commit(c, len);
+}
+
+// Queues a reference to data in the response, data has to stay valid until
+// it is sent
+static int out_ref(connection *c, const void *data, size_t len)
+{
+  if (!len)
+    return 0;
+  out_seg *s = out_new_seg(c);
+  if (!s)
+    return -1;
+  s->ext = data;
+  s->off = 0;
+  s->len = len;
+  return 0;
+}
+
+// Queues len bytes of the file at pos in the response, they are sent
+// straight from the file when the socket can take them
+static int out_file(connection *c, int fd, off_t pos, size_t len)
+{
+  if (!len)
+    return 0;
+  if (c->copy_files)
+  {
+    uint8_t *dst = out_reserve(c, len);
+    if (!dst)
+      return -1;
+    size_t done = 0;
+    while (done < len)
+    {
+      ssize_t n = pread(fd, dst + done, len - done, pos + done);
+      if (n <= 0)
+        return -1;
+      done += n;
+    }
+    return out_commit(c, len);
+  }
+  // Consecutive messages of a topic are next to each other in its file
+  out_seg *last = c->out_count > c->out_first ? &c->out[c->out_count - 1] : 0;
+  if (last && last->fd == fd && last->pos + (off_t)last->len == pos)
+  {
+    last->len += len;
+    return 0;
+  }
+  out_seg *s = out_new_seg(c);
+  if (!s)
+    return -1;
+  s->ext = 0;
+  s->off = 0;
+  s->len = len;
+  s->fd = fd;
+  s->pos = pos;
+  return 0;
+}
+
+static int out_u32(connection *c, uint32_t v)
+{
+  uint32_t v_net = htonl(v);
+  return out_copy(c, &v_net, 4);
+}
+
+// Messages stay there while the connection is in its epoch, so the response
+// can point right at the stored message, in memory or in the topic file
+static int out_stored(connection *c, const message *m, int fd)
+{
+  // Packed messages are stored in their batch
+  size_t len = m->packed_len ? m->packed_len : m->len;
+  if (!m->base)
+    return out_file(c, fd, m->pos, len);
+  return out_ref(c, m->base, len);
+}
+
+// Single messages that came packed are unpacked into the response
+static int out_message(connection *c, const message *m, int fd)
+{
+  if (!m->packed_len)
+    return out_stored(c, m, fd);
+  uint8_t *dst = out_reserve(c, m->len);
+  if (!dst || op_unpack(m, fd, dst) < 0)
+    return -1;
+  return out_commit(c, m->len);
+}
+
+// Sends the message at offset, or an empty one if there is none
+static int out_poll(connection *c, topic *t, uint32_t offset)
+{
+  int fd;
+  message m;
+  if (op_poll(t, offset, &m, &fd) < 0)
+  {
+    // Whatever comes before the low offset is gone for good
+    int32_t low = op_low_offset(t);
+    if (low < 0 || offset >= (uint32_t)low)
+      return out_u32(c, 0);
+    return out_u32(c, POLL_GONE) < 0 ? -1 : out_u32(c, low);
+  }
+  if (out_u32(c, m.len) < 0)
+    return -1;
+  return out_message(c, &m, fd);
+}
+
+// Appends the messages of each (topic len, messages, topic, messages) in
+// the body, each message being its length and its bytes
+// Sends the offset of the first message of each topic, or its error
+static int out_send_batch(
+    connection *c,
+    int by_id,
+    const uint8_t *body,
+    uint32_t body_len,
+    uint32_t ntopics)
+{
+  for (uint32_t i = 0; i < ntopics; ++i)
+  {
+    if (body_len < 8)
+      return -1;
+    uint32_t nmsgs = get_u32(body + 4);
+    topic *t;
+    ssize_t name_len =
+        find_topic(c, by_id, get_u32(body), body + 8, body_len - 8, &t);
+    if (name_len < 0)
+      return -1;
+    body += 8 + name_len;
+    body_len -= 8 + name_len;
+
+    // Every message takes at least its length, which bounds the allocation
+    if (!nmsgs || nmsgs > body_len / 4)
+      return -1;
+    struct iovec *msgs = malloc(nmsgs * sizeof(*msgs));
+    if (!msgs)
+      return -1;
+    for (uint32_t j = 0; j < nmsgs; ++j)
+    {
+      if (body_len < 4 || get_u32(body) > body_len - 4)
+      {
+        free(msgs);
+        return -1;
+      }
+      uint32_t msg_len = get_u32(body);
+      iove_setup(msgs, j, msg_len, (void *)(body + 4));
+      body += 4 + msg_len;
+      body_len -= 4 + msg_len;
+    }
+    int32_t result = op_send_batch(t, msgs, nmsgs);
+    free(msgs);
+    if (out_u32(c, result) < 0)
+      return -1;
+  }
+  return body_len ? -1 : 0;
+}
+
+// Appends the packed batch of each (topic len, messages, topic, batch len,
+// batch) in the body
+// Sends the offset of the first message of each topic, or its error
+static int out_send_packed(
+    connection *c,
+    int by_id,
+    const uint8_t *body,
+    uint32_t body_len,
+    uint32_t ntopics)
+{
+  for (uint32_t i = 0; i < ntopics; ++i)
+  {
+    if (body_len < 8)
+      return -1;
+    uint32_t nmsgs = get_u32(body + 4);
+    topic *t;
+    ssize_t name_len =
+        find_topic(c, by_id, get_u32(body), body + 8, body_len - 8, &t);
+    if (name_len < 0 || body_len - 8 - name_len < 4)
+      return -1;
+    uint32_t batch_len = get_u32(body + 8 + name_len);
+    body += 8 + name_len + 4;
+    body_len -= 8 + name_len + 4;
+    if (batch_len > body_len)
+      return -1;
+
+    // The messages the run says it has have to be the ones in the batch
+    int32_t result = OP_SM_FAIL;
+    if (batch_len >= 8 && get_u32(body + 4) == nmsgs)
+      result = op_send_packed(t, body, batch_len);
+    if (out_u32(c, result) < 0)
+      return -1;
+    body += batch_len;
+    body_len -= batch_len;
+  }
+  return body_len ? -1 : 0;
+}
+
+// Sends the number of items, the length of each one with the index of the
+// first message wanted if it is a packed batch (FETCH_PLAIN otherwise), and
+// then all of them, so messages stored together in a file go out in a
+// single piece. Packed batches go as they are, once.
+// Returns the bytes of the items sent, -1 on error
+static ssize_t out_fetch(
+    connection *c,
+    topic *t,
+    uint32_t offset,
+    uint32_t max_msgs,
+    uint32_t max_bytes)
+{
+  message msgs[FETCH_MAX_MSGS];
+  int fd;
+  if (max_msgs > FETCH_MAX_MSGS)
+    max_msgs = FETCH_MAX_MSGS;
+  int n = op_fetch(t, offset, msgs, max_msgs, max_bytes, &fd);
+  int32_t low;
+  if (!n && (low = op_low_offset(t)) >= 0 && offset < (uint32_t)low)
+  {
+    uint32_t gone[2] = {htonl(FETCH_GONE), htonl(low)};
+    return out_copy(c, gone, sizeof(gone));
+  }
+  int nitems = 0;
+  for (int i = 0; i < n; ++i)
+    if (!nitems || !op_same_batch(&msgs[nitems - 1], &msgs[i]))
+      msgs[nitems++] = msgs[i];
+
+  // obuf may not be aligned for a uint32_t here
+  uint8_t *dst = out_reserve(c, 4 + 8 * nitems);
+  if (!dst)
+    return -1;
+  uint32_t v_net = htonl(nitems);
+  memcpy(dst, &v_net, 4);
+  for (int i = 0; i < nitems; ++i)
+  {
+    message *m = &msgs[i];
+    uint32_t item[2] = {
+        htonl(m->packed_len ? m->packed_len : m->len),
+        htonl(m->packed_len ? m->packed_index : FETCH_PLAIN)};
+    memcpy(dst + 4 + 8 * i, item, 8);
+  }
+  if (out_commit(c, 4 + 8 * nitems) < 0)
+    return -1;
+  ssize_t bytes = 0;
+  for (int i = 0; i < nitems; ++i)
+  {
+    if (out_stored(c, &msgs[i], fd) < 0)
+      return -1;
+    bytes += msgs[i].packed_len ? msgs[i].packed_len : msgs[i].len;
+  }
+  return bytes;
+}
+
+// Sends a FETCH response for each (topic len, offset, topic) in the body,
+// max_bytes is for all of them
+static int out_fetch_all(
+    connection *c,
+    int by_id,
+    const uint8_t *body,
+    uint32_t body_len,
+    uint32_t ntopics,
+    uint32_t max_msgs,
+    uint32_t max_bytes)
+{
+  size_t bytes = 0;
+  for (uint32_t i = 0; i < ntopics; ++i)
+  {
+    if (body_len < 8)
+      return -1;
+    uint32_t offset = get_u32(body + 4);
+    topic *t;
+    ssize_t name_len =
+        find_topic(c, by_id, get_u32(body), body + 8, body_len - 8, &t);
+    if (name_len < 0)
+      return -1;
+    body += 8 + name_len;
+    body_len -= 8 + name_len;
+
+    // Once there is nothing left, the rest get an empty response
+    ssize_t n;
+    if (bytes >= max_bytes)
+      n = out_u32(c, 0);
+    else
+      n = out_fetch(c, t, offset, max_msgs, max_bytes - bytes);
+    if (n < 0)
+      return -1;
+    bytes += n;
+  }
+  return body_len ? -1 : 0;
+}
+
+// Stream frames are the stream id, the offset and the length of the
+// message, followed by the message
+static int out_frame(connection *c, uint32_t id, uint32_t offset, uint32_t len)
+{
+  uint32_t frame[3] = {htonl(id), htonl(offset), htonl(len)};
+  return out_copy(c, frame, sizeof(frame));
+}
+
+static stream *find_stream(connection *c, uint32_t id)
+{
+  stream *s = c->streams;
+  while (s && s->id != id)
+    s = s->next;
+  return s;
+}
+
+// Runs a complete request, req points to its opcode
+// Returns 0 if OK, 1 if it has to wait (the connection is parked), -1 if
+// the connection should be dropped
+static int conn_execute(connection *c, const uint8_t *req)
+{
+  uint8_t op = req[0] & ~OP_BY_ID;
+  int by_id = req[0] & OP_BY_ID;
+  const uint8_t *hdr = req + 1;
+  const uint8_t *body = hdr + header_size(op);
+
+  // Responses would get mixed with the frames
+  if (c->streams && op != OP_STREAM && op != OP_CREDIT)
+    return -1;
+
+  // Before anything stored is looked at
+  conn_enter(c);
+
+  // The body goes on after the topic name
+  topic *t = 0;
+  if (on_topic(op))
+  {
+    ssize_t name_len = find_topic(
+        c,
+        by_id,
+        get_u32(hdr),
+        body,
+        body_size(req[0], hdr),
+        &t);
+    if (name_len < 0)
+      return -1;
+    body += name_len;
+  }
+
+  switch (op)
+  {
+  case OP_CREATE_TOPIC:
+  {
+    uint32_t topic_len = get_u32(hdr);
+    if (!valid_str(body, topic_len))
+      return -1;
+    char *topic = malloc(topic_len); // free()d in hmap_destroy
+    if (!topic)
+      return -1;
+    memcpy(topic, body, topic_len);
+    uint8_t result = op_create_topic(c->topics, topic);
+    return out_copy(c, &result, 1);
+  }
+  case OP_NTOPICS:
+    return out_u32(c, op_ntopics(c->topics));
+  case OP_TOPIC_ID:
+  {
+    uint32_t topic_len = get_u32(hdr);
+    if (!valid_str(body, topic_len))
+      return -1;
+    return out_u32(c, op_topic_id(c->topics, (const char *)body));
+  }
+  case OP_SEND_MSG:
+    return out_u32(c, op_send_msg(t, body, get_u32(hdr + 4)));
+  case OP_SEND_BATCH:
+    return out_send_batch(c, by_id, body, get_u32(hdr), get_u32(hdr + 4));
+  case OP_SEND_PACKED:
+    return out_send_packed(c, by_id, body, get_u32(hdr), get_u32(hdr + 4));
+  case OP_TOPIC_STATS:
+  {
+    // Both all ones if no such topic
+    uint64_t raw = UINT64_MAX;
+    uint64_t stored = UINT64_MAX;
+    op_topic_stats(t, &raw, &stored);
+    uint32_t v[4] = {
+        htonl(raw >> 32),
+        htonl(raw),
+        htonl(stored >> 32),
+        htonl(stored)};
+    return out_copy(c, v, sizeof(v));
+  }
+  case OP_MSG_LEN:
+    return out_u32(c, op_msg_len(t, get_u32(hdr + 4)));
+  case OP_END_OFF:
+    return out_u32(c, op_end_offset(t));
+  case OP_LOW_OFF:
+    return out_u32(c, op_low_offset(t));
+  case OP_SET_RETENTION:
+  {
+    retention r;
+    r.max_msgs = get_u32(hdr + 4);
+    r.max_bytes = (uint64_t)get_u32(hdr + 8) << 32 | get_u32(hdr + 12);
+    r.max_age_ms = get_u32(hdr + 16);
+    return out_u32(c, op_set_retention(t, &r));
+  }
+  case OP_POLL:
+    return out_poll(c, t, get_u32(hdr + 4));
+  case OP_FETCH:
+  {
+    // It gives the bytes sent, which are not a status
+    ssize_t sent = out_fetch(
+        c,
+        t,
+        get_u32(hdr + 4),
+        get_u32(hdr + 8),
+        get_u32(hdr + 12));
+    return sent < 0 ? -1 : 0;
+  }
+  case OP_FETCH_ALL:
+    return out_fetch_all(
+        c,
+        by_id,
+        body,
+        get_u32(hdr),
+        get_u32(hdr + 4),
+        get_u32(hdr + 8),
+        get_u32(hdr + 12));
+  case OP_POLL_WAIT:
+  {
+    uint32_t offset = get_u32(hdr + 4);
+    uint32_t max_wait = get_u32(hdr + 8);
+    if (!c->wait_over && max_wait)
+    {
+      // Whoever wakes us may do it as soon as we are in the wait list
+      __atomic_store_n(&c->wait_state, WS_PARKED, __ATOMIC_RELEASE);
+      if (op_poll_wait(t, offset, max_wait, &c->w))
+      {
+        c->parked = 1;
+        return 1;
+      }
+      __atomic_store_n(&c->wait_state, WS_NONE, __ATOMIC_RELEASE);
+    }
+    c->wait_over = 0;
+    return out_poll(c, t, offset);
+  }
+  case OP_STREAM:
+  {
+    uint32_t id = get_u32(hdr + 4);
+    uint32_t offset = get_u32(hdr + 8);
+    uint32_t credit = get_u32(hdr + 12);
+    if (find_stream(c, id))
+      return -1;
+    if (!t)
+      return out_frame(c, id, offset, STREAM_NOTOPIC);
+    stream *s = calloc(1, sizeof(*s));
+    if (!s)
+      return -1;
+    s->t = t;
+    s->c = c;
+    s->id = id;
+    s->offset = offset;
+    s->credit = credit;
+    s->w.wake = stream_wake;
+    s->next = c->streams;
+    c->streams = s;
+    return 0; // The owner pumps it
+  }
+  case OP_CREDIT:
+  {
+    stream *s = find_stream(c, get_u32(hdr));
+    if (s)
+      s->credit += get_u32(hdr + 4);
+    return 0;
+  }
+  case OP_COMMIT:
+  {
+    uint32_t topic_len = get_u32(hdr);
+    uint32_t client_len = get_u32(hdr + 4);
+    uint32_t offset = get_u32(hdr + 8);
+    const uint8_t *client = body + topic_len;
+    if (!valid_str(body, topic_len) || !valid_str(client, client_len))
+      return -1;
+    int8_t result = op_commit(
+        c->dir_commit,
+        (const char *)client,
+        (const char *)body,
+        offset);
+    return out_copy(c, &result, 1);
+  }
+  case OP_COMMITED:
+  {
+    uint32_t topic_len = get_u32(hdr);
+    uint32_t client_len = get_u32(hdr + 4);
+    const uint8_t *client = body + topic_len;
+    if (!valid_str(body, topic_len) || !valid_str(client, client_len))
+      return -1;
+    return out_u32(
+        c,
+        op_commited(c->dir_commit, (const char *)client, (const char *)body));
+  }
+  default:
+    return -1;
+  }
+}
+
+// Reserves room in its topic for the payload of the SEND_MSG at req, so it
+// is received right there. Without such a topic, or room, the request is
+// answered right away and its payload dropped as it arrives
+// Returns 0 if OK, 1 if the request has to go the usual way, -1 if the
+// connection should be dropped
+static int direct_begin(connection *c, const uint8_t *req)
+{
+  const uint8_t *hdr = req + 1;
+  size_t hdr_size = header_size(req[0]);
+  topic *t;
+  if (find_topic(
+          c,
+          req[0] & OP_BY_ID,
+          get_u32(hdr),
+          hdr + hdr_size,
+          c->pneed - 1 - hdr_size,
+          &t) < 0)
+    return -1;
+  void *msg;
+  int status = op_reserve(t, get_u32(hdr + 4), &msg, &c->direct_hold);
+  if (status > 0)
+    return 1;
+  c->direct_topic = t;
+  c->direct_len = get_u32(hdr + 4);
+  c->direct_got = 0;
+  if (!status)
+  {
+    c->direct = msg;
+    c->pstate = PS_PAYLOAD;
+    return 0;
+  }
+  c->pstate = PS_DISCARD;
+  return out_u32(c, status);
+}
+
+// Leaves the epoch once nothing pending points to stored messages
+static void conn_leave(connection *c)
+{
+  if (!conn_has_output(c))
+    epoch_exit(&c->reader);
+}
+
+// Takes len more bytes of the payload, they are already in place
+// Returns 0 if OK, -1 if the connection should be dropped
+static int direct_received(connection *c, size_t len)
+{
+  c->direct_got += len;
+  if (c->direct_got < c->direct_len)
+    return 0;
+  c->pstate = PS_OPCODE;
+  conn_enter(c);
+  int result = out_u32(
+      c,
+      op_send_reserved(
+          c->direct_topic,
+          c->direct,
+          c->direct_len,
+          c->direct_hold));
+  conn_leave(c);
+  return result;
+}
+
+static ssize_t conn_run(connection *c, const uint8_t *buf, size_t len)
+{
+  size_t pos = 0; // Start of the current request
+  while (!c->parked)
+  {
+    size_t avail = len - pos;
+    switch (c->pstate)
+    {
+    case PS_OPCODE:
+    {
+      if (avail < 1)
+        return pos;
+      int hdr_size = header_size(buf[pos]);
+      if (hdr_size < 0) // If we receive an invalid opcode, we break the
+        return -1;      // connection
+      c->op = buf[pos];
+      c->pneed = 1 + hdr_size;
+      c->pstate = PS_HEADER;
+      break;
+    }
+    case PS_HEADER:
+    {
+      if (avail < c->pneed)
+        return pos;
+      const uint8_t *hdr = buf + pos + 1;
+      if ((c->op & ~OP_BY_ID) == OP_SEND_MSG && !c->streams &&
+          get_u32(hdr + 4) >= DIRECT_MIN)
+      {
+        // The topic name first, if any
+        c->pneed += c->op & OP_BY_ID ? 0 : get_u32(hdr);
+        c->pstate = PS_TOPIC;
+        break;
+      }
+      c->pneed += body_size(c->op, hdr);
+      c->pstate = PS_BODY;
+      break;
+    }
+    case PS_TOPIC:
+    {
+      if (avail < c->pneed)
+        return pos;
+      int status = direct_begin(c, buf + pos);
+      if (status < 0)
+        return -1;
+      if (status > 0)
+      {
+        c->pneed += get_u32(buf + pos + 5);
+        c->pstate = PS_BODY;
+        break;
+      }
+      pos += c->pneed;
+      break;
+    }
+    case PS_PAYLOAD:
+    {
+      size_t take = c->direct_len - c->direct_got;
+      if (take > avail)
+        take = avail;
+      memcpy(c->direct + c->direct_got, buf + pos, take);
+      pos += take;
+      if (direct_received(c, take) < 0)
+        return -1;
+      if (c->pstate == PS_PAYLOAD)
+        return pos;
+      break;
+    }
+    case PS_DISCARD:
+    {
+      size_t take = c->direct_len - c->direct_got;
+      if (take > avail)
+        take = avail;
+      pos += take;
+      c->direct_got += take;
+      if (c->direct_got < c->direct_len)
+        return pos;
+      c->pstate = PS_OPCODE;
+      break;
+    }
+    case PS_BODY:
+    {
+      if (avail < c->pneed)
+        return pos;
+      int status = conn_execute(c, buf + pos);
+      if (status < 0)
+        return -1;
+      if (status > 0) // Parked, it runs again from the start when woken
+        return pos;
+      pos += c->pneed;
+      c->pstate = PS_OPCODE;
+      break;
+    }
+    }
+  }
+  return pos;
+}
+
+ssize_t conn_process(connection *c, const uint8_t *buf, size_t len)
+{
+  ssize_t used = conn_run(c, buf, len);
+  conn_leave(c);
+  return used;
+}
+
+// Keeps the bytes from the first request not run on, which may be an
+// incomplete one or a parked one with whole requests after it
+static int conn_keep(connection *c, const uint8_t *data, size_t len)
+{
+  size_t cap = c->pneed > IN_MIN_CAP ? c->pneed : IN_MIN_CAP;
+  if (cap < len)
+    cap = len;
+  c->in = malloc(cap);
+  if (!c->in)
+    return -1;
+  c->in_cap = cap;
+  c->in_len = len;
+  memcpy(c->in, data, len);
+  return 0;
+}
+
+// Runs the requests completed by the last in_len increase
+static int conn_process_in(connection *c)
+{
+  ssize_t used = conn_process(c, c->in, c->in_len);
+  if (used < 0)
+    return -1;
+  c->in_len -= used;
+  if (c->in_len)
+    memmove(c->in, c->in + used, c->in_len);
+  else
+  {
+    free(c->in);
+    c->in = 0;
+    c->in_cap = 0;
+  }
+  return 0;
+}
+
+// Makes room in the input buffer for the rest of the incomplete request
+static int conn_grow_in(connection *c, size_t extra)
+{
+  size_t want = c->pneed > c->in_len + extra ? c->pneed : c->in_len + extra;
+  if (want > c->in_cap)
+  {
+    uint8_t *nin = realloc(c->in, want);
+    if (!nin)
+      return -1;
+    c->in = nin;
+    c->in_cap = want;
+  }
+  return 0;
+}
+
+int conn_feed(connection *c, const uint8_t *data, size_t len)
+{
+  if (!c->in_len)
+  {
+    // Nothing pending, requests are run right from data
+    ssize_t used = conn_process(c, data, len);
+    if (used < 0)
+      return -1;
+    return (size_t)used < len ? conn_keep(c, data + used, len - used) : 0;
+  }
+  if (conn_grow_in(c, len) < 0)
+    return -1;
+  memcpy(c->in + c->in_len, data, len);
+  c->in_len += len;
+  return conn_process_in(c);
+}
+
+int conn_read(connection *c, uint8_t *scratch, size_t scratch_sz)
+{
+  if (c->pstate == PS_PAYLOAD)
+  {
+    uint8_t *dst = c->direct + c->direct_got;
+    ssize_t nread = recv(c->cfd, dst, c->direct_len - c->direct_got, 0);
+    if (nread == 0)
+      return -1;
+    if (nread < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return direct_received(c, nread);
+  }
+  if (!c->in_len)
+  {
+    ssize_t nread = recv(c->cfd, scratch, scratch_sz, 0);
+    if (nread == 0)
+      return -1;
+    if (nread < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return conn_feed(c, scratch, nread);
+  }
+
+  // Continue the incomplete request right in its buffer, which has to be
+  // large enough for all of it
+  if (conn_grow_in(c, IN_MIN_CAP) < 0)
+    return -1;
+  ssize_t nread = recv(c->cfd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+  if (nread == 0)
+    return -1;
+  if (nread < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  c->in_len += nread;
+  return conn_process_in(c);
+}
+
+int conn_settle(connection *c)
+{
+  while (c->parked)
+  {
+    int expected = WS_PARKED;
+    if (__atomic_compare_exchange_n(
+            &c->wait_state,
+            &expected,
+            WS_RELEASED,
+            0,
+            __ATOMIC_ACQ_REL,
+            __ATOMIC_ACQUIRE))
+      return 1;
+    // Woken already, nobody is going to call on_wake
+    if (conn_resume(c) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int conn_resume(connection *c)
+{
+  __atomic_store_n(&c->wait_state, WS_NONE, __ATOMIC_RELEASE);
+  c->parked = 0;
+  c->wait_over = 1;
+  return conn_process_in(c);
+}
+
+int conn_pump(connection *c)
+{
+  int result = 0;
+  conn_enter(c);
+  for (stream *s = c->streams; s && !result; s = s->next)
+  {
+    if (s->waiting)
+    {
+      if (!__atomic_load_n(&s->woken, __ATOMIC_ACQUIRE))
+        continue;
+      s->waiting = 0;
+    }
+    while (s->credit > 0)
+    {
+      int fd;
+      message m;
+      int found = op_poll(s->t, s->offset, &m, &fd) == 0;
+      int32_t low;
+      if (!found && s->offset < (uint32_t)(low = op_low_offset(s->t)))
+      {
+        // Dropped, the client sees where it goes on in the next frame
+        s->offset = low;
+        continue;
+      }
+      if (!found)
+      {
+        // Up to date, the next append wakes us
+        __atomic_store_n(&s->woken, 0, __ATOMIC_RELAXED);
+        if (op_poll_wait(s->t, s->offset, 0, &s->w))
+        {
+          s->waiting = 1;
+          break;
+        }
+        continue; // Appended meanwhile
+      }
+      if (out_frame(c, s->id, s->offset, m.len) < 0 ||
+          out_message(c, &m, fd) < 0)
+      {
+        result = -1;
+        break;
+      }
+      s->credit -= m.len;
+      ++s->offset;
+    }
+  }
+  conn_leave(c);
+  return result;
+}
+
+void conn_stop_streams(connection *c)
+{
+  for (stream *s = c->streams; s; s = s->next)
+    if (s->waiting)
+    {
+      wait_cancel(&s->w);
+      s->waiting = 0;
+    }
+}
+
+int conn_has_output(connection *c)
+{
+  return c->out_first < c->out_count;
+}
+
+int conn_out_iov(connection *c, struct iovec *iov, int max)
+{
+  int iov_count = 0;
+  for (size_t i = c->out_first; i < c->out_count && iov_count < max; ++i)
+  {
+    out_seg *s = &c->out[i];
+    if (s->fd >= 0)
+      break;
+    iove_setup(
+        iov,
+        iov_count++,
+        s->len,
+        s->ext ? (void *)s->ext : c->obuf + s->off);
+  }
+  return iov_count;
+}
+
+void conn_out_consume(connection *c, size_t sent)
+{
+  while (sent > 0)
+  {
+    out_seg *s = &c->out[c->out_first];
+    if (sent >= s->len)
+    {
+      sent -= s->len;
+      ++c->out_first;
+    }
+    else
+    {
+      if (s->fd >= 0)
+        s->pos += sent;
+      else if (s->ext)
+        s->ext = (const uint8_t *)s->ext + sent;
+      else
+        s->off += sent;
+      s->len -= sent;
+      sent = 0;
+    }
+  }
+  if (c->out_first == c->out_count)
+  {
+    c->out_first = c->out_count = 0;
+    c->obuf_len = 0;
+    epoch_exit(&c->reader);
+  }
+  else
+    epoch_hold(&c->reader, c->out[c->out_first].epoch);
+}
+
+int conn_flush(connection *c)
+{
+  while (conn_has_output(c))
+  {
+    struct iovec iov[IOV_BATCH];
+    int iov_count = conn_out_iov(c, iov, IOV_BATCH);
+
+    // Everything but messages from topic files goes with writev
+    ssize_t sent;
+    if (iov_count)
+      sent = writev(c->cfd, iov, iov_count);
+    else
+    {
+      out_seg *s = &c->out[c->out_first];
+      off_t pos = s->pos;
+      sent = sendfile(c->cfd, s->fd, &pos, s->len);
+      if (sent == 0) // The file is shorter than it should
+        return -1;
+    }
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    conn_out_consume(c, sent);
+  }
+  return 1;
+}
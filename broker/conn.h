@@ -0,0 +1,199 @@
+/*
+ * Connection state, for every broker mode.
+ * Bytes are fed to a connection as they arrive, it keeps track of where it
+ * is in the current request, runs every complete request and queues the
+ * responses until the socket can take them.
+ * Requests are run right from the buffer they were read into: topics and
+ * other strings are handed to the operations in place. Large SEND_MSG
+ * payloads for topics kept in memory are not even buffered, they are
+ * received right where the topic keeps them.
+ * Responses point right at the stored messages, so a connection is in an
+ * epoch (see epoch.h) from the time it runs a request until its pending
+ * response is all sent. Every queued piece remembers the epoch it was
+ * queued in, and the connection stays in the one of the oldest piece
+ * still pending.
+ */
+
+#ifndef _CONN_H
+#define _CONN_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "epoch.h"
+#include "hmap.h"
+#include "ops.h"
+#include "wait.h"
+
+// How much we try to read from a socket at once
+#define READ_CHUNK (64 * 1024)
+// Maximum number of iovecs given to a single writev
+#define IOV_BATCH (64)
+
+// Request parser states
+#define PS_OPCODE (0) // Waiting for the opcode
+#define PS_HEADER (1) // Waiting for the fixed size fields of the request
+#define PS_BODY (2)   // Waiting for the variable size fields (topic, msg...)
+#define PS_TOPIC (3)  // Waiting for the topic of a SEND_MSG, its payload is
+                      // received right into the topic if it can
+#define PS_PAYLOAD (4) // Receiving that payload
+#define PS_DISCARD (5) // Dropping that payload, the request was answered
+                       // without it
+
+// Smallest payload received right into its topic, smaller ones mostly come
+// in the same read as their header anyway
+#define DIRECT_MIN (4096)
+
+typedef struct OUT_SEG out_seg;
+struct OUT_SEG
+{
+  const void *ext; // Bytes not owned by the connection (zero copy), or
+                   // 0 if the bytes live in the connection's obuf
+  size_t off;      // Offset in obuf, only when ext is 0
+  size_t len;
+  int fd;          // If not -1, the bytes are at pos in this file, and go
+  off_t pos;       // to the socket with sendfile
+  uint64_t epoch;  // The connection was in when it was queued
+};
+
+typedef struct CONNECTION connection;
+
+// Messages of a topic pushed to the client as they are appended, as long as
+// it has credit for them
+typedef struct STREAM stream;
+struct STREAM
+{
+  connection *c;
+  uint32_t id; // Chosen by the client, it comes in every frame
+  uint32_t offset; // Next message to push
+  // Bytes the client can still take, a message goes out if there is any
+  // credit left, so this can end up negative
+  int64_t credit;
+  waiter w;
+  int waiting; // w is in the topic's wait list
+  int woken;   // Set by whoever woke w
+  stream *next;
+  topic *t;
+};
+
+// Called when a connection its owner let go of while parked can run again
+// It may run on any thread, the owner has to get back to the connection on
+// its own and call conn_resume
+typedef void (*conn_wake_t)(connection *c);
+
+struct CONNECTION
+{
+  int cfd;
+  hmap *topics;
+  char *dir_commit;
+  void *owner; // Whoever drives the connection (an event loop...)
+  int copy_files; // Messages stored in files are read into obuf instead of
+                  // sent with sendfile, for those who only use conn_out_iov
+  epoch_reader reader;
+  uint64_t epoch; // Last one entered
+
+  // Parser
+  int pstate;
+  uint8_t op;
+  size_t pneed; // Bytes the current request needs to move to the next state
+
+  // SEND_MSG payload being received right where the topic keeps it, or
+  // dropped
+  topic *direct_topic;
+  arena_block *direct_hold;
+  uint8_t *direct;
+  uint32_t direct_len;
+  uint32_t direct_got;
+
+  // Bytes of an incomplete request, kept between reads
+  // Only allocated while there is such a request, idle connections
+  // own no buffers
+  uint8_t *in;
+  size_t in_len;
+  size_t in_cap;
+
+  // Long polls
+  // While a request waits in w, it stays at the start of the input and
+  // nothing after it runs
+  waiter w;
+  int parked;
+  int wait_over;  // The parked request ran out of waiting, it runs right away
+  int wait_state; // Shared with whoever wakes w
+  conn_wake_t on_wake;
+
+  // Streams, once a connection opens one it only takes stream requests
+  // When a stream is woken on some other thread, on_notify asks the owner to
+  // call conn_pump, only once until the owner clears notify_pending
+  stream *streams;
+  int notify_pending;
+  conn_wake_t on_notify;
+  // For the owner to keep notified connections in a list, and to remember
+  // it is done with one that is still there
+  connection *next_notified;
+  int closed;
+
+  // Pending response
+  out_seg *out;
+  size_t out_first; // First segment not completely sent
+  size_t out_count;
+  size_t out_cap;
+  uint8_t *obuf;
+  size_t obuf_len;
+  size_t obuf_cap;
+};
+
+connection *conn_create(int cfd, hmap *topics, char *dir_commit);
+void conn_destroy(connection *c);
+
+// Reads whatever is available on the socket, and runs every
+// complete request received. scratch is used for reading when the connection
+// has no partial request pending, so it can be shared by all the connections
+// of a thread.
+// Returns 0 if the connection is still usable, -1 if it should be closed
+int conn_read(connection *c, uint8_t *scratch, size_t scratch_sz);
+
+// Runs every complete request in data, keeping whatever is left of an
+// incomplete request for the next call. For bytes read by someone else.
+// Returns 0 if the connection is still usable, -1 if it should be closed
+int conn_feed(connection *c, const uint8_t *data, size_t len);
+
+// Runs every complete request in buf, updating the parser state.
+// Returns the number of bytes consumed, -1 on protocol error
+ssize_t conn_process(connection *c, const uint8_t *buf, size_t len);
+
+// To be called by the owner when it is done with the connection for now
+// If the connection is parked, the owner lets go of it until on_wake
+// Returns 1 if parked, 0 if not (it may have been resumed here), -1 if it
+// should be closed
+int conn_settle(connection *c);
+
+// Runs the parked request once it has been woken, and whatever is after it
+// Returns 0 if the connection is still usable, -1 if it should be closed
+int conn_resume(connection *c);
+
+// Queues the frames of every stream with new messages and credit for them
+// Returns 0 if OK, -1 if the connection should be closed
+int conn_pump(connection *c);
+
+// Takes the streams out of their wait lists, after that nobody calls
+// on_notify anymore. If notify_pending is still set, the owner still has to
+// get the connection from wherever on_notify left it before destroying it.
+void conn_stop_streams(connection *c);
+
+// Sends as much of the pending response as the socket takes.
+// Returns 1 if everything was sent, 0 if there is still output pending,
+// -1 on error
+int conn_flush(connection *c);
+
+int conn_has_output(connection *c);
+
+// Fills iov with up to max pieces of the pending response, returns how many
+// Stops at the first piece that has to be sent from a file
+int conn_out_iov(connection *c, struct iovec *iov, int max);
+
+// Drops the first sent bytes of the pending response
+void conn_out_consume(connection *c, size_t sent);
+
+#endif // _CONN_H
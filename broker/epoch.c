@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+typedef struct RETIRED retired;
+struct RETIRED
+{
+  void *p;
+  void *arg;
+  epoch_free_t free_fn;
+  uint64_t epoch; // Readers from this one on never saw it
+  retired *next;
+};
+
+static uint64_t global_epoch = 1;
+
+// Registered readers
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_reader *readers;
+
+// Oldest first
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired *retired_first;
+static retired *retired_last;
+
+void epoch_register(epoch_reader *r)
+{
+  r->epoch = 0;
+  r->prev = 0;
+  pthread_mutex_lock(&readers_lock);
+  r->next = readers;
+  if (readers)
+    readers->prev = r;
+  readers = r;
+  pthread_mutex_unlock(&readers_lock);
+}
+
+void epoch_unregister(epoch_reader *r)
+{
+  pthread_mutex_lock(&readers_lock);
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    readers = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  pthread_mutex_unlock(&readers_lock);
+}
+
+uint64_t epoch_enter(epoch_reader *r, uint64_t hold)
+{
+  // Once the epoch we are in is still the current one after we are seen
+  // in it, whatever gets retired from then on waits for us, and what was
+  // retired before is out of our reach
+  uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  while (1)
+  {
+    __atomic_store_n(&r->epoch, hold && hold < e ? hold : e,
+                     __ATOMIC_SEQ_CST);
+    uint64_t now = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    if (now == e)
+      return e;
+    e = now;
+  }
+}
+
+void epoch_hold(epoch_reader *r, uint64_t e)
+{
+  __atomic_store_n(&r->epoch, e, __ATOMIC_RELEASE);
+}
+
+void epoch_exit(epoch_reader *r)
+{
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+int epoch_retire(void *p, void *arg, epoch_free_t free_fn)
+{
+  retired *rt = malloc(sizeof(*rt));
+  if (!rt)
+    return -1;
+  rt->p = p;
+  rt->arg = arg;
+  rt->free_fn = free_fn;
+  rt->next = 0;
+  // Readers that get this epoch or a later one entered after p was out of
+  // their reach
+  rt->epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&retired_lock);
+  if (retired_last)
+    retired_last->next = rt;
+  else
+    retired_first = rt;
+  retired_last = rt;
+  pthread_mutex_unlock(&retired_lock);
+  return 0;
+}
+
+void epoch_reclaim(void)
+{
+  // Items retired in an epoch can go once every reader in is in that one or
+  // a later one
+  uint64_t oldest = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&readers_lock);
+  for (epoch_reader *r = readers; r; r = r->next)
+  {
+    uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (e && e < oldest)
+      oldest = e;
+  }
+  pthread_mutex_unlock(&readers_lock);
+
+  // Retired in epoch order, the first one still visible ends it
+  pthread_mutex_lock(&retired_lock);
+  retired *done = 0;
+  retired **done_end = &done;
+  while (retired_first && retired_first->epoch <= oldest)
+  {
+    *done_end = retired_first;
+    done_end = &retired_first->next;
+    retired_first = retired_first->next;
+  }
+  *done_end = 0;
+  if (!retired_first)
+    retired_last = 0;
+  pthread_mutex_unlock(&retired_lock);
+
+  while (done)
+  {
+    retired *next = done->next;
+    done->free_fn(done->p, done->arg);
+    free(done);
+    done = next;
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * Epoch based reclamation, for memory readers reach without locks.
+ * A reader enters before it looks at shared memory and exits once it is
+ * done with everything it found there. Whoever takes something out of
+ * reach retires it, and it is freed once every reader that could have
+ * seen it has exited.
+ * Readers here are connections: they stay in while their pending response
+ * still points to stored messages, in the epoch of the oldest of them.
+ */
+
+#ifndef _EPOCH_H
+#define _EPOCH_H 1
+
+#include <stdint.h>
+
+typedef struct EPOCH_READER epoch_reader;
+struct EPOCH_READER
+{
+  uint64_t epoch; // When it entered, 0 if out
+  epoch_reader *prev;
+  epoch_reader *next;
+};
+
+typedef void (*epoch_free_t)(void *p, void *arg);
+
+void epoch_register(epoch_reader *r);
+// It must be out
+void epoch_unregister(epoch_reader *r);
+
+// Enters the current epoch, and returns it. A reader still holding
+// something it got in an older epoch passes that one as hold (0 if none),
+// and stays in that one
+uint64_t epoch_enter(epoch_reader *r, uint64_t hold);
+
+// Moves to e, an epoch it entered, once it holds nothing older
+void epoch_hold(epoch_reader *r, uint64_t e);
+
+void epoch_exit(epoch_reader *r);
+
+// free_fn(p, arg) runs once no reader can still have p. What p is must be
+// out of reach of readers that enter from now on
+// Returns 0 if OK, -1 on error, then p is leaked
+int epoch_retire(void *p, void *arg, epoch_free_t free_fn);
+
+// Frees whatever was retired and nobody can have anymore
+void epoch_reclaim(void);
+
+#endif // _EPOCH_H
@@ -0,0 +1,318 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "conn.h"
+#include "pool.h"
+#include "evloop.h"
+
+// Events handled per epoll_wait
+#define MAX_EVENTS (256)
+
+typedef struct EVLOOP evloop;
+struct EVLOOP
+{
+  int epfd;
+  pthread_t thid;
+  pool *workers; // If set, connections are served by the pool, not the loop
+  hmap *topics;
+  char *dir_commit;
+
+  // Connections whose streams have new messages, the eventfd tells the loop
+  int efd;
+  pthread_mutex_t notify_lock;
+  connection *notified;
+};
+
+static evloop *loops;
+static int nloops;
+static unsigned next_loop; // Shared by the accept threads
+
+static void close_connection(connection *c)
+{
+  conn_stop_streams(c);
+  // Still in the loop's list, it goes away from there
+  if (__atomic_load_n(&c->notify_pending, __ATOMIC_ACQUIRE))
+  {
+    c->closed = 1;
+    epoll_ctl(((evloop *)c->owner)->epfd, EPOLL_CTL_DEL, c->cfd, 0);
+    return;
+  }
+  printf("[%3d] Connection closed\n", c->cfd);
+  conn_destroy(c);
+}
+
+// Sets what we wait for on the connection: we stop reading requests
+// while the responses of the previous ones did not leave
+// With a pool, the connection is reported once and rearmed once served, so
+// a single worker at a time handles it
+static int watch(evloop *l, connection *c, int op)
+{
+  struct epoll_event ev;
+  ev.events = conn_has_output(c) ? EPOLLOUT : EPOLLIN;
+  if (l->workers)
+    ev.events |= EPOLLONESHOT;
+  ev.data.ptr = c;
+  return epoll_ctl(l->epfd, op, c->cfd, &ev);
+}
+
+// Back from a long poll: the connection was out of epoll while parked, now
+// it gets reported as soon as it is writable
+static void wake_conn(connection *c)
+{
+  evloop *l = c->owner;
+  struct epoll_event ev;
+  ev.events = EPOLLOUT;
+  if (l->workers)
+    ev.events |= EPOLLONESHOT;
+  ev.data.ptr = c;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->cfd, &ev) < 0)
+    close_connection(c);
+}
+
+// Leaves the connection for the loop to pump its streams, from any thread
+// Streaming connections are always served by the loop, even with a pool:
+// whoever pumps a stream is the one being notified when it is woken
+static void notify_conn(connection *c)
+{
+  evloop *l = c->owner;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&l->notify_lock);
+  c->next_notified = l->notified;
+  l->notified = c;
+  pthread_mutex_unlock(&l->notify_lock);
+  if (write(l->efd, &one, sizeof(one)) < 0)
+    perror("write");
+}
+
+// Runs whatever the connection was reported ready for
+// Only the loop pumps streams
+// Returns 0 if it has to be watched again, 1 if it was parked and is out of
+// epoll, -1 if it should be closed
+static int run_events(
+    evloop *l,
+    connection *c,
+    uint32_t events,
+    uint8_t *scratch,
+    int on_loop)
+{
+  if (c->parked)
+  {
+    if (conn_resume(c) < 0)
+      return -1;
+  }
+  else if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    if (conn_read(c, scratch, READ_CHUNK) < 0)
+      return -1;
+  if (on_loop && conn_pump(c) < 0)
+    return -1;
+  if (conn_has_output(c) && conn_flush(c) < 0)
+    return -1;
+
+  if (c->parked)
+  {
+    // Out of epoll until woken, before anyone can wake it
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->cfd, 0);
+    int status = conn_settle(c);
+    if (status)
+      return status;
+    // It was woken meanwhile and ran here
+    if (conn_has_output(c) && conn_flush(c) < 0)
+      return -1;
+    return watch(l, c, EPOLL_CTL_ADD) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+// Connection served by the loop
+static void serve_on_loop(
+    evloop *l,
+    connection *c,
+    uint32_t events,
+    uint8_t *scratch)
+{
+  int had_output = conn_has_output(c);
+  int was_parked = c->parked;
+  int status = run_events(l, c, events, scratch, 1);
+  if (status < 0)
+    close_connection(c);
+  else if (!status &&
+           (l->workers || was_parked || had_output != conn_has_output(c)) &&
+           watch(l, c, EPOLL_CTL_MOD) < 0)
+    close_connection(c);
+}
+
+// Connections with new stream messages
+static void serve_notified(evloop *l, uint8_t *scratch)
+{
+  uint64_t n;
+  if (read(l->efd, &n, sizeof(n)) < 0)
+    return;
+
+  pthread_mutex_lock(&l->notify_lock);
+  connection *c = l->notified;
+  l->notified = 0;
+  pthread_mutex_unlock(&l->notify_lock);
+
+  while (c)
+  {
+    connection *next = c->next_notified;
+    __atomic_store_n(&c->notify_pending, 0, __ATOMIC_RELEASE);
+    if (c->closed)
+    {
+      printf("[%3d] Connection closed\n", c->cfd);
+      conn_destroy(c);
+    }
+    else
+      serve_on_loop(l, c, 0, scratch);
+    c = next;
+  }
+}
+
+// Pool task for a ready connection
+static void serve(void *parg_conn)
+{
+  static __thread uint8_t *scratch; // One per worker
+  connection *c = parg_conn;
+  evloop *l = c->owner;
+
+  if (!scratch && !(scratch = malloc(READ_CHUNK)))
+  {
+    close_connection(c);
+    return;
+  }
+  // Reported writable if it had output, readable otherwise
+  uint32_t events = conn_has_output(c) ? EPOLLOUT : EPOLLIN;
+  int status = run_events(l, c, events, scratch, 0);
+  if (status < 0)
+    close_connection(c);
+  else if (!status && c->streams)
+  {
+    // The loop keeps it from now on, it rearms it after the first pump
+    __atomic_store_n(&c->notify_pending, 1, __ATOMIC_RELEASE);
+    notify_conn(c);
+  }
+  else if (!status && watch(l, c, EPOLL_CTL_MOD) < 0)
+    close_connection(c);
+}
+
+static void *evloop_run(void *parg_loop)
+{
+  evloop *l = parg_loop;
+  uint8_t *scratch = malloc(READ_CHUNK);
+  struct epoll_event evs[MAX_EVENTS];
+
+  if (!scratch)
+  {
+    perror("malloc");
+    return 0;
+  }
+
+  while (1)
+  {
+    int nev = epoll_wait(l->epfd, evs, MAX_EVENTS, -1);
+    if (nev < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+    // Notified connections are served last, they may be destroyed there
+    // while the batch still has events for them
+    int notified = 0;
+    for (int i = 0; i < nev; ++i)
+    {
+      connection *c = evs[i].data.ptr;
+      if (!c)
+        notified = 1;
+      else if (c->closed)
+        continue;
+      else if (l->workers && !c->streams)
+      {
+        if (pool_submit(l->workers, serve, c) < 0)
+          close_connection(c);
+      }
+      else
+        serve_on_loop(l, c, evs[i].events, scratch);
+    }
+    if (notified)
+      serve_notified(l, scratch);
+  }
+  free(scratch);
+  return 0;
+}
+
+int evloop_start(int n, pool *workers, hmap *topics, char *dir_commit)
+{
+  loops = calloc(n, sizeof(*loops));
+  if (!loops)
+    return -1;
+  nloops = n;
+  for (int i = 0; i < n; ++i)
+  {
+    loops[i].workers = workers;
+    loops[i].topics = topics;
+    loops[i].dir_commit = dir_commit;
+    loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epfd < 0)
+    {
+      perror("epoll_create1");
+      return -1;
+    }
+    pthread_mutex_init(&loops[i].notify_lock, 0);
+    loops[i].efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (loops[i].efd < 0 ||
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].efd, &ev) < 0)
+    {
+      perror("eventfd");
+      return -1;
+    }
+    if (pthread_create(&loops[i].thid, 0, evloop_run, &loops[i]))
+    {
+      perror("pthread_create");
+      return -1;
+    }
+    pthread_detach(loops[i].thid);
+  }
+  return 0;
+}
+
+int evloop_add(int cfd)
+{
+  evloop *l = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % nloops];
+
+  int flags = fcntl(cfd, F_GETFL);
+  if (flags < 0 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    close(cfd);
+    return -1;
+  }
+
+  connection *c = conn_create(cfd, l->topics, l->dir_commit);
+  if (!c)
+  {
+    close(cfd);
+    return -1;
+  }
+  c->owner = l;
+  c->on_wake = wake_conn;
+  c->on_notify = notify_conn;
+  printf("[%3d] Connection opened\n", cfd);
+  if (watch(l, c, EPOLL_CTL_ADD) < 0)
+  {
+    conn_destroy(c);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Event driven broker mode: a fixed set of threads, each one running an
+ * epoll loop over non blocking client sockets.
+ * The loops can also just watch the sockets and leave the requests to a
+ * worker pool.
+ */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H 1
+
+#include "hmap.h"
+#include "pool.h"
+
+// Starts nloops event loop threads
+// If workers is not NULL, ready connections are served by its threads
+// Returns 0 if OK, -1 on error
+int evloop_start(int nloops, pool *workers, hmap *topics, char *dir_commit);
+
+// Hands a newly accepted connection to one of the loops
+// Returns 0 if OK, -1 on error (cfd is closed then)
+int evloop_add(int cfd);
+
+#endif // _EVLOOP_H
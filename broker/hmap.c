@@ -0,0 +1,151 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hmap.h"
+
+// Initial number of slots, always a power of two
+#define HMAP_MIN_CAP (64)
+
+typedef struct HMAP_SLOT hmap_slot;
+struct HMAP_SLOT
+{
+  // Set last, once hash and value are there, a slot is taken from then on
+  char *key;
+  uint64_t hash;
+  void *value;
+};
+
+// Open addressing with linear probing, kept at most half full
+typedef struct HMAP_TABLE hmap_table;
+struct HMAP_TABLE
+{
+  size_t cap;
+  // The one this replaced: readers that got to it before the table grew
+  // may still be in it, so it goes away with the map
+  hmap_table *prev;
+  hmap_slot slots[];
+};
+
+struct HMAP
+{
+  hmap_table *table;
+  uint32_t size;
+  pthread_mutex_t put_lock;
+};
+
+// FNV-1a
+static uint64_t hash_key(const char *key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *key; ++key)
+    h = (h ^ (uint8_t)*key) * 0x100000001b3ULL;
+  return h;
+}
+
+static hmap_table *table_create(size_t cap)
+{
+  hmap_table *t = calloc(1, sizeof(*t) + cap * sizeof(t->slots[0]));
+  if (t)
+    t->cap = cap;
+  return t;
+}
+
+// Fills the first free slot for the hash, the table is not full
+static void table_fill(hmap_table *t, char *key, uint64_t hash, void *value)
+{
+  size_t i = hash & (t->cap - 1);
+  while (t->slots[i].key)
+    i = (i + 1) & (t->cap - 1);
+  t->slots[i].hash = hash;
+  t->slots[i].value = value;
+  __atomic_store_n(&t->slots[i].key, key, __ATOMIC_RELEASE);
+}
+
+hmap *hmap_create(void)
+{
+  hmap *m = malloc(sizeof(*m));
+  if (!m)
+    return 0;
+  m->table = table_create(HMAP_MIN_CAP);
+  if (!m->table)
+  {
+    free(m);
+    return 0;
+  }
+  m->size = 0;
+  pthread_mutex_init(&m->put_lock, 0);
+  return m;
+}
+
+void hmap_destroy(hmap *m, hmap_release_t release)
+{
+  hmap_table *t = m->table;
+  for (size_t i = 0; release && i < t->cap; ++i)
+    if (t->slots[i].key)
+      release(t->slots[i].key, t->slots[i].value);
+  while (t)
+  {
+    hmap_table *prev = t->prev;
+    free(t);
+    t = prev;
+  }
+  pthread_mutex_destroy(&m->put_lock);
+  free(m);
+}
+
+int hmap_put(hmap *m, char *key, void *value)
+{
+  uint64_t hash = hash_key(key);
+  int result = -1;
+  pthread_mutex_lock(&m->put_lock);
+  if (hmap_get(m, key))
+    goto end;
+
+  hmap_table *t = m->table;
+  if (2 * (m->size + 1) > t->cap)
+  {
+    // Readers keep using the old table until they see the new one, which
+    // has everything the old one had
+    hmap_table *nt = table_create(2 * t->cap);
+    if (!nt)
+    {
+      result = -2;
+      goto end;
+    }
+    for (size_t i = 0; i < t->cap; ++i)
+      if (t->slots[i].key)
+        table_fill(nt, t->slots[i].key, t->slots[i].hash, t->slots[i].value);
+    nt->prev = t;
+    __atomic_store_n(&m->table, nt, __ATOMIC_RELEASE);
+    t = nt;
+  }
+  table_fill(t, key, hash, value);
+  __atomic_store_n(&m->size, m->size + 1, __ATOMIC_RELAXED);
+  result = 0;
+
+end:
+  pthread_mutex_unlock(&m->put_lock);
+  return result;
+}
+
+void *hmap_get(hmap *m, const char *key)
+{
+  uint64_t hash = hash_key(key);
+  hmap_table *t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE);
+  size_t i = hash & (t->cap - 1);
+  char *k;
+  // Slots are never emptied, the first empty one ends the search
+  while ((k = __atomic_load_n(&t->slots[i].key, __ATOMIC_ACQUIRE)))
+  {
+    if (t->slots[i].hash == hash && !strcmp(k, key))
+      return t->slots[i].value;
+    i = (i + 1) & (t->cap - 1);
+  }
+  return 0;
+}
+
+uint32_t hmap_size(hmap *m)
+{
+  return __atomic_load_n(&m->size, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+/*
+ * Map of strings to values, for the topics of the broker.
+ * Entries are only added, never removed, which lets lookups run without
+ * locks: they never wait for a writer, not even while the table grows.
+ * Writers take a lock among themselves.
+ * Like map.h, it keeps references to the keys and values, not copies.
+ */
+
+#ifndef _HMAP_H
+#define _HMAP_H 1
+
+#include <stdint.h>
+
+typedef struct HMAP hmap;
+
+typedef void (*hmap_release_t)(void *key, void *value);
+
+// Returns the map, or NULL on error
+hmap *hmap_create(void);
+
+// Calls release for every entry, unless it is NULL
+// Nobody may be using the map anymore
+void hmap_destroy(hmap *m, hmap_release_t release);
+
+// Adds the entry, value can't be NULL
+// Returns 0 if OK, -1 if the key is there already, -2 on error
+int hmap_put(hmap *m, char *key, void *value);
+
+// Returns the value of the key, NULL if it is not there
+void *hmap_get(hmap *m, const char *key);
+
+uint32_t hmap_size(hmap *m);
+
+#endif // _HMAP_H
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "msglog.h"
+
+// Index entries per index chunk
+#define INDEX_CHUNK (1024)
+
+// Where a message is. The ones after it, up to the next entry, follow it
+// Only one of base and pos is kept, pos is only looked at without a base.
+// It stays absolute: at most one message in MSGLOG_SPARSE has an entry,
+// next to the 4 bytes of length each one has, and where a message does not
+// follow the one before it is in another arena block or segment, which
+// can be anywhere
+typedef struct INDEX_ENTRY index_entry;
+struct INDEX_ENTRY
+{
+  uint32_t offset;
+  uint32_t packed_len;
+  uint32_t packed_index;
+  uint32_t in_memory; // at is the base, and not the pos
+  uint64_t at;
+};
+
+typedef struct LEN_CHUNK len_chunk;
+struct LEN_CHUNK
+{
+  uint32_t first_entry; // Index entry of its first message
+  uint32_t lens[MSGLOG_CHUNK];
+};
+
+// Chunks of the log, only the directory moves when it grows
+typedef struct MSGLOG_DIR msglog_dir;
+struct MSGLOG_DIR
+{
+  uint32_t cap;
+  // The one this replaced: readers that got to it before it grew may still
+  // be in it, so it goes away with the log
+  msglog_dir *prev;
+  void *chunks[];
+};
+
+struct MSG_LOG
+{
+  msglog_dir *dir;   // Of len_chunk
+  msglog_dir *index; // Of index_entry[INDEX_CHUNK]
+  uint32_t nchunks;
+  uint32_t nindex;
+  uint32_t gap;
+  uint32_t end;       // Next offset to append, only seen by the appender
+  uint32_t published; // Messages readers can see
+  uint32_t low;       // Oldest message kept
+  uint32_t retired;   // Chunks trimmed, only seen by the one trimming
+  uint32_t entries;   // Index entries, only seen by the appender
+  uint32_t entries_published;
+  uint32_t index_retired;
+  uint32_t last_entry; // Offset of the last entry
+  message last;        // Last one appended
+};
+
+static msglog_dir *dir_create(uint32_t n)
+{
+  uint32_t cap = 16;
+  while (cap <= n)
+    cap *= 2;
+  msglog_dir *dir = calloc(1, sizeof(*dir) + cap * sizeof(dir->chunks[0]));
+  if (dir)
+    dir->cap = cap;
+  return dir;
+}
+
+static void dir_destroy(msglog_dir *dir, uint32_t retired, uint32_t n)
+{
+  for (uint32_t i = retired; i < n; ++i)
+    free(dir->chunks[i]);
+  while (dir)
+  {
+    msglog_dir *prev = dir->prev;
+    free(dir);
+    dir = prev;
+  }
+}
+
+// Adds chunk as the nth one of *dirp, growing it if needed
+static int dir_add(msglog_dir **dirp, uint32_t n, void *chunk)
+{
+  msglog_dir *dir = *dirp;
+  if (n == dir->cap)
+  {
+    uint32_t ncap = dir->cap * 2;
+    msglog_dir *ndir = malloc(sizeof(*ndir) + ncap * sizeof(ndir->chunks[0]));
+    if (!ndir)
+      return -1;
+    ndir->cap = ncap;
+    ndir->prev = dir;
+    for (uint32_t i = 0; i < n; ++i)
+      ndir->chunks[i] = dir->chunks[i];
+    __atomic_store_n(dirp, ndir, __ATOMIC_RELEASE);
+    dir = ndir;
+  }
+  dir->chunks[n] = chunk;
+  return 0;
+}
+
+msg_log *msglog_create(uint32_t low, uint32_t gap)
+{
+  msg_log *l = calloc(1, sizeof(msg_log));
+  if (!l)
+    return 0;
+  // The chunks below the one of low are never there
+  l->nchunks = l->retired = low / MSGLOG_CHUNK;
+  if (!(l->dir = dir_create(l->nchunks)) || !(l->index = dir_create(0)))
+  {
+    free(l->dir);
+    free(l);
+    return 0;
+  }
+  l->gap = gap;
+  l->end = l->published = l->low = low;
+  return l;
+}
+
+void msglog_destroy(msg_log *l)
+{
+  dir_destroy(l->dir, l->retired, l->nchunks);
+  dir_destroy(l->index, l->index_retired, l->nindex);
+  free(l);
+}
+
+static index_entry *entry_at(msglog_dir *index, uint32_t k)
+{
+  index_entry *chunk = index->chunks[k / INDEX_CHUNK];
+  return &chunk[k % INDEX_CHUNK];
+}
+
+// Moves m to the message after it, which is len bytes long, when there is
+// no index entry for that one
+static void step(message *m, size_t len, uint32_t gap)
+{
+  if (m->packed_len)
+  {
+    ++m->packed_index;
+    return;
+  }
+  if (m->base)
+    m->base = (uint8_t *)m->base + len + gap;
+  if (m->pos)
+    m->pos += len + gap;
+}
+
+// Whether m is where the message after prev would be without an entry
+static int follows(const message *prev, const message *m, uint32_t gap)
+{
+  message next = *prev;
+  step(&next, prev->len, gap);
+  return m->base == next.base && m->pos == next.pos &&
+         m->packed_len == next.packed_len &&
+         m->packed_index == next.packed_index;
+}
+
+int32_t msglog_append(msg_log *l, const message *m)
+{
+  // Offsets are int32_t in the protocol
+  if (l->end >= INT32_MAX || m->len > UINT32_MAX)
+    return -1;
+  // The first message of a chunk always has an entry, its search starts
+  // there
+  int new_chunk = l->end / MSGLOG_CHUNK == l->nchunks;
+  int new_entry = new_chunk || l->end - l->last_entry >= MSGLOG_SPARSE ||
+                  !follows(&l->last, m, l->gap);
+  if (new_entry && l->entries / INDEX_CHUNK == l->nindex)
+  {
+    index_entry *chunk = malloc(INDEX_CHUNK * sizeof(*chunk));
+    if (!chunk || dir_add(&l->index, l->nindex, chunk) < 0)
+    {
+      free(chunk);
+      return -1;
+    }
+    ++l->nindex;
+  }
+  if (new_chunk)
+  {
+    len_chunk *chunk = malloc(sizeof(*chunk));
+    if (!chunk || dir_add(&l->dir, l->nchunks, chunk) < 0)
+    {
+      free(chunk);
+      return -1;
+    }
+    chunk->first_entry = l->entries;
+    ++l->nchunks;
+  }
+
+  if (new_entry)
+  {
+    index_entry *e = entry_at(l->index, l->entries++);
+    e->offset = l->end;
+    e->packed_len = m->packed_len;
+    e->packed_index = m->packed_index;
+    e->in_memory = m->base != 0;
+    e->at = m->base ? (uint64_t)(uintptr_t)m->base : (uint64_t)m->pos;
+    l->last_entry = l->end;
+  }
+  len_chunk *chunk = l->dir->chunks[l->end / MSGLOG_CHUNK];
+  chunk->lens[l->end % MSGLOG_CHUNK] = m->len;
+  l->last = *m;
+  return l->end++;
+}
+
+void msglog_publish(msg_log *l)
+{
+  __atomic_store_n(&l->entries_published, l->entries, __ATOMIC_RELEASE);
+  __atomic_store_n(&l->published, l->end, __ATOMIC_RELEASE);
+}
+
+int msglog_read(msg_log *l, uint32_t offset, message *msgs, int n)
+{
+  // Whatever was there when the message was published is seen after this
+  uint32_t end = __atomic_load_n(&l->published, __ATOMIC_ACQUIRE);
+  if (offset >= end || offset < __atomic_load_n(&l->low, __ATOMIC_SEQ_CST))
+    return 0;
+  uint32_t entries = __atomic_load_n(&l->entries_published, __ATOMIC_ACQUIRE);
+  msglog_dir *dir = __atomic_load_n(&l->dir, __ATOMIC_ACQUIRE);
+  msglog_dir *index = __atomic_load_n(&l->index, __ATOMIC_ACQUIRE);
+
+  // The last entry not past offset. Entries of the chunk start at its
+  // first one, and the one wanted is no further than a message each
+  len_chunk *chunk = dir->chunks[offset / MSGLOG_CHUNK];
+  uint32_t lo = chunk->first_entry;
+  uint32_t hi = lo + offset % MSGLOG_CHUNK;
+  if (hi > entries - 1)
+    hi = entries - 1;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (entry_at(index, mid)->offset <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  // Walks from it to offset, and on for the rest
+  uint32_t next = lo;
+  uint32_t at = entry_at(index, lo)->offset;
+  message m = {0};
+  int got = 0;
+  for (; at < end && got < n; ++at)
+  {
+    if (at % MSGLOG_CHUNK == 0)
+      chunk = dir->chunks[at / MSGLOG_CHUNK];
+    if (next < entries && entry_at(index, next)->offset == at)
+    {
+      index_entry *e = entry_at(index, next++);
+      m.packed_len = e->packed_len;
+      m.packed_index = e->packed_index;
+      m.base = e->in_memory ? (void *)(uintptr_t)e->at : 0;
+      m.pos = e->in_memory ? 0 : (off_t)e->at;
+    }
+    else
+      step(&m, m.len, l->gap);
+    m.len = chunk->lens[at % MSGLOG_CHUNK];
+    if (at >= offset)
+      msgs[got++] = m;
+  }
+  return got;
+}
+
+int msglog_get(msg_log *l, uint32_t offset, message *m)
+{
+  return msglog_read(l, offset, m, 1) == 1 ? 0 : -1;
+}
+
+uint32_t msglog_end(msg_log *l)
+{
+  return __atomic_load_n(&l->published, __ATOMIC_ACQUIRE);
+}
+
+uint32_t msglog_low(msg_log *l)
+{
+  return __atomic_load_n(&l->low, __ATOMIC_SEQ_CST);
+}
+
+static void chunk_free(void *chunk, void *arg)
+{
+  free(chunk);
+}
+
+void msglog_trim(msg_log *l, uint32_t low)
+{
+  // Readers that enter from now on don't go below it
+  __atomic_store_n(&l->low, low, __ATOMIC_SEQ_CST);
+  // Appends only add chunks at the end, the directory has the ones below
+  msglog_dir *dir = __atomic_load_n(&l->dir, __ATOMIC_ACQUIRE);
+  while ((l->retired + 1) * (uint64_t)MSGLOG_CHUNK <= low &&
+         epoch_retire(dir->chunks[l->retired], 0, chunk_free) == 0)
+    ++l->retired;
+
+  // Searches start at the first entry of the chunk of low. Once nothing
+  // from low on is there, the next search starts at an entry yet to come
+  if (low >= __atomic_load_n(&l->published, __ATOMIC_ACQUIRE))
+    return;
+  dir = __atomic_load_n(&l->dir, __ATOMIC_ACQUIRE);
+  msglog_dir *index = __atomic_load_n(&l->index, __ATOMIC_ACQUIRE);
+  len_chunk *chunk = dir->chunks[low / MSGLOG_CHUNK];
+  while ((l->index_retired + 1) * (uint64_t)INDEX_CHUNK <= chunk->first_entry &&
+         epoch_retire(index->chunks[l->index_retired], 0, chunk_free) == 0)
+    ++l->index_retired;
+}
@@ -0,0 +1,64 @@
+/*
+ * Messages of a topic, by offset.
+ * Payloads are mostly back to back where they are stored, so only the
+ * length of each message is kept, in fixed size chunks found through a
+ * directory of chunks. A sparse index has where the messages are: one
+ * entry at least every MSGLOG_SPARSE messages, and one for each message
+ * that does not follow the one before (a new packed batch, a new segment).
+ * Looking up an offset is a binary search of the index entries of its
+ * chunk and a walk of the lengths from the entry found, so a message takes
+ * a few bytes here instead of a whole message struct.
+ * Chunks never move once allocated.
+ * A single thread at a time appends, readers take no locks: they only see
+ * the messages published, which they see whole. Trimming retires the
+ * chunks left behind (see epoch.h), readers have to be in an epoch.
+ */
+
+#ifndef _MSGLOG_H
+#define _MSGLOG_H 1
+
+#include <stdint.h>
+
+#include "ops.h"
+
+// Messages per chunk
+#define MSGLOG_CHUNK (4096)
+// Index entries are at most this many messages apart
+#define MSGLOG_SPARSE (16)
+
+typedef struct MSG_LOG msg_log;
+
+// Returns an empty log that starts at offset low, or NULL on error
+// Messages not packed together follow one another if each one starts gap
+// bytes after the end of the one before
+msg_log *msglog_create(uint32_t low, uint32_t gap);
+
+void msglog_destroy(msg_log *l);
+
+// Appends a copy of m, returns its offset, -1 on error
+// Nobody sees it until it is published
+int32_t msglog_append(msg_log *l, const message *m);
+
+// Makes every message appended so far visible to readers
+void msglog_publish(msg_log *l);
+
+// Copies to msgs up to n published messages from offset on
+// Returns how many, 0 if there is none at offset or it is below the low
+// offset
+int msglog_read(msg_log *l, uint32_t offset, message *msgs, int n);
+
+// Copies the published message at offset to m
+// Returns 0 if OK, -1 if there is none or it is below the low offset
+int msglog_get(msg_log *l, uint32_t offset, message *m);
+
+// Offset after the last published message
+uint32_t msglog_end(msg_log *l);
+
+// Offset of the oldest message kept
+uint32_t msglog_low(msg_log *l);
+
+// Drops the messages below low, which can't be past the end. Only one
+// thread at a time trims
+void msglog_trim(msg_log *l, uint32_t low);
+
+#endif // _MSGLOG_H
@@ -0,0 +1,1095 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include "comun.h"
+#include "arena.h"
+#include "epoch.h"
+#include "msglog.h"
+#include "seglog.h"
+#include "ops.h"
+
+// Batches up to this many messages are put together on the stack
+#define LOCAL_BATCH (16)
+// How often the reaper looks for messages to drop
+#define REAP_MS (1000)
+// Ages are kept for runs of messages appended within this time
+#define MARK_MS (1000)
+
+// Lock for the commit directory
+// We don't want two threads to access it at the same time
+// It probably won't cause problems most of the time
+// But if both happen to access the same client/topic, then
+// there is going to be problems, and we don't want them
+static pthread_mutex_t dir_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Where topic logs go, 0 if messages are kept in memory
+static char *storage_dir;
+// Logs are mapped, stored messages are read from memory
+static int storage_mapped;
+static seglog_sync storage_sync;
+static unsigned next_topic_dir;
+
+// Topics by ID, IDs are given in creation order
+// The array grows in chunks that never move, so it is read without locks
+#define ID_CHUNK (4096)
+#define ID_CHUNKS (1024) // Up to 4M topics
+static topic **topic_ids[ID_CHUNKS];
+static uint32_t next_topic_id;
+// Taken to give an ID, so once a topic is found by name it has one
+static pthread_mutex_t topic_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// For topics created from now on
+static retention default_retention;
+
+// Messages from offset on were appended at ms or later, the ones up to the
+// next mark less than MARK_MS later
+typedef struct TIME_MARK time_mark;
+struct TIME_MARK
+{
+  uint32_t offset;
+  int64_t ms;
+};
+
+struct TOPIC
+{
+  uint32_t id;
+  msg_log *msgs;
+  arena *payloads; // Where messages in memory are
+  // Topic files, 0 if the messages are in memory
+  // Appends take the lock, so records are in the files in offset order
+  // Readers don't take it, they only see the messages published
+  seg_log *log;
+  char *dir; // Where its files are, with its name and retention
+  pthread_mutex_t append_lock;
+  wait_list waiters; // Long polls for the next messages
+  // Bytes of the messages appended, and what they take stored, they only
+  // differ for packed batches. Updated with the append lock
+  uint64_t raw_bytes;
+  uint64_t stored_bytes;
+
+  // Retention, with the append lock
+  retention keep;
+  // Ring of the times messages were appended, only kept with a max age
+  time_mark *marks;
+  uint32_t marks_first;
+  uint32_t nmarks;
+  uint32_t marks_cap;
+  // Only seen by the reaper
+  uint64_t dropped_bytes; // Stored bytes of the messages below the low one
+};
+
+static FILE *open_commit_file(
+    char *dir_commit,
+    const char *client,
+    const char *topic,
+    char *mode)
+{
+  // We need to join th three parameters with '/'
+  size_t dc_len = strlen(dir_commit);
+  size_t client_len = strlen(client);
+  size_t topic_len = strlen(topic);
+  char path[dc_len + client_len + topic_len + 2 + 1]; // + 2 '/' + 1 NULL term
+
+  strcpy(path, dir_commit);
+  strcat(path, "/");
+  strcat(path, client);
+  strcat(path, "/");
+
+  // path is now the path of the directory of the client
+  DIR *dc = opendir(path);
+
+  if (!dc)
+  {
+    // Directory does not exist, we need to make it
+    if (mkdir(path, 0700) < 0)
+      return 0;
+  }
+  else
+    closedir(dc);
+
+  // We are sure the client dir exists
+  strcat(path, topic);
+
+  FILE *f = fopen(path, mode);
+  return f;
+}
+
+// Client and topic names end up as path components, we don't want them
+// to escape the commit directory
+static int valid_commit_names(const char *client, const char *topic)
+{
+  return client[0] &&
+         topic[0] &&
+         client[0] != '.' &&
+         topic[0] != '.' &&
+         !strchr(client, '/') &&
+         !strchr(topic, '/');
+}
+
+static int64_t now_ms()
+{
+  // A run of appends gets one mark, the coarse clock is enough
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void destroy_topic(topic *t)
+{
+  if (t->msgs)
+    msglog_destroy(t->msgs);
+  if (t->payloads)
+    arena_destroy(t->payloads);
+  if (t->log)
+    seglog_close(t->log, 0);
+  pthread_mutex_destroy(&t->append_lock);
+  wait_list_destroy(&t->waiters);
+  free(t->marks);
+  free(t->dir);
+  free(t);
+}
+
+void ops_default_retention(const retention *r)
+{
+  default_retention = *r;
+}
+
+// Bytes a stored message takes, a packed batch counts with its first one
+static size_t stored_len(const message *m)
+{
+  if (!m->packed_len)
+    return m->len;
+  return m->packed_index ? 0 : m->packed_len;
+}
+
+// Drops the oldest messages of the topic that retention does not keep
+static void reap_topic(topic *t, int64_t now)
+{
+  pthread_mutex_lock(&t->append_lock);
+  retention keep = t->keep;
+  uint32_t end = msglog_end(t->msgs);
+  uint64_t stored = t->stored_bytes;
+  // The messages of a mark were appended within MARK_MS of it, up to the
+  // next mark
+  uint32_t aged = 0;
+  while (t->nmarks && keep.max_age_ms &&
+         t->marks[t->marks_first].ms + MARK_MS <= now - keep.max_age_ms)
+  {
+    t->marks_first = (t->marks_first + 1) % t->marks_cap;
+    --t->nmarks;
+    aged = t->nmarks ? t->marks[t->marks_first].offset : end;
+  }
+  if (!keep.max_age_ms)
+    t->nmarks = 0;
+  // Topics that stopped getting messages have theirs synced by now
+  if (t->log)
+    seglog_sync_due(t->log);
+  pthread_mutex_unlock(&t->append_lock);
+
+  uint32_t low = msglog_low(t->msgs);
+  uint32_t new_low = aged > low ? aged : low;
+  if (keep.max_msgs && end - new_low > keep.max_msgs)
+    new_low = end - keep.max_msgs;
+  // Only we trim, the messages from low on stay there meanwhile
+  message m;
+  for (; low < end && msglog_get(t->msgs, low, &m) == 0; ++low)
+  {
+    if (low >= new_low &&
+        (!keep.max_bytes || stored - t->dropped_bytes <= keep.max_bytes))
+      break;
+    t->dropped_bytes += stored_len(&m);
+  }
+  if (low == msglog_low(t->msgs))
+    return;
+
+  msglog_trim(t->msgs, low);
+  if (t->payloads)
+    arena_trim(t->payloads, low);
+  // Only whole segments go from the files
+  if (t->log)
+    seglog_trim(t->log, low);
+}
+
+static void *reaper(void *arg)
+{
+  while (1)
+  {
+    usleep(REAP_MS * 1000);
+    int64_t now = now_ms();
+    uint32_t ntopics = __atomic_load_n(&next_topic_id, __ATOMIC_RELAXED);
+    for (uint32_t id = 0; id < ntopics; ++id)
+    {
+      topic *t = op_topic_by_id(id);
+      if (t)
+        reap_topic(t, now);
+    }
+    epoch_reclaim();
+  }
+  return 0;
+}
+
+int ops_reaper_start(void)
+{
+  pthread_t thid;
+  if (pthread_create(&thid, 0, reaper, 0))
+  {
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_detach(thid);
+  return 0;
+}
+
+// Notes when the next message is appended, if the topic has a max age
+// Called with the append lock. Without room for the mark, the messages go
+// with the ones of the previous mark
+static void mark_time(topic *t)
+{
+  if (!t->keep.max_age_ms)
+    return;
+  int64_t now = now_ms();
+  if (t->nmarks &&
+      now - t->marks[(t->marks_first + t->nmarks - 1) % t->marks_cap].ms <
+          MARK_MS)
+    return;
+  if (t->nmarks == t->marks_cap)
+  {
+    uint32_t ncap = t->marks_cap ? t->marks_cap * 2 : 16;
+    time_mark *nmarks = malloc(ncap * sizeof(*nmarks));
+    if (!nmarks)
+      return;
+    for (uint32_t i = 0; i < t->nmarks; ++i)
+      nmarks[i] = t->marks[(t->marks_first + i) % t->marks_cap];
+    free(t->marks);
+    t->marks = nmarks;
+    t->marks_first = 0;
+    t->marks_cap = ncap;
+  }
+  time_mark *m = &t->marks[(t->marks_first + t->nmarks++) % t->marks_cap];
+  m->offset = msglog_end(t->msgs);
+  m->ms = now;
+}
+
+// Checks the header of a packed batch, returns the number of messages in it
+// and their total length once unpacked, or -1 if it is not valid
+static int packed_check(const uint8_t *batch, uint32_t batch_len, size_t *raw)
+{
+  uint32_t v[2];
+  if (batch_len < PACKED_HDR_SIZE(0))
+    return -1;
+  memcpy(v, batch, 8);
+  uint32_t codec = ntohl(v[0]);
+  uint32_t n = ntohl(v[1]);
+  if ((codec != CODEC_NONE && codec != CODEC_LZ) || !n ||
+      n > (batch_len - PACKED_HDR_SIZE(0)) / 4)
+    return -1;
+  *raw = 0;
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    memcpy(v, batch + PACKED_HDR_SIZE(i), 4);
+    *raw += ntohl(v[0]);
+  }
+  // Not compressed, the messages have to be all there
+  if (codec == CODEC_NONE && *raw != batch_len - PACKED_HDR_SIZE(n))
+    return -1;
+  return n;
+}
+
+// A topic with no messages yet, and no ID
+// Returns 0 on error
+static topic *topic_new(void)
+{
+  topic *t = malloc(sizeof(*t)); // free()d in topic_release
+  if (!t)
+    return 0;
+  t->msgs = 0;
+  t->payloads = 0;
+  t->log = 0;
+  t->dir = 0;
+  pthread_mutex_init(&t->append_lock, 0);
+  wait_list_init(&t->waiters);
+  t->raw_bytes = 0;
+  t->stored_bytes = 0;
+  t->keep = default_retention;
+  t->marks = 0;
+  t->marks_first = 0;
+  t->nmarks = 0;
+  t->marks_cap = 0;
+  t->dropped_bytes = 0;
+  return t;
+}
+
+// Gives the topic the next ID and puts it in the map as name
+// Returns 0 if OK, -1 if the name is taken, -2 on error
+static int topic_add(hmap *topics, char *name, topic *t)
+{
+  // The ID is only used up if the topic gets into the map
+  pthread_mutex_lock(&topic_ids_lock);
+  t->id = next_topic_id;
+  topic **chunk = 0;
+  if (t->id < ID_CHUNK * ID_CHUNKS)
+  {
+    chunk = topic_ids[t->id / ID_CHUNK];
+    if (!chunk && (chunk = calloc(ID_CHUNK, sizeof(*chunk))))
+      __atomic_store_n(&topic_ids[t->id / ID_CHUNK], chunk, __ATOMIC_RELEASE);
+  }
+  int result = chunk ? hmap_put(topics, name, t) : -2;
+  if (result < 0)
+  {
+    pthread_mutex_unlock(&topic_ids_lock);
+    return result;
+  }
+  __atomic_store_n(&chunk[t->id % ID_CHUNK], t, __ATOMIC_RELEASE);
+  ++next_topic_id;
+  pthread_mutex_unlock(&topic_ids_lock);
+  return 0;
+}
+
+// Record read back from the topic files, see seglog.h
+static int recovered(
+    void *arg,
+    uint32_t offset,
+    off_t pos,
+    const void *rec,
+    uint32_t len,
+    int packed)
+{
+  topic *t = arg;
+  if (!t->msgs)
+  {
+    if (!(t->msgs = msglog_create(offset, SEGLOG_HDR)))
+      return -2;
+    // When they came is not known, they age from now on
+    mark_time(t);
+  }
+  size_t raw = len;
+  int n = packed ? packed_check(rec, len, &raw) : 1;
+  if (n < 0)
+    return -1;
+  for (int i = 0; i < n; ++i)
+  {
+    message m = {0};
+    m.len = len;
+    m.pos = pos;
+    if (storage_mapped)
+      m.base = (void *)rec;
+    if (packed)
+    {
+      uint32_t msg_len;
+      memcpy(&msg_len, (const uint8_t *)rec + PACKED_HDR_SIZE(i), 4);
+      m.len = ntohl(msg_len);
+      m.packed_len = len;
+      m.packed_index = i;
+    }
+    if (msglog_append(t->msgs, &m) < 0)
+      return -2;
+  }
+  t->raw_bytes += raw;
+  t->stored_bytes += len;
+  return n;
+}
+
+// Opens the files of the topic in dir, creating them if they are not there,
+// and brings back the messages in them
+static int topic_open_log(topic *t, const char *dir)
+{
+  uint32_t low;
+  if (!(t->dir = strdup(dir)) ||
+      !(t->log = seglog_open(
+            dir, storage_mapped, &storage_sync, &low, recovered, t)) ||
+      (!t->msgs && !(t->msgs = msglog_create(low, SEGLOG_HDR))))
+    return -1;
+  msglog_publish(t->msgs);
+  return 0;
+}
+
+// Topic directories are numbered, topic names could be anything. The name
+// goes in a file of the directory
+static int write_topic_name(const char *dir, const char *name)
+{
+  char path[strlen(dir) + 8];
+  snprintf(path, sizeof(path), "%s/name", dir);
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+  int ok = fputs(name, f) >= 0;
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+// Returns the name in the topic directory, to be free()d, or 0 if it has
+// none
+static char *read_topic_name(const char *dir)
+{
+  char path[strlen(dir) + 8];
+  snprintf(path, sizeof(path), "%s/name", dir);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char *name = 0;
+  long len;
+  if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 &&
+      fseek(f, 0, SEEK_SET) == 0 && (name = malloc(len + 1)))
+  {
+    if (fread(name, 1, len, f) == (size_t)len && !memchr(name, 0, len))
+      name[len] = 0;
+    else
+    {
+      free(name);
+      name = 0;
+    }
+  }
+  fclose(f);
+  return name;
+}
+
+// Retention set for the topic, in its directory
+// Called with the append lock
+static void write_retention(topic *t)
+{
+  char path[strlen(t->dir) + 16];
+  snprintf(path, sizeof(path), "%s/retention", t->dir);
+  FILE *f = fopen(path, "w");
+  if (!f ||
+      fprintf(f, "%u,%llu,%u\n", t->keep.max_msgs,
+              (unsigned long long)t->keep.max_bytes, t->keep.max_age_ms) < 0 ||
+      fclose(f) != 0)
+    perror(path);
+}
+
+// Leaves keep as it is if the topic directory has no retention
+static void read_retention(const char *dir, retention *keep)
+{
+  char path[strlen(dir) + 16];
+  snprintf(path, sizeof(path), "%s/retention", dir);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  retention r;
+  unsigned long long max_bytes;
+  if (fscanf(f, "%u,%llu,%u", &r.max_msgs, &max_bytes, &r.max_age_ms) == 3)
+  {
+    r.max_bytes = max_bytes;
+    *keep = r;
+  }
+  fclose(f);
+}
+
+static void remove_topic_dir(topic *t, const char *dir)
+{
+  if (t->log)
+    seglog_close(t->log, 1);
+  t->log = 0;
+  char path[strlen(dir) + 8];
+  snprintf(path, sizeof(path), "%s/name", dir);
+  unlink(path);
+  rmdir(dir);
+}
+
+uint8_t op_create_topic(hmap *topics, char *name)
+{
+  topic *t = topic_new();
+  if (!t)
+  {
+    free(name);
+    return OP_CT_FAIL;
+  }
+
+  // Stored, it gets a new directory
+  char dir[storage_dir ? strlen(storage_dir) + 32 : 1];
+  int made = 0;
+  if (storage_dir)
+  {
+    unsigned n = __atomic_fetch_add(&next_topic_dir, 1, __ATOMIC_RELAXED);
+    snprintf(dir, sizeof(dir), "%s/topic-%u", storage_dir, n);
+    made = mkdir(dir, 0700) == 0;
+    if (!made)
+      perror("mkdir");
+  }
+  int added = -2;
+  if ((storage_dir &&
+       (!made || write_topic_name(dir, name) < 0 ||
+        topic_open_log(t, dir) < 0)) ||
+      (!storage_dir &&
+       (!(t->msgs = msglog_create(0, 0)) || !(t->payloads = arena_create()))) ||
+      (added = topic_add(topics, name, t)) < 0)
+  {
+    if (made)
+      remove_topic_dir(t, dir);
+    destroy_topic(t);
+    free(name);
+    return added == -1 ? OP_CT_EXISTS : OP_CT_FAIL;
+  }
+  return OP_CT_SUCCESS;
+}
+
+// Brings back the topic in the directory with that number, if it has one
+static void recover_topic(hmap *topics, unsigned n)
+{
+  char dir[strlen(storage_dir) + 32];
+  snprintf(dir, sizeof(dir), "%s/topic-%u", storage_dir, n);
+  char *name = read_topic_name(dir);
+  if (!name)
+    return;
+  topic *t = topic_new();
+  if (t)
+    read_retention(dir, &t->keep);
+  if (!t || topic_open_log(t, dir) < 0 || topic_add(topics, name, t) < 0)
+  {
+    fprintf(stderr, "%s: topic %s could not be brought back\n", dir, name);
+    if (t)
+      destroy_topic(t);
+    free(name);
+    return;
+  }
+  printf("Topic %s: offsets %u to %u\n", name, msglog_low(t->msgs),
+         msglog_end(t->msgs));
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned *)a;
+  unsigned y = *(const unsigned *)b;
+  return x < y ? -1 : x > y;
+}
+
+int ops_storage_init(
+    const char *dir,
+    int mapped,
+    const seglog_sync *sync,
+    hmap *topics)
+{
+  storage_mapped = mapped;
+  storage_sync = *sync;
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+  {
+    perror("mkdir");
+    return -1;
+  }
+  DIR *d = opendir(dir);
+  if (!d)
+  {
+    perror("opendir");
+    return -1;
+  }
+  if (!(storage_dir = strdup(dir)))
+  {
+    perror("strdup");
+    closedir(d);
+    return -1;
+  }
+  // Topic directories, by number
+  unsigned *nums = 0;
+  int n = 0;
+  int cap = 0;
+  struct dirent *e;
+  while ((e = readdir(d)))
+  {
+    unsigned num;
+    int used = 0;
+    if (sscanf(e->d_name, "topic-%u%n", &num, &used) != 1 ||
+        e->d_name[used])
+      continue;
+    if (num >= next_topic_dir)
+      next_topic_dir = num + 1;
+    if (n == cap)
+    {
+      cap = cap ? cap * 2 : 16;
+      unsigned *nnums = realloc(nums, cap * sizeof(*nnums));
+      if (!nnums)
+      {
+        perror("realloc");
+        closedir(d);
+        free(nums);
+        return -1;
+      }
+      nums = nnums;
+    }
+    nums[n++] = num;
+  }
+  closedir(d);
+  // In the order they were created, they get the IDs they had as long as
+  // none went missing
+  if (n)
+    qsort(nums, n, sizeof(*nums), cmp_unsigned);
+  for (int i = 0; i < n; ++i)
+    recover_topic(topics, nums[i]);
+  free(nums);
+  return 0;
+}
+
+uint32_t op_ntopics(hmap *topics)
+{
+  return hmap_size(topics);
+}
+
+topic *op_topic(hmap *topics, const char *name)
+{
+  return hmap_get(topics, name);
+}
+
+int32_t op_topic_id(hmap *topics, const char *name)
+{
+  pthread_mutex_lock(&topic_ids_lock);
+  topic *t = op_topic(topics, name);
+  pthread_mutex_unlock(&topic_ids_lock);
+  return t ? (int32_t)t->id : -1;
+}
+
+topic *op_topic_by_id(uint32_t id)
+{
+  if (id >= ID_CHUNK * ID_CHUNKS)
+    return 0;
+  topic **chunk = __atomic_load_n(&topic_ids[id / ID_CHUNK], __ATOMIC_ACQUIRE);
+  return chunk ? __atomic_load_n(&chunk[id % ID_CHUNK], __ATOMIC_ACQUIRE) : 0;
+}
+
+int32_t op_send_batch(
+    topic *t,
+    const struct iovec *msgs,
+    int n)
+{
+  if (!t)
+    return OP_SM_NOTOPIC;
+  if (n <= 0)
+    return OP_SM_FAIL;
+
+  // Everything that can fail is done before taking the lock
+  // In memory, the batch goes in one piece of the arena
+  message local[LOCAL_BATCH] = {0};
+  off_t local_pos[LOCAL_BATCH];
+  void *local_at[LOCAL_BATCH];
+  message *ms = n <= LOCAL_BATCH ? local : calloc(n, sizeof(*ms));
+  off_t *pos = 0;
+  void **at = 0;
+  if (t->log)
+    pos = n <= LOCAL_BATCH ? local_pos : malloc(n * sizeof(*pos));
+  if (t->log && storage_mapped)
+    at = n <= LOCAL_BATCH ? local_at : malloc(n * sizeof(*at));
+  size_t total = 0;
+  for (int i = 0; i < n; ++i)
+    total += msgs[i].iov_len;
+  arena_block *block = 0;
+  uint8_t *base = !t->log ? arena_alloc(t->payloads, total, &block) : 0;
+  int ok = ms && (t->log ? pos && (at || !storage_mapped) : base != 0);
+  for (int i = 0; ok && i < n; ++i)
+  {
+    ms[i].len = msgs[i].iov_len;
+    if (!t->log)
+    {
+      ms[i].base = base;
+      memcpy(base, msgs[i].iov_base, msgs[i].iov_len);
+      base += msgs[i].iov_len;
+    }
+  }
+
+  // Messages of a batch get consecutive offsets, and in the files, they
+  // are in offset order
+  int result = OP_SM_FAIL;
+  int appended = 0;
+  if (ok)
+  {
+    pthread_mutex_lock(&t->append_lock);
+    mark_time(t);
+    if (!t->log ||
+        seglog_append(t->log, msglog_end(t->msgs), msgs, n, 0, pos, at) == 0)
+      for (; appended < n; ++appended)
+      {
+        if (pos)
+          ms[appended].pos = pos[appended];
+        if (at)
+          ms[appended].base = at[appended];
+        int32_t offset = msglog_append(t->msgs, &ms[appended]);
+        if (offset < 0)
+          break;
+        t->raw_bytes += ms[appended].len;
+        t->stored_bytes += ms[appended].len;
+        if (!appended)
+          result = offset;
+      }
+    msglog_publish(t->msgs);
+    pthread_mutex_unlock(&t->append_lock);
+  }
+
+  if (block)
+    arena_settle(block, appended ? result + appended - 1 : -1);
+  if (appended)
+    wait_wake(&t->waiters, result + appended);
+  // Room taken in the arena for the ones that failed is lost
+  if (ms != local)
+    free(ms);
+  if (pos != local_pos)
+    free(pos);
+  if (at != local_at)
+    free(at);
+  // If the log failed halfway, the first ones stay there anyway
+  return appended == n ? result : OP_SM_FAIL;
+}
+
+int32_t op_send_msg(
+    topic *t,
+    const void *msg,
+    uint32_t msg_len)
+{
+  struct iovec iov;
+  iove_setup(&iov, 0, msg_len, (void *)msg);
+  return op_send_batch(t, &iov, 1);
+}
+
+int op_reserve(topic *t, uint32_t msg_len, void **msg, arena_block **hold)
+{
+  if (!t)
+    return OP_SM_NOTOPIC;
+  if (t->log)
+    return 1;
+  *msg = arena_alloc(t->payloads, msg_len, hold);
+  return *msg ? 0 : OP_SM_FAIL;
+}
+
+void op_unreserve(arena_block *hold)
+{
+  arena_settle(hold, -1);
+}
+
+int32_t op_send_reserved(
+    topic *t,
+    void *msg,
+    uint32_t msg_len,
+    arena_block *hold)
+{
+  message m = {0};
+  m.len = msg_len;
+  m.base = msg;
+  pthread_mutex_lock(&t->append_lock);
+  mark_time(t);
+  int32_t offset = msglog_append(t->msgs, &m);
+  if (offset >= 0)
+  {
+    t->raw_bytes += msg_len;
+    t->stored_bytes += msg_len;
+    msglog_publish(t->msgs);
+  }
+  pthread_mutex_unlock(&t->append_lock);
+  arena_settle(hold, offset);
+  if (offset < 0)
+    return OP_SM_FAIL;
+  wait_wake(&t->waiters, offset + 1);
+  return offset;
+}
+
+int32_t op_send_packed(
+    topic *t,
+    const void *batch,
+    uint32_t batch_len)
+{
+  if (!t)
+    return OP_SM_NOTOPIC;
+  size_t raw;
+  int n = packed_check(batch, batch_len, &raw);
+  if (n < 0)
+    return OP_SM_FAIL;
+
+  // The batch is stored once, its messages point to it
+  message local[LOCAL_BATCH] = {0};
+  message *ms = n <= LOCAL_BATCH ? local : calloc(n, sizeof(*ms));
+  arena_block *block = 0;
+  void *base = !t->log ? arena_alloc(t->payloads, batch_len, &block) : 0;
+  int ok = ms && (t->log || base);
+  for (int i = 0; ok && i < n; ++i)
+  {
+    uint32_t len;
+    memcpy(&len, (const uint8_t *)batch + PACKED_HDR_SIZE(i), 4);
+    ms[i].len = ntohl(len);
+    ms[i].base = base;
+    ms[i].packed_len = batch_len;
+    ms[i].packed_index = i;
+  }
+  if (base)
+    memcpy(base, batch, batch_len);
+
+  int result = OP_SM_FAIL;
+  int appended = 0;
+  if (ok)
+  {
+    struct iovec iov;
+    iove_setup(&iov, 0, batch_len, (void *)batch);
+    off_t pos = 0;
+    void *at = 0;
+    pthread_mutex_lock(&t->append_lock);
+    mark_time(t);
+    if (!t->log ||
+        seglog_append(t->log, msglog_end(t->msgs), &iov, 1, 1, &pos, &at) ==
+            0)
+    {
+      for (; appended < n; ++appended)
+      {
+        ms[appended].pos = pos;
+        if (at)
+          ms[appended].base = at;
+        int32_t offset = msglog_append(t->msgs, &ms[appended]);
+        if (offset < 0)
+          break;
+        if (!appended)
+          result = offset;
+      }
+      // Once the first one is there, the batch is
+      if (appended)
+      {
+        t->raw_bytes += raw;
+        t->stored_bytes += batch_len;
+      }
+      msglog_publish(t->msgs);
+    }
+    pthread_mutex_unlock(&t->append_lock);
+  }
+
+  if (block)
+    arena_settle(block, appended ? result + appended - 1 : -1);
+  if (appended)
+    wait_wake(&t->waiters, result + appended);
+  if (ms != local)
+    free(ms);
+  // If the log failed halfway, the first ones stay there anyway
+  return appended == n ? result : OP_SM_FAIL;
+}
+
+int op_topic_stats(
+    topic *t,
+    uint64_t *raw_bytes,
+    uint64_t *stored_bytes)
+{
+  if (!t)
+    return -1;
+  pthread_mutex_lock(&t->append_lock);
+  *raw_bytes = t->raw_bytes;
+  *stored_bytes = t->stored_bytes;
+  pthread_mutex_unlock(&t->append_lock);
+  return 0;
+}
+
+int op_unpack(const message *m, int fd, void *dst)
+{
+  uint8_t *batch = m->base;
+  uint8_t *raw = 0;
+  int result = -1;
+  if (!batch && (batch = malloc(m->packed_len)))
+  {
+    size_t done = 0;
+    while (done < m->packed_len)
+    {
+      ssize_t n = pread(fd, batch + done, m->packed_len - done, m->pos + done);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    if (done < m->packed_len)
+      goto end;
+  }
+  if (!batch)
+    return -1;
+
+  // Checked when it was appended
+  uint32_t v[2];
+  memcpy(v, batch, 8);
+  uint32_t codec = ntohl(v[0]);
+  uint32_t n = ntohl(v[1]);
+  size_t raw_len = 0;
+  size_t msg_pos = 0;
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    memcpy(v, batch + PACKED_HDR_SIZE(i), 4);
+    if (i == m->packed_index)
+      msg_pos = raw_len;
+    raw_len += ntohl(v[0]);
+  }
+  const uint8_t *data = batch + PACKED_HDR_SIZE(n);
+  size_t data_len = m->packed_len - PACKED_HDR_SIZE(n);
+  if (codec == CODEC_NONE)
+    memcpy(dst, data + msg_pos, m->len);
+  else if ((raw = malloc(raw_len ? raw_len : 1)) &&
+           !lz_decompress(data, data_len, raw, raw_len))
+    memcpy(dst, raw + msg_pos, m->len);
+  else
+    goto end;
+  result = 0;
+
+end:
+  free(raw);
+  if (batch != m->base)
+    free(batch);
+  return result;
+}
+
+int32_t op_msg_len(topic *t, uint32_t offset)
+{
+  if (!t)
+    return -1;
+  message m;
+  if (msglog_get(t->msgs, offset, &m) == 0)
+    return m.len;
+  return offset < msglog_low(t->msgs) ? OP_ML_GONE : 0;
+}
+
+int32_t op_end_offset(topic *t)
+{
+  if (!t)
+    return -1;
+  return msglog_end(t->msgs);
+}
+
+int32_t op_low_offset(topic *t)
+{
+  if (!t)
+    return -1;
+  return msglog_low(t->msgs);
+}
+
+int op_set_retention(topic *t, const retention *r)
+{
+  if (!t)
+    return -1;
+  pthread_mutex_lock(&t->append_lock);
+  t->keep = *r;
+  // Stored topics keep it when the broker starts again
+  if (t->dir)
+    write_retention(t);
+  pthread_mutex_unlock(&t->append_lock);
+  return 0;
+}
+
+int op_poll(topic *t, uint32_t offset, message *m, int *fd)
+{
+  if (!t || msglog_get(t->msgs, offset, m) < 0)
+    return -1;
+  // Mapped, it is read right from m->base. Its segment may have been
+  // trimmed since, then m->pos is no good in any file and it is gone
+  uint32_t seg_end;
+  *fd = m->base ? -1 : seglog_fd(t->log, offset, &seg_end);
+  return m->base || *fd >= 0 ? 0 : -1;
+}
+
+int op_same_batch(const message *a, const message *b)
+{
+  return a->packed_len && b->packed_len && a->base == b->base &&
+         a->pos == b->pos;
+}
+
+int op_fetch(
+    topic *t,
+    uint32_t offset,
+    message *msgs,
+    int max_msgs,
+    size_t max_bytes,
+    int *fd)
+{
+  if (!t)
+    return 0;
+
+  // Messages are only appended, whatever is before end stays there
+  // They all come from the same file
+  uint32_t end = msglog_end(t->msgs);
+  *fd = -1;
+  if (t->log && !storage_mapped && offset < end)
+  {
+    uint32_t seg_end;
+    // Trimmed, so are the messages in msgs
+    if ((*fd = seglog_fd(t->log, offset, &seg_end)) < 0)
+      return 0;
+    if (seg_end < end)
+      end = seg_end;
+  }
+  if (end - offset < (uint32_t)max_msgs)
+    max_msgs = end - offset;
+  int got = msglog_read(t->msgs, offset, msgs, max_msgs);
+  size_t bytes = 0;
+  int n = 0;
+  for (; n < got; ++n)
+  {
+    size_t len = msgs[n].len;
+    // The batch went with the first of its messages
+    if (msgs[n].packed_len)
+      len = n && op_same_batch(&msgs[n - 1], &msgs[n]) ? 0
+                                                        : msgs[n].packed_len;
+    if (n && bytes + len > max_bytes)
+      break;
+    bytes += len;
+  }
+  return n;
+}
+
+int op_poll_wait(
+    topic *t,
+    uint32_t offset,
+    uint32_t max_wait_ms,
+    waiter *w)
+{
+  if (!t)
+    return 0;
+  wait_begin(&t->waiters);
+  if (offset < msglog_end(t->msgs))
+  {
+    wait_abort(&t->waiters);
+    return 0;
+  }
+  wait_park(&t->waiters, w, offset, max_wait_ms);
+  return 1;
+}
+
+int8_t op_commit(
+    char *dir_commit,
+    const char *client,
+    const char *topic,
+    uint32_t offset)
+{
+  int8_t result;
+  if (!valid_commit_names(client, topic))
+    return -1;
+  pthread_mutex_lock(&dir_commit_lock);
+  FILE *target_file = open_commit_file(dir_commit, client, topic, "w");
+  if (target_file)
+  {
+    fprintf(target_file, "%u", offset);
+    fclose(target_file);
+    result = 0;
+  }
+  else
+    result = -2;
+  pthread_mutex_unlock(&dir_commit_lock);
+  return result;
+}
+
+int32_t op_commited(char *dir_commit, const char *client, const char *topic)
+{
+  int32_t result;
+  if (!valid_commit_names(client, topic))
+    return -1;
+  pthread_mutex_lock(&dir_commit_lock);
+  FILE *target_file = open_commit_file(dir_commit, client, topic, "r");
+  if (target_file)
+  {
+    if (fscanf(target_file, "%d", &result) != 1)
+      result = -2;
+    fclose(target_file);
+  }
+  else
+    result = -2;
+  pthread_mutex_unlock(&dir_commit_lock);
+  return result;
+}
+
+void topic_release(void *key, void *value)
+{
+  destroy_topic(value);
+  free(key);
+}
@@ -0,0 +1,199 @@
+/*
+ * Broker operations, independent of how requests reach the broker.
+ * Every connection handling mode (thread per connection, event loops)
+ * parses requests its own way and then calls into these.
+ */
+
+#ifndef _OPS_H
+#define _OPS_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "hmap.h"
+#include "seglog.h"
+#include "wait.h"
+
+// A topic, once created it is there as long as the broker runs
+typedef struct TOPIC topic;
+
+// How much of a topic is kept, older messages go first
+// Offsets don't change when they go, the topic then starts at a higher one
+typedef struct RETENTION retention;
+struct RETENTION
+{
+  // 0 for no limit
+  uint32_t max_msgs;
+  uint64_t max_bytes; // Stored bytes
+  uint32_t max_age_ms;
+};
+
+typedef struct MESSAGE message;
+struct MESSAGE
+{
+  size_t len;
+  void *base; // 0 if the message is in the topic files, and not mapped
+  off_t pos;  // Where the message is in its file, only looked at if no base
+  // Messages that came in a packed batch share it, base and pos are where
+  // the batch is and len the length of the message once unpacked
+  uint32_t packed_len; // 0 if the message came on its own
+  uint32_t packed_index;
+};
+
+// Keeps the messages of every topic created from now on in files of dir,
+// which is created if it is not there, instead of in memory (see
+// seglog.h), and first puts in topics the ones stored there, with the
+// messages they had. If mapped is set the files are mapped, messages are
+// read from there and not with calls on the files. They go to disk as
+// sync says. Topics that can't be brought back are left out, and said so
+// Returns 0 if OK, -1 if dir can't be used, after saying why
+int ops_storage_init(
+    const char *dir,
+    int mapped,
+    const seglog_sync *sync,
+    hmap *topics);
+
+// Retention of the topics created from now on
+void ops_default_retention(const retention *r);
+
+// Starts the thread dropping old messages, as retention says
+// Returns 0 if OK, -1 on error
+int ops_reaper_start(void);
+
+// Returns OP_CT_SUCCESS, OP_CT_EXISTS or OP_CT_FAIL
+// topic is stored as the map key on success and free()d otherwise
+uint8_t op_create_topic(hmap *topics, char *topic);
+
+uint32_t op_ntopics(hmap *topics);
+
+// Returns the topic, 0 if no such topic
+topic *op_topic(hmap *topics, const char *name);
+
+// Returns the ID of the topic, -1 if no such topic
+// IDs are small and dense, they never change while the broker runs
+int32_t op_topic_id(hmap *topics, const char *name);
+
+// Returns the topic with that ID, 0 if no such topic
+topic *op_topic_by_id(uint32_t id);
+
+// Every operation on a topic takes it as returned by op_topic or
+// op_topic_by_id, 0 if it was not found, and they all act as such
+
+// Appends a copy of msg to the topic, returns its offset or
+// OP_SM_NOTOPIC/OP_SM_FAIL
+int32_t op_send_msg(
+    topic *t,
+    const void *msg,
+    uint32_t msg_len);
+
+// Appends a copy of the n messages to the topic, with consecutive offsets
+// Returns the offset of the first one or OP_SM_NOTOPIC/OP_SM_FAIL
+int32_t op_send_batch(
+    topic *t,
+    const struct iovec *msgs,
+    int n);
+
+// Room for a message of msg_len bytes in the topic, at *msg, for it to be
+// received right where it is stored and then appended with
+// op_send_reserved, or given back with op_unreserve. *hold is for either
+// Returns 0 if OK, 1 if the topic does not keep its messages in memory, or
+// OP_SM_NOTOPIC/OP_SM_FAIL
+int op_reserve(topic *t, uint32_t msg_len, void **msg, arena_block **hold);
+
+// Appends the message at msg, as given by op_reserve, returns its offset or
+// OP_SM_NOTOPIC/OP_SM_FAIL
+int32_t op_send_reserved(
+    topic *t,
+    void *msg,
+    uint32_t msg_len,
+    arena_block *hold);
+
+void op_unreserve(arena_block *hold);
+
+// Appends the messages of a packed batch to the topic, with consecutive
+// offsets; the batch is stored as it is
+// Returns the offset of the first one or OP_SM_NOTOPIC/OP_SM_FAIL
+int32_t op_send_packed(
+    topic *t,
+    const void *batch,
+    uint32_t batch_len);
+
+// Bytes of the messages received for the topic, and bytes stored for them
+// Returns 0 if OK, -1 if no such topic
+int op_topic_stats(
+    topic *t,
+    uint64_t *raw_bytes,
+    uint64_t *stored_bytes);
+
+// Copies the message, which came in a packed batch, to dst (m->len bytes)
+// fd is the file of the message, as set by op_poll
+// Returns 0 if OK, -1 if the batch could not be read or unpacked
+int op_unpack(const message *m, int fd, void *dst);
+
+// Returns the message length, 0 if no such offset, -1 if no such topic,
+// OP_ML_GONE if retention dropped it
+int32_t op_msg_len(topic *t, uint32_t offset);
+
+// Returns the end offset of the topic, -1 if no such topic
+int32_t op_end_offset(topic *t);
+
+// Returns the offset of the oldest message kept, -1 if no such topic
+// Offsets below it, and only those, are gone
+int32_t op_low_offset(topic *t);
+
+// Returns 0 if OK, -1 if no such topic
+int op_set_retention(topic *t, const retention *r);
+
+// Messages are copied to the caller, what they point to stays there as
+// long as the caller is in the epoch it was in when it got them (see
+// epoch.h)
+
+// Copies the message at offset to m
+// Returns 0 if OK, -1 if the topic/offset do not exist
+// If the message is in the topic files, *fd is set to its file, -1
+// otherwise
+int op_poll(topic *t, uint32_t offset, message *m, int *fd);
+
+// Whether both messages came in the same packed batch
+int op_same_batch(const message *a, const message *b);
+
+// Fills msgs with up to max_msgs consecutive messages from offset on, as
+// long as what is sent for them adds up to max_bytes (the first one goes in
+// anyway) and they are in the same file. A packed batch is sent whole, once
+// Returns how many, 0 if the topic/offset do not exist
+// *fd is set as in op_poll
+int op_fetch(
+    topic *t,
+    uint32_t offset,
+    message *msgs,
+    int max_msgs,
+    size_t max_bytes,
+    int *fd);
+
+// Parks w until the message at offset is published, or max_wait_ms go by
+// (0 to wait for the message as long as it takes)
+// Returns 1 if w was parked, 0 if the poll can be answered right away (the
+// message is there or the topic does not exist)
+int op_poll_wait(
+    topic *t,
+    uint32_t offset,
+    uint32_t max_wait_ms,
+    waiter *w);
+
+// Returns 0 on success, -1 for invalid names, -2 if the file could not be
+// written
+int8_t op_commit(
+    char *dir_commit,
+    const char *client,
+    const char *topic,
+    uint32_t offset);
+
+// Returns the commited offset, -1 for invalid names, -2 if none was commited
+int32_t op_commited(char *dir_commit, const char *client, const char *topic);
+
+void topic_release(void *key, void *value);
+
+#endif // _OPS_H
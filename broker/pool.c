@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "pool.h"
+
+#define DEQUE_MIN_CAP (64)
+
+typedef struct TASK task;
+struct TASK
+{
+  pool_task_t run;
+  void *arg;
+};
+
+// Circular buffer of tasks
+// The owner pushes and pops at the bottom, thieves take from the top
+typedef struct DEQUE deque;
+struct DEQUE
+{
+  pthread_mutex_t lock;
+  task *tasks;
+  size_t cap;
+  size_t top;
+  size_t count;
+};
+
+typedef struct WORKER worker;
+struct WORKER
+{
+  pool *p;
+  int index;
+  pthread_t thid;
+};
+
+struct POOL
+{
+  int nworkers;
+  deque *deques;
+  worker *workers;
+  unsigned next; // Deque for the next task submitted from outside the pool
+
+  // Idle workers sleep here until there is something to run
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  int pending;  // Tasks submitted and not taken yet
+  int stopping; // Only while pool_create undoes what it did
+};
+
+static __thread worker *self; // Worker running on this thread, if any
+
+static int deque_push_bottom(deque *d, pool_task_t run, void *arg)
+{
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->cap)
+  {
+    size_t ncap = d->cap ? d->cap * 2 : DEQUE_MIN_CAP;
+    task *ntasks = malloc(ncap * sizeof(*ntasks));
+    if (!ntasks)
+    {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < d->count; ++i)
+      ntasks[i] = d->tasks[(d->top + i) % d->cap];
+    free(d->tasks);
+    d->tasks = ntasks;
+    d->cap = ncap;
+    d->top = 0;
+  }
+  task *t = &d->tasks[(d->top + d->count) % d->cap];
+  t->run = run;
+  t->arg = arg;
+  ++d->count;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+static int deque_pop_bottom(deque *d, task *t)
+{
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->count)
+  {
+    --d->count;
+    *t = d->tasks[(d->top + d->count) % d->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// With wait unset, a deque someone else is working on is left alone, we
+// have other places to look at
+static int deque_steal_top(deque *d, task *t, int wait)
+{
+  int found = 0;
+  if (wait)
+    pthread_mutex_lock(&d->lock);
+  else if (pthread_mutex_trylock(&d->lock))
+    return 0;
+  if (d->count)
+  {
+    *t = d->tasks[d->top];
+    d->top = (d->top + 1) % d->cap;
+    --d->count;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Own deque first, then the others starting with our neighbour
+static int take_task(worker *w, task *t, int wait)
+{
+  pool *p = w->p;
+  if (deque_pop_bottom(&p->deques[w->index], t))
+    return 1;
+  for (int i = 1; i < p->nworkers; ++i)
+    if (deque_steal_top(&p->deques[(w->index + i) % p->nworkers], t, wait))
+      return 1;
+  return 0;
+}
+
+static void *worker_run(void *parg_worker)
+{
+  worker *w = parg_worker;
+  pool *p = w->p;
+  self = w;
+
+  while (1)
+  {
+    pthread_mutex_lock(&p->idle_lock);
+    while (!__atomic_load_n(&p->pending, __ATOMIC_RELAXED) && !p->stopping)
+      pthread_cond_wait(&p->idle_cond, &p->idle_lock);
+    int stopping = p->stopping;
+    pthread_mutex_unlock(&p->idle_lock);
+    if (stopping)
+      return 0;
+
+    task t;
+    int took = 0;
+    // A task in a deque being worked on only waits for its lock
+    while (take_task(w, &t, 0) || take_task(w, &t, 1))
+    {
+      __atomic_sub_fetch(&p->pending, 1, __ATOMIC_RELAXED);
+      t.run(t.arg);
+      took = 1;
+    }
+    // Every deque looked at in whole and nothing there: whatever is pending
+    // was taken and is about to be counted off, or is about to be pushed,
+    // let the one doing it go on instead of looking again right away
+    if (!took)
+      sched_yield();
+  }
+  return 0;
+}
+
+// Stops the first n workers, which are not detached yet, and frees the pool
+static void pool_destroy(pool *p, int n)
+{
+  pthread_mutex_lock(&p->idle_lock);
+  p->stopping = 1;
+  pthread_cond_broadcast(&p->idle_cond);
+  pthread_mutex_unlock(&p->idle_lock);
+  for (int i = 0; i < n; ++i)
+    pthread_join(p->workers[i].thid, 0);
+  for (int i = 0; i < p->nworkers; ++i)
+    pthread_mutex_destroy(&p->deques[i].lock);
+  pthread_cond_destroy(&p->idle_cond);
+  pthread_mutex_destroy(&p->idle_lock);
+  free(p->deques);
+  free(p->workers);
+  free(p);
+}
+
+pool *pool_create(int nworkers)
+{
+  pool *p = calloc(1, sizeof(*p));
+  if (!p)
+    return 0;
+  p->nworkers = nworkers;
+  p->deques = calloc(nworkers, sizeof(*p->deques));
+  p->workers = calloc(nworkers, sizeof(*p->workers));
+  if (!p->deques || !p->workers)
+  {
+    free(p->deques);
+    free(p->workers);
+    free(p);
+    return 0;
+  }
+  pthread_mutex_init(&p->idle_lock, 0);
+  pthread_cond_init(&p->idle_cond, 0);
+
+  for (int i = 0; i < nworkers; ++i)
+    pthread_mutex_init(&p->deques[i].lock, 0);
+  for (int i = 0; i < nworkers; ++i)
+  {
+    p->workers[i].p = p;
+    p->workers[i].index = i;
+    if (pthread_create(&p->workers[i].thid, 0, worker_run, &p->workers[i]))
+    {
+      perror("pthread_create");
+      pool_destroy(p, i);
+      return 0;
+    }
+  }
+  // Only now, the ones started could have to be stopped until then
+  for (int i = 0; i < nworkers; ++i)
+    pthread_detach(p->workers[i].thid);
+  return p;
+}
+
+int pool_submit(pool *p, pool_task_t run, void *arg)
+{
+  int index;
+  if (self && self->p == p)
+    index = self->index;
+  else
+    index = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->nworkers;
+
+  // Counted before it can be taken, so pending never goes below the tasks
+  // in the deques, nor below 0
+  __atomic_add_fetch(&p->pending, 1, __ATOMIC_RELAXED);
+  if (deque_push_bottom(&p->deques[index], run, arg) < 0)
+  {
+    __atomic_sub_fetch(&p->pending, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  pthread_mutex_lock(&p->idle_lock);
+  pthread_cond_signal(&p->idle_cond);
+  pthread_mutex_unlock(&p->idle_lock);
+  return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Fixed size pool of worker threads. Each worker has its own deque of
+ * tasks: it takes new work from its own end and, when it runs out, steals
+ * from the other end of the other workers' deques.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H 1
+
+typedef struct POOL pool;
+
+typedef void (*pool_task_t)(void *arg);
+
+// Starts nworkers threads
+// Returns the pool, or NULL on error
+pool *pool_create(int nworkers);
+
+// Schedules task(arg) on the pool. From a worker, the task goes to its own
+// deque, from any other thread the deques are used in turns.
+// Returns 0 if OK, -1 on error
+int pool_submit(pool *p, pool_task_t task, void *arg);
+
+#endif // _POOL_H
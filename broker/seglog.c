@@ -0,0 +1,715 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <netinet/in.h>
+
+#include "epoch.h"
+#include "seglog.h"
+
+// Records given to a single pwritev, two iovecs each (IOV_MAX on Linux)
+#define WRITE_BATCH (512)
+// Appends up to this many records put their headers on the stack
+#define LOCAL_BATCH (16)
+// Segments are read back in pieces of at least this size
+#define READ_CHUNK (1 << 20)
+// Mapped segments get their blocks in pieces of this size
+#define ALLOC_CHUNK (1 << 20)
+
+typedef struct SEGMENT segment;
+struct SEGMENT
+{
+  uint32_t base; // Offset of its first record
+  int fd;
+  off_t size; // Where the next record goes, only seen by the appender
+  // Mapped logs only: the whole segment, and how much of the file has its
+  // blocks already
+  uint8_t *map;
+  size_t map_len;
+  off_t alloc;
+  off_t synced; // Up to where msync was called
+};
+
+// Segments of the log, only the directory moves when it grows
+typedef struct SEGLOG_DIR seglog_dir;
+struct SEGLOG_DIR
+{
+  uint32_t cap;
+  // The one this replaced: readers that got to it before it grew may still
+  // be in it, so it goes away with the log
+  seglog_dir *prev;
+  segment *segs[];
+};
+
+struct SEG_LOG
+{
+  char *path;
+  int mapped;
+  seglog_dir *dir;
+  uint32_t nsegs; // The last one is where records are appended
+  uint32_t first; // Oldest one kept
+  seglog_sync sync;
+  // Appended and not synced yet, only seen by the appender
+  uint32_t unsynced;
+  uint64_t unsynced_bytes;
+  int64_t unsynced_ms; // When the first of them was appended
+};
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; ++i)
+  {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k)
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  crc = ~crc;
+  while (len--)
+    crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// The length word goes in too, a torn header does not pass for a record
+static uint32_t record_crc(uint32_t len_word, const void *rec, size_t len)
+{
+  uint32_t be = htonl(len_word);
+  return crc_update(crc_update(0, &be, 4), rec, len);
+}
+
+static void segment_path(seg_log *l, uint32_t base, char *path, size_t sz)
+{
+  snprintf(path, sz, "%s/%010u.log", l->path, base);
+}
+
+// Maps len bytes of the segment file, for records up to len bytes in
+// Returns the mapping, or 0 on error
+static uint8_t *map_segment(int fd, size_t len)
+{
+  uint8_t *map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("mmap");
+    return 0;
+  }
+  // Consumers mostly read on from where they are, the kernel can read
+  // ahead of them and drop what they left behind
+  madvise(map, len, MADV_SEQUENTIAL);
+  return map;
+}
+
+// Adds a segment at the end of the log, for the appender
+// map is 0 if the log is not mapped
+static int add_segment(
+    seg_log *l,
+    uint32_t base,
+    int fd,
+    off_t size,
+    uint8_t *map,
+    size_t map_len)
+{
+  seglog_dir *dir = l->dir;
+  if (!dir || l->nsegs == dir->cap)
+  {
+    uint32_t ncap = dir ? dir->cap * 2 : 16;
+    seglog_dir *ndir = malloc(sizeof(*ndir) + ncap * sizeof(ndir->segs[0]));
+    if (!ndir)
+      return -1;
+    ndir->cap = ncap;
+    ndir->prev = dir;
+    for (uint32_t i = 0; i < l->nsegs; ++i)
+      ndir->segs[i] = dir->segs[i];
+    __atomic_store_n(&l->dir, ndir, __ATOMIC_RELEASE);
+    dir = ndir;
+  }
+  segment *s = malloc(sizeof(*s));
+  if (!s)
+    return -1;
+  s->base = base;
+  s->fd = fd;
+  s->size = size;
+  s->map = map;
+  s->map_len = map_len;
+  s->alloc = size;
+  s->synced = 0;
+  dir->segs[l->nsegs] = s;
+  __atomic_store_n(&l->nsegs, l->nsegs + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Starts a new segment with the record at base, need bytes long at least
+static int new_segment(seg_log *l, uint32_t base, size_t need)
+{
+  char path[strlen(l->path) + 16];
+  segment_path(l, base, path, sizeof(path));
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    perror("open");
+    return -1;
+  }
+  size_t map_len = need > SEGLOG_BYTES ? need : SEGLOG_BYTES;
+  uint8_t *map = 0;
+  if (l->mapped &&
+      (ftruncate(fd, map_len) < 0 || !(map = map_segment(fd, map_len))))
+  {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  if (add_segment(l, base, fd, 0, map, map_len) < 0)
+  {
+    if (map)
+      munmap(map, map_len);
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Segment read back in pieces, a record at a time
+typedef struct SEG_READER seg_reader;
+struct SEG_READER
+{
+  int fd;
+  const uint8_t *map; // Read right there if the segment is mapped
+  off_t size;
+  uint8_t *buf;
+  size_t cap;
+  off_t from; // Where the bytes in buf are
+  size_t len;
+};
+
+// Returns the len bytes at pos, or NULL if the segment ends before
+static const uint8_t *read_at(seg_reader *r, off_t pos, size_t len)
+{
+  if (pos > r->size || len > (size_t)(r->size - pos))
+    return 0;
+  if (r->map)
+    return r->map + pos;
+  if (pos >= r->from && pos + len <= r->from + r->len)
+    return r->buf + (pos - r->from);
+  size_t want = len > READ_CHUNK ? len : READ_CHUNK;
+  if (want > r->cap)
+  {
+    uint8_t *nbuf = realloc(r->buf, want);
+    if (!nbuf)
+      return 0;
+    r->buf = nbuf;
+    r->cap = want;
+  }
+  r->from = pos;
+  r->len = 0;
+  while (r->len < want)
+  {
+    ssize_t n = pread(r->fd, r->buf + r->len, want - r->len, pos + r->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    r->len += n;
+  }
+  return r->len >= len ? r->buf : 0;
+}
+
+// Gives every valid record of the segment to found, from its first one on,
+// and returns the size of the segment up to the last of them, -1 if found
+// gave up. *offset goes on to the offset after it
+static off_t scan_segment(
+    seg_reader *r,
+    uint32_t *offset,
+    seglog_found_t found,
+    void *arg)
+{
+  off_t pos = 0;
+  while (1)
+  {
+    const uint8_t *hdr = read_at(r, pos, SEGLOG_HDR);
+    if (!hdr)
+      return pos;
+    uint32_t v[2];
+    memcpy(v, hdr, 8);
+    uint32_t len_word = ntohl(v[0]);
+    uint32_t crc = ntohl(v[1]);
+    uint32_t len = len_word & ~SEGLOG_PACKED;
+    const uint8_t *rec = read_at(r, pos + SEGLOG_HDR, len);
+    if (!rec || record_crc(len_word, rec, len) != crc)
+      return pos;
+    int n = found(
+        arg,
+        *offset,
+        pos + SEGLOG_HDR,
+        rec,
+        len,
+        !!(len_word & SEGLOG_PACKED));
+    if (n == -2)
+      return -1;
+    if (n < 0)
+      return pos;
+    *offset += n;
+    pos += SEGLOG_HDR + len;
+  }
+}
+
+static int cmp_base(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Bases of the segments in the log directory, sorted
+// Returns how many, -1 on error
+static int list_segments(seg_log *l, uint32_t **bases)
+{
+  DIR *d = opendir(l->path);
+  if (!d)
+    return -1;
+  int n = 0;
+  int cap = 0;
+  *bases = 0;
+  struct dirent *e;
+  while ((e = readdir(d)))
+  {
+    uint32_t base;
+    int used = 0;
+    if (sscanf(e->d_name, "%10u.log%n", &base, &used) != 1 ||
+        e->d_name[used] || used != 14)
+      continue;
+    if (n == cap)
+    {
+      cap = cap ? cap * 2 : 16;
+      uint32_t *nbases = realloc(*bases, cap * sizeof(*nbases));
+      if (!nbases)
+      {
+        closedir(d);
+        free(*bases);
+        return -1;
+      }
+      *bases = nbases;
+    }
+    (*bases)[n++] = base;
+  }
+  closedir(d);
+  if (n)
+    qsort(*bases, n, sizeof(**bases), cmp_base);
+  return n;
+}
+
+// Reads back the segments in the directory, they have to follow one
+// another. Whatever comes after the first record that is not valid goes
+static int recover(seg_log *l, uint32_t *low, seglog_found_t found, void *arg)
+{
+  uint32_t *bases;
+  int n = list_segments(l, &bases);
+  if (n <= 0)
+    return n;
+  seg_reader r = {0};
+  int result = 0;
+  uint32_t offset = bases[0];
+  *low = offset;
+  int i = 0;
+  char path[strlen(l->path) + 16];
+  for (; i < n && bases[i] == offset; ++i)
+  {
+    segment_path(l, bases[i], path, sizeof(path));
+    r.fd = open(path, O_RDWR | O_CLOEXEC);
+    if (r.fd < 0)
+    {
+      perror("open");
+      result = -1;
+      break;
+    }
+    struct stat st;
+    if (fstat(r.fd, &st) < 0)
+    {
+      perror("fstat");
+      close(r.fd);
+      result = -1;
+      break;
+    }
+    r.size = st.st_size;
+    r.len = 0;
+    // Mapped for as long as it would be written, records found stay where
+    // they are
+    size_t map_len = st.st_size > SEGLOG_BYTES ? st.st_size : SEGLOG_BYTES;
+    r.map = 0;
+    if (l->mapped && !(r.map = map_segment(r.fd, map_len)))
+    {
+      close(r.fd);
+      result = -1;
+      break;
+    }
+    off_t size = scan_segment(&r, &offset, found, arg);
+    // Mapped ones were made as long as they could get, the rest of the last
+    // one is just zeros
+    const uint8_t *hdr = r.map && size >= 0 ? read_at(&r, size, 4) : 0;
+    int zeros = hdr && !memcmp(hdr, "\0\0\0", 4);
+    if (size < 0 || (r.size > size && ftruncate(r.fd, size) < 0) ||
+        add_segment(l, bases[i], r.fd, size, (uint8_t *)r.map, map_len) < 0)
+    {
+      if (r.map)
+        munmap((void *)r.map, map_len);
+      close(r.fd);
+      result = -1;
+      break;
+    }
+    if (r.size > size)
+    {
+      if (!zeros)
+        fprintf(stderr, "%s: not valid from byte %lld on, dropped\n", path,
+                (long long)size);
+      ++i;
+      break;
+    }
+  }
+  // The last one goes on being written
+  if (!result && l->mapped && l->nsegs)
+  {
+    segment *s = l->dir->segs[l->nsegs - 1];
+    if (ftruncate(s->fd, s->map_len) < 0)
+    {
+      perror("ftruncate");
+      result = -1;
+    }
+  }
+  // Cut off from the ones before
+  for (; !result && i < n; ++i)
+  {
+    segment_path(l, bases[i], path, sizeof(path));
+    fprintf(stderr, "%s: after a gap, dropped\n", path);
+    unlink(path);
+  }
+  free(r.buf);
+  free(bases);
+  return result;
+}
+
+seg_log *seglog_open(
+    const char *dir,
+    int mapped,
+    const seglog_sync *sync,
+    uint32_t *low,
+    seglog_found_t found,
+    void *arg)
+{
+  pthread_once(&crc_once, crc_init);
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+  {
+    perror("mkdir");
+    return 0;
+  }
+  seg_log *l = calloc(1, sizeof(*l));
+  if (!l || !(l->path = strdup(dir)))
+  {
+    free(l);
+    return 0;
+  }
+  l->mapped = mapped;
+  l->sync = *sync;
+  *low = 0;
+  if (recover(l, low, found, arg) < 0 ||
+      (!l->nsegs && new_segment(l, 0, 0) < 0))
+  {
+    seglog_close(l, 0);
+    return 0;
+  }
+  return l;
+}
+
+void seglog_close(seg_log *l, int remove)
+{
+  char path[strlen(l->path) + 16];
+  for (uint32_t i = l->first; i < l->nsegs; ++i)
+  {
+    segment *s = l->dir->segs[i];
+    if (s->map)
+      munmap(s->map, s->map_len);
+    close(s->fd);
+    if (remove)
+    {
+      segment_path(l, s->base, path, sizeof(path));
+      unlink(path);
+    }
+    free(s);
+  }
+  while (l->dir)
+  {
+    seglog_dir *prev = l->dir->prev;
+    free(l->dir);
+    l->dir = prev;
+  }
+  free(l->path);
+  free(l);
+}
+
+// Writes the iovecs at pos, in as many calls as it takes
+static int write_all(int fd, struct iovec *iov, int n, off_t pos)
+{
+  while (n)
+  {
+    int chunk = n < 2 * WRITE_BATCH ? n : 2 * WRITE_BATCH;
+    ssize_t written = pwritev(fd, iov, chunk, pos);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    pos += written;
+    // Whatever did not make it goes in the next call
+    while (n && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+// Makes sure the mapped segment has its blocks up to end. Writing to a
+// hole through the mapping with the disk full would kill the process
+static int reserve(segment *s, off_t end)
+{
+  if (end <= s->alloc)
+    return 0;
+  off_t to = (end + ALLOC_CHUNK - 1) / ALLOC_CHUNK * ALLOC_CHUNK;
+  if (to > (off_t)s->map_len)
+    to = s->map_len;
+  int err = posix_fallocate(s->fd, s->alloc, to - s->alloc);
+  if (err)
+  {
+    errno = err;
+    perror("posix_fallocate");
+    return -1;
+  }
+  s->alloc = to;
+  return 0;
+}
+
+// Makes the empty last segment of a mapped log need bytes long
+static int grow_segment(segment *s, size_t need)
+{
+  uint8_t *map;
+  if (ftruncate(s->fd, need) < 0 || !(map = map_segment(s->fd, need)))
+    return -1;
+  munmap(s->map, s->map_len);
+  s->map = map;
+  s->map_len = need;
+  return 0;
+}
+
+static int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Puts the records of the last segment on disk. Those of the segments
+// before it already are
+static void sync_last(seg_log *l)
+{
+  segment *s = l->dir->segs[l->nsegs - 1];
+  if (s->map)
+  {
+    // From the page where the last one stopped
+    long page = sysconf(_SC_PAGESIZE);
+    off_t from = s->synced / page * page;
+    if (s->size > from && msync(s->map + from, s->size - from, MS_SYNC) < 0)
+      perror("msync");
+    s->synced = s->size;
+  }
+  else if (fdatasync(s->fd) < 0)
+    perror("fdatasync");
+  l->unsynced = 0;
+  l->unsynced_bytes = 0;
+}
+
+// Closes the last segment, the new one starts with the records at offset,
+// total bytes of them. The one closed is not going to change, it goes to
+// disk now
+static int roll(seg_log *l, uint32_t offset, size_t total)
+{
+  segment *s = l->dir->segs[l->nsegs - 1];
+  sync_last(l);
+  // Readers never look past size
+  if (s->map && ftruncate(s->fd, s->size) < 0)
+    perror("ftruncate");
+  return new_segment(l, offset, total);
+}
+
+// Counts n records of total bytes just appended, and syncs them if the
+// policy says so
+static void appended(seg_log *l, int n, size_t total)
+{
+  if (!l->sync.records && !l->sync.bytes && !l->sync.interval_ms)
+    return;
+  int64_t now = l->sync.interval_ms ? now_ms() : 0;
+  if (!l->unsynced)
+    l->unsynced_ms = now;
+  l->unsynced += n;
+  l->unsynced_bytes += total;
+  if ((l->sync.records && l->unsynced >= l->sync.records) ||
+      (l->sync.bytes && l->unsynced_bytes >= l->sync.bytes) ||
+      (l->sync.interval_ms && now - l->unsynced_ms >= l->sync.interval_ms))
+    sync_last(l);
+}
+
+void seglog_sync_due(seg_log *l)
+{
+  if (l->unsynced && l->sync.interval_ms &&
+      now_ms() - l->unsynced_ms >= l->sync.interval_ms)
+    sync_last(l);
+}
+
+int seglog_append(
+    seg_log *l,
+    uint32_t offset,
+    const struct iovec *recs,
+    int n,
+    int packed,
+    off_t *pos,
+    void **at)
+{
+  uint32_t local_hdrs[2 * LOCAL_BATCH];
+  struct iovec local_iov[2 * LOCAL_BATCH];
+  uint32_t *hdrs = n <= LOCAL_BATCH ? local_hdrs : malloc(8 * (size_t)n);
+  struct iovec *iov =
+      n <= LOCAL_BATCH ? local_iov : malloc(2 * n * sizeof(*iov));
+  int result = -1;
+  if (!hdrs || !iov)
+    goto end;
+
+  size_t total = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    if (recs[i].iov_len >= SEGLOG_PACKED)
+      goto end;
+    uint32_t len_word = recs[i].iov_len | (packed ? SEGLOG_PACKED : 0);
+    hdrs[2 * i] = htonl(len_word);
+    hdrs[2 * i + 1] =
+        htonl(record_crc(len_word, recs[i].iov_base, recs[i].iov_len));
+    iov[2 * i].iov_base = &hdrs[2 * i];
+    iov[2 * i].iov_len = SEGLOG_HDR;
+    iov[2 * i + 1] = recs[i];
+    total += SEGLOG_HDR + recs[i].iov_len;
+  }
+
+  // Full, the new one starts with these
+  segment *s = l->dir->segs[l->nsegs - 1];
+  if (s->map && s->size + total > s->map_len)
+  {
+    // Nothing in the empty one yet, nobody can be reading from it
+    if (!s->size ? grow_segment(s, total) < 0 : roll(l, offset, total) < 0)
+      goto end;
+  }
+  else if (!s->map && s->size && s->size + total > SEGLOG_BYTES)
+  {
+    if (roll(l, offset, total) < 0)
+      goto end;
+  }
+  s = l->dir->segs[l->nsegs - 1];
+  if (s->map)
+  {
+    if (reserve(s, s->size + total) < 0)
+      goto end;
+    off_t p = s->size;
+    for (int i = 0; i < n; ++i)
+    {
+      memcpy(s->map + p, &hdrs[2 * i], SEGLOG_HDR);
+      memcpy(s->map + p + SEGLOG_HDR, recs[i].iov_base, recs[i].iov_len);
+      p += SEGLOG_HDR + recs[i].iov_len;
+    }
+  }
+  else if (write_all(s->fd, iov, 2 * n, s->size) < 0)
+    goto end;
+  for (int i = 0; i < n; ++i)
+  {
+    pos[i] = s->size + SEGLOG_HDR;
+    if (at)
+      at[i] = s->map ? s->map + pos[i] : 0;
+    s->size += SEGLOG_HDR + recs[i].iov_len;
+  }
+  appended(l, n, total);
+  result = 0;
+
+end:
+  if (hdrs != local_hdrs)
+    free(hdrs);
+  if (iov != local_iov)
+    free(iov);
+  return result;
+}
+
+int seglog_fd(seg_log *l, uint32_t offset, uint32_t *end)
+{
+  // Whatever was there when the segment was added is seen after this
+  uint32_t nsegs = __atomic_load_n(&l->nsegs, __ATOMIC_ACQUIRE);
+  uint32_t lo = __atomic_load_n(&l->first, __ATOMIC_ACQUIRE);
+  seglog_dir *dir = __atomic_load_n(&l->dir, __ATOMIC_ACQUIRE);
+  // The last one with a base not past offset, mostly the last one
+  uint32_t hi = nsegs - 1;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (dir->segs[mid]->base <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  // Trimmed since the record was found, the one left first is a later one
+  if (dir->segs[lo]->base > offset)
+    return -1;
+  *end = lo + 1 < nsegs ? dir->segs[lo + 1]->base : UINT32_MAX;
+  return dir->segs[lo]->fd;
+}
+
+static void segment_free(void *p, void *arg)
+{
+  segment *s = p;
+  if (s->map)
+    munmap(s->map, s->map_len);
+  close(s->fd);
+  free(s);
+}
+
+void seglog_trim(seg_log *l, uint32_t low)
+{
+  uint32_t nsegs = __atomic_load_n(&l->nsegs, __ATOMIC_ACQUIRE);
+  seglog_dir *dir = __atomic_load_n(&l->dir, __ATOMIC_ACQUIRE);
+  char path[strlen(l->path) + 16];
+  while (l->first + 1 < nsegs && dir->segs[l->first + 1]->base <= low)
+  {
+    segment *s = dir->segs[l->first];
+    // Readers that enter from now on don't look at it
+    __atomic_store_n(&l->first, l->first + 1, __ATOMIC_SEQ_CST);
+    // Readers still sending from it keep the file open (and mapped). If it
+    // can't be retired it stays open
+    segment_path(l, s->base, path, sizeof(path));
+    unlink(path);
+    epoch_retire(s, 0, segment_free);
+  }
+}
@@ -0,0 +1,106 @@
+/*
+ * Messages of a topic on disk, in a directory of segment files.
+ * Records are only appended, to the last segment, which is closed once it
+ * is SEGLOG_BYTES long and a new one goes on from the next offset. Each
+ * segment is named after the offset of its first record, so retention
+ * drops whole segments and the log can be read back after a restart.
+ * Record framing, big-endian:
+ *  4 bytes length of the record, with SEGLOG_PACKED set for packed batches
+ *  4 bytes CRC-32 of the record
+ *  Then the record, as it was sent (one message or a packed batch)
+ * A single thread at a time appends, readers take no locks. Trimming
+ * retires the segments left behind (see epoch.h), readers have to be in an
+ * epoch.
+ * A log can be mapped: every segment is mapped in whole, records are copied
+ * in there and readers get at them by address, with no calls.
+ * Appended records are in the page cache right away: readers, and the log
+ * opened again after the process dies, see them. Only a crash of the
+ * machine loses what is not synced yet, and each sync waits for the disk.
+ * A segment is synced when it is closed, the sync policy says how much can
+ * be waiting before that (see seglog_sync).
+ */
+
+#ifndef _SEGLOG_H
+#define _SEGLOG_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A segment is closed once it is this long
+#define SEGLOG_BYTES (64 << 20)
+#define SEGLOG_HDR (8)
+#define SEGLOG_PACKED (0x80000000)
+
+typedef struct SEG_LOG seg_log;
+
+// What is appended goes to disk once any of these is reached, 0 for no
+// limit. Syncing more often loses less in a crash and takes more of the
+// appends: with 1 record every append waits for the disk, with all of them
+// 0 only the closed segments are synced (and whatever the kernel writes
+// back on its own, within seconds)
+typedef struct SEGLOG_SYNC seglog_sync;
+struct SEGLOG_SYNC
+{
+  uint32_t records;     // Records appended since the last sync
+  uint64_t bytes;       // Bytes of them, headers included
+  uint32_t interval_ms; // Since the first of them was appended
+};
+
+// Called for every record found when a log is opened, in offset order
+// pos is where the record is, and rec the len bytes of it. In a mapped log
+// rec stays there until its segment is trimmed
+// Returns how many offsets the record takes, -1 if it is not valid, -2 to
+// give up opening the log
+typedef int (*seglog_found_t)(
+    void *arg,
+    uint32_t offset,
+    off_t pos,
+    const void *rec,
+    uint32_t len,
+    int packed);
+
+// Opens the log in dir, creating both if they are not there, mapped if
+// mapped is set and synced as sync says. Records found are given to found,
+// the log goes on after the last valid one. *low is set to the offset of
+// the first record kept
+// Returns the log, or NULL on error
+seg_log *seglog_open(
+    const char *dir,
+    int mapped,
+    const seglog_sync *sync,
+    uint32_t *low,
+    seglog_found_t found,
+    void *arg);
+
+// Closes the log, and deletes its segments if remove is set
+void seglog_close(seg_log *l, int remove);
+
+// Appends n records, the first one with offset, all of them to the same
+// segment. pos gets where each record is, and at (if not NULL) its address
+// in a mapped log, 0 otherwise
+// Returns 0 if OK, -1 on error, then none of them is there
+int seglog_append(
+    seg_log *l,
+    uint32_t offset,
+    const struct iovec *recs,
+    int n,
+    int packed,
+    off_t *pos,
+    void **at);
+
+// Syncs what was appended if its sync interval is over. Appends see to it
+// themselves, this is for a log that stopped getting them. Only the thread
+// appending can call it
+void seglog_sync_due(seg_log *l);
+
+// Returns the segment file with the record at offset, which must have been
+// in the log, and sets *end to the offset its next segment starts at
+// Returns -1 if its segment was trimmed meanwhile
+int seglog_fd(seg_log *l, uint32_t offset, uint32_t *end);
+
+// Drops the segments with nothing from low on. Only one thread at a time
+// trims
+void seglog_trim(seg_log *l, uint32_t low);
+
+#endif // _SEGLOG_H
@@ -0,0 +1,528 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "conn.h"
+#include "uring.h"
+
+// Submission queue entries, the kernel makes the completion queue twice that
+#define RING_ENTRIES (256)
+// Receive buffers provided to the kernel by each ring, must be a power of 2
+#define NBUFS (512)
+#define BUF_SZ (16 * 1024)
+// Buffer group, each ring has a single one
+#define BGID (0)
+
+// What a completion is about, kept in the low bits of its user_data, next
+// to the connection pointer
+#define UD_ACCEPT (0)
+#define UD_RECV (1)
+#define UD_WRITE (2)
+#define UD_WAKE (3) // Some parked connections were woken
+#define UD_MASK (3)
+
+typedef struct URING uring;
+
+typedef struct URING_CONN uconn;
+struct URING_CONN
+{
+  connection *c;
+  uring *r;
+  int recving; // Multishot receive armed
+  int writing; // writev in flight
+  int closing;
+  int dirty; // Waiting in the ring's list to get its output sent
+  uconn *next_dirty;
+  int parked; // Let go of until woken, by another thread maybe
+  uconn *next_woken;
+  struct iovec iov[IOV_BATCH]; // Has to outlive the writev submission
+};
+
+struct URING
+{
+  int fd;
+  int sfd;
+  hmap *topics;
+  char *dir_commit;
+  pthread_t thid;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // Entries filled, the kernel sees them on submit
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // Provided buffers
+  struct io_uring_buf_ring *br;
+  uint8_t *bufs;
+  unsigned br_tail;
+
+  uconn *dirty; // Connections with new output
+
+  // Woken connections are left here, and the eventfd tells the ring
+  int wfd;
+  uint64_t wval;
+  pthread_mutex_t woken_lock;
+  uconn *woken;
+};
+
+static void buf_add(uring *r, unsigned bid)
+{
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & (NBUFS - 1)];
+  b->addr = (uintptr_t)(r->bufs + (size_t)bid * BUF_SZ);
+  b->len = BUF_SZ;
+  b->bid = bid;
+  ++r->br_tail;
+}
+
+static void buf_publish(uring *r)
+{
+  __atomic_store_n(&r->br->tail, (uint16_t)r->br_tail, __ATOMIC_RELEASE);
+}
+
+static int ring_setup(uring *r)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (r->fd < 0)
+  {
+    perror("io_uring_setup");
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP))
+  {
+    fprintf(stderr, "io_uring: kernel too old\n");
+    return -1;
+  }
+
+  size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uint8_t *ring = mmap(
+      0,
+      sq_sz > cq_sz ? sq_sz : cq_sz,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      r->fd,
+      IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED)
+  {
+    perror("mmap");
+    return -1;
+  }
+  r->sqes = mmap(
+      0,
+      p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      r->fd,
+      IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+  {
+    perror("mmap");
+    return -1;
+  }
+
+  r->sq_head = (unsigned *)(ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_array = (unsigned *)(ring + p.sq_off.array);
+  r->sq_local_tail = *r->sq_tail;
+
+  r->cq_head = (unsigned *)(ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  // Ring of provided buffers, receives pick one when data arrives instead
+  // of each connection pinning its own
+  r->br = mmap(
+      0,
+      NBUFS * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+  r->bufs = malloc((size_t)NBUFS * BUF_SZ);
+  if (r->br == MAP_FAILED || !r->bufs)
+  {
+    perror("malloc");
+    return -1;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)r->br;
+  reg.ring_entries = NBUFS;
+  reg.bgid = BGID;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    perror("io_uring_register");
+    return -1;
+  }
+  r->br_tail = 0;
+  for (unsigned bid = 0; bid < NBUFS; ++bid)
+    buf_add(r, bid);
+  buf_publish(r);
+
+  r->wfd = eventfd(0, EFD_CLOEXEC);
+  if (r->wfd < 0)
+  {
+    perror("eventfd");
+    return -1;
+  }
+  pthread_mutex_init(&r->woken_lock, 0);
+  return 0;
+}
+
+// Hands the filled entries to the kernel, waiting for at least wait
+// completions
+static int ring_submit(uring *r, unsigned wait)
+{
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned pending = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  int status = syscall(
+      __NR_io_uring_enter,
+      r->fd,
+      pending,
+      wait,
+      wait ? IORING_ENTER_GETEVENTS : 0,
+      0,
+      0);
+  if (status < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+  {
+    perror("io_uring_enter");
+    return -1;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *get_sqe(uring *r)
+{
+  while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+         r->sq_entries)
+    if (ring_submit(r, 0) < 0)
+      return 0;
+  unsigned idx = r->sq_local_tail++ & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  return sqe;
+}
+
+static int prep_accept(uring *r)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = r->sfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = UD_ACCEPT;
+  return 0;
+}
+
+static int prep_recv(uring *r, uconn *uc)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->c->cfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BGID;
+  sqe->user_data = (uintptr_t)uc | UD_RECV;
+  uc->recving = 1;
+  return 0;
+}
+
+static int prep_write(uring *r, uconn *uc)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = uc->c->cfd;
+  sqe->addr = (uintptr_t)uc->iov;
+  sqe->len = conn_out_iov(uc->c, uc->iov, IOV_BATCH);
+  sqe->user_data = (uintptr_t)uc | UD_WRITE;
+  uc->writing = 1;
+  return 0;
+}
+
+static int prep_wake(uring *r)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = r->wfd;
+  sqe->addr = (uintptr_t)&r->wval;
+  sqe->len = sizeof(r->wval);
+  sqe->user_data = UD_WAKE;
+  return 0;
+}
+
+static void mark_dirty(uring *r, uconn *uc)
+{
+  if (uc->dirty)
+    return;
+  uc->dirty = 1;
+  uc->next_dirty = r->dirty;
+  r->dirty = uc;
+}
+
+static void start_close(uconn *uc)
+{
+  if (uc->closing)
+    return;
+  uc->closing = 1;
+  // Makes the armed receive complete, the connection goes away after that
+  if (uc->recving)
+    shutdown(uc->c->cfd, SHUT_RDWR);
+}
+
+static void maybe_release(uconn *uc)
+{
+  if (!uc->closing || uc->recving || uc->writing || uc->dirty || uc->parked)
+    return;
+  // Once no stream can be woken, the ring may still have to get it back
+  // from the woken list
+  conn_stop_streams(uc->c);
+  if (__atomic_load_n(&uc->c->notify_pending, __ATOMIC_ACQUIRE))
+    return;
+  printf("[%3d] Connection closed\n", uc->c->cfd);
+  conn_destroy(uc->c);
+  free(uc);
+}
+
+// Called by whoever woke a parked connection, or a stream of it
+static void wake_uconn(connection *c)
+{
+  uconn *uc = c->owner;
+  uring *r = uc->r;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&r->woken_lock);
+  uc->next_woken = r->woken;
+  r->woken = uc;
+  pthread_mutex_unlock(&r->woken_lock);
+  if (write(r->wfd, &one, sizeof(one)) < 0)
+    perror("write");
+}
+
+// Lets go of the connection if a long poll parked it, and pushes whatever
+// its streams have
+static void settle(uring *r, uconn *uc)
+{
+  int status = conn_settle(uc->c);
+  if (status < 0 || conn_pump(uc->c) < 0)
+    start_close(uc);
+  else
+    uc->parked = status;
+  if (conn_has_output(uc->c))
+    mark_dirty(r, uc);
+}
+
+static void on_accept(uring *r, struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE) && prep_accept(r) < 0)
+    fprintf(stderr, "io_uring: could not accept connections anymore\n");
+  if (cqe->res < 0)
+  {
+    fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    return;
+  }
+
+  uconn *uc = calloc(1, sizeof(*uc));
+  if (uc)
+    uc->c = conn_create(cqe->res, r->topics, r->dir_commit);
+  if (!uc || !uc->c)
+  {
+    free(uc);
+    close(cqe->res);
+    return;
+  }
+  uc->r = r;
+  uc->c->owner = uc;
+  uc->c->on_wake = wake_uconn;
+  uc->c->on_notify = wake_uconn;
+  // Writes are plain writev submissions, there is no sendfile to the ring
+  uc->c->copy_files = 1;
+  printf("[%3d] Connection opened\n", cqe->res);
+  if (prep_recv(r, uc) < 0)
+  {
+    uc->closing = 1;
+    maybe_release(uc);
+  }
+}
+
+static void on_recv(uring *r, uconn *uc, struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uc->recving = 0;
+
+  if (cqe->res > 0)
+  {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    // While parked, requests just pile up in the connection
+    if (!uc->closing &&
+        conn_feed(uc->c, r->bufs + (size_t)bid * BUF_SZ, cqe->res) < 0)
+      start_close(uc);
+    buf_add(r, bid);
+    if (!uc->closing && !uc->parked)
+      settle(r, uc);
+  }
+  else if (cqe->res != -ENOBUFS) // Out of buffers just needs a new receive
+    start_close(uc);
+
+  if (!uc->recving && !uc->closing && prep_recv(r, uc) < 0)
+    start_close(uc);
+  maybe_release(uc);
+}
+
+static void on_write(uring *r, uconn *uc, struct io_uring_cqe *cqe)
+{
+  uc->writing = 0;
+  if (cqe->res < 0)
+    start_close(uc);
+  else
+  {
+    conn_out_consume(uc->c, cqe->res);
+    if (conn_has_output(uc->c))
+      mark_dirty(r, uc);
+  }
+  maybe_release(uc);
+}
+
+static void on_woken(uring *r, struct io_uring_cqe *cqe)
+{
+  if (prep_wake(r) < 0)
+    fprintf(stderr, "io_uring: could not wake connections anymore\n");
+
+  pthread_mutex_lock(&r->woken_lock);
+  uconn *uc = r->woken;
+  r->woken = 0;
+  pthread_mutex_unlock(&r->woken_lock);
+
+  while (uc)
+  {
+    uconn *next = uc->next_woken;
+    int was_parked = uc->parked;
+    uc->parked = 0;
+    __atomic_store_n(&uc->c->notify_pending, 0, __ATOMIC_RELEASE);
+    if (!uc->closing)
+    {
+      if (was_parked && conn_resume(uc->c) < 0)
+        start_close(uc);
+      else
+        settle(r, uc);
+    }
+    maybe_release(uc);
+    uc = next;
+  }
+}
+
+// Queues one writev for each connection that got new output since the
+// last submission, so all responses produced by a batch of receives leave
+// together
+static void flush_dirty(uring *r)
+{
+  while (r->dirty)
+  {
+    uconn *uc = r->dirty;
+    r->dirty = uc->next_dirty;
+    uc->dirty = 0;
+    if (!uc->closing && !uc->writing && conn_has_output(uc->c) &&
+        prep_write(r, uc) < 0)
+      start_close(uc);
+    maybe_release(uc);
+  }
+}
+
+static void *uring_loop(void *parg_ring)
+{
+  uring *r = parg_ring;
+
+  if (prep_accept(r) < 0 || prep_wake(r) < 0)
+    return 0;
+  while (1)
+  {
+    flush_dirty(r);
+    buf_publish(r);
+    if (ring_submit(r, 1) < 0)
+      break;
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+      uconn *uc = (uconn *)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_MASK);
+      switch (cqe->user_data & UD_MASK)
+      {
+      case UD_ACCEPT:
+        on_accept(r, cqe);
+        break;
+      case UD_RECV:
+        on_recv(r, uc, cqe);
+        break;
+      case UD_WRITE:
+        on_write(r, uc, cqe);
+        break;
+      case UD_WAKE:
+        on_woken(r, cqe);
+        break;
+      }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+int uring_run(int *sfds, int nsfds, int nrings, hmap *topics, char *dir_commit)
+{
+  // A socket no ring accepts on would still get its share of connections
+  if (nrings < nsfds)
+    nrings = nsfds;
+  uring *rings = calloc(nrings, sizeof(*rings));
+  if (!rings)
+    return -1;
+  for (int i = 0; i < nrings; ++i)
+  {
+    rings[i].sfd = sfds[i % nsfds];
+    rings[i].topics = topics;
+    rings[i].dir_commit = dir_commit;
+    if (ring_setup(&rings[i]) < 0)
+      return -1;
+  }
+  for (int i = 1; i < nrings; ++i)
+    if (pthread_create(&rings[i].thid, 0, uring_loop, &rings[i]))
+    {
+      perror("pthread_create");
+      return -1;
+    }
+  uring_loop(&rings[0]);
+  return -1;
+}
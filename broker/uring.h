@@ -0,0 +1,19 @@
+/*
+ * io_uring broker mode: each loop thread owns a ring with a multishot
+ * accept on the listening socket, multishot receives into a ring of
+ * provided buffers and writev responses, all submitted in batches.
+ * Only built with `make URING=1`.
+ */
+
+#ifndef _URING_H
+#define _URING_H 1
+
+#include "hmap.h"
+
+// Runs nrings io_uring loops, accepting connections on the nsfds listening
+// sockets in turns. There are nsfds loops at least, so every socket has
+// one accepting on it
+// Only returns on error, with -1
+int uring_run(int *sfds, int nsfds, int nrings, hmap *topics, char *dir_commit);
+
+#endif // _URING_H
@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "wait.h"
+
+// Timer resolution
+#define TICK_MS (10)
+// Slots of the timer wheel, a waiter goes to the one of its deadline tick
+// and is skipped until the wheel gets to that tick
+#define WHEEL_SLOTS (512)
+
+// Lock of the wheel and the timer, taken after the lock of a wait list
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static waiter *wheel[WHEEL_SLOTS];
+static uint64_t next_tick; // First tick the timer did not expire yet
+static int nparked;        // In the wheel
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t timer_cond;
+
+static uint64_t now_ticks()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+// Called with the list lock held
+static void unlink_list(waiter *w)
+{
+  if (w->prev)
+    w->prev->next = w->next;
+  else
+    w->list->first = w->next;
+  if (w->next)
+    w->next->prev = w->prev;
+  __atomic_sub_fetch(&w->list->nwaiters, 1, __ATOMIC_SEQ_CST);
+  w->waiting = 0;
+}
+
+// Called with wheel_lock held
+static void unlink_wheel(waiter *w)
+{
+  waiter **slot = &wheel[w->deadline % WHEEL_SLOTS];
+  if (w->tprev)
+    w->tprev->tnext = w->tnext;
+  else
+    *slot = w->tnext;
+  if (w->tnext)
+    w->tnext->tprev = w->tprev;
+  w->timed = 0;
+  --nparked;
+}
+
+// Called with the list lock held
+static void unlink_waiter(waiter *w)
+{
+  unlink_list(w);
+  if (!w->timed)
+    return;
+  pthread_mutex_lock(&wheel_lock);
+  unlink_wheel(w);
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+// Called with wheel_lock held, which it lets go to wait for a list lock
+static void expire_slot(uint64_t tick, uint64_t now)
+{
+  wait_list *held = 0; // Locked in order, the slot was looked at again
+  waiter *w = wheel[tick % WHEEL_SLOTS];
+  while (w)
+  {
+    waiter *tnext = w->tnext;
+    if (w->deadline > now)
+    {
+      w = tnext;
+      continue;
+    }
+    // Topics are never freed while the broker runs, nor their lists
+    wait_list *l = w->list;
+    if (l == held || !pthread_mutex_trylock(&l->lock))
+    {
+      unlink_list(w);
+      unlink_wheel(w);
+      w->wake(w);
+      if (l != held)
+        pthread_mutex_unlock(&l->lock);
+    }
+    else
+    {
+      // Take them in order, the slot may change meanwhile
+      if (held)
+        pthread_mutex_unlock(&held->lock);
+      pthread_mutex_unlock(&wheel_lock);
+      pthread_mutex_lock(&l->lock);
+      pthread_mutex_lock(&wheel_lock);
+      held = l;
+      tnext = wheel[tick % WHEEL_SLOTS];
+    }
+    w = tnext;
+  }
+  if (held)
+    pthread_mutex_unlock(&held->lock);
+}
+
+static void *timer_run(void *unused)
+{
+  pthread_mutex_lock(&wheel_lock);
+  while (1)
+  {
+    // Nobody waits, nothing to tick for
+    while (!nparked)
+      pthread_cond_wait(&timer_cond, &wheel_lock);
+
+    uint64_t now = now_ticks();
+    // After a long sleep every slot may have something due, once is enough
+    if (next_tick + WHEEL_SLOTS <= now)
+      next_tick = now - WHEEL_SLOTS + 1;
+    for (; next_tick <= now; ++next_tick)
+      expire_slot(next_tick, now);
+
+    uint64_t ms = (now + 1) * TICK_MS;
+    struct timespec until = {ms / 1000, (ms % 1000) * 1000000};
+    pthread_cond_timedwait(&timer_cond, &wheel_lock, &until);
+  }
+  return 0;
+}
+
+static void timer_start()
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thid;
+  if (pthread_create(&thid, 0, timer_run, 0))
+  {
+    // Waits will only end with a message
+    perror("pthread_create");
+    return;
+  }
+  pthread_detach(thid);
+}
+
+void wait_list_init(wait_list *l)
+{
+  pthread_mutex_init(&l->lock, 0);
+  l->first = 0;
+  l->nwaiters = 0;
+}
+
+void wait_list_destroy(wait_list *l)
+{
+  pthread_mutex_destroy(&l->lock);
+}
+
+void wait_begin(wait_list *l)
+{
+  pthread_once(&timer_once, timer_start);
+  // Appends look at this before taking the lock, it has to be visible
+  // before we check whether there is something to wait for. That check is
+  // an acquire load, only the fence keeps it from going before the add
+  __atomic_add_fetch(&l->nwaiters, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&l->lock);
+}
+
+void wait_abort(wait_list *l)
+{
+  __atomic_sub_fetch(&l->nwaiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void wait_park(wait_list *l, waiter *w, uint32_t offset, uint32_t max_wait_ms)
+{
+  w->offset = offset;
+  w->list = l;
+  w->waiting = 1;
+  w->prev = 0;
+  w->next = l->first;
+  if (l->first)
+    l->first->prev = w;
+  l->first = w;
+
+  w->timed = max_wait_ms > 0;
+  if (!w->timed)
+  {
+    pthread_mutex_unlock(&l->lock);
+    return;
+  }
+  pthread_mutex_lock(&wheel_lock);
+  uint64_t now = now_ticks();
+  w->deadline = now + (max_wait_ms + TICK_MS - 1) / TICK_MS;
+  // The timer was idle, it starts ticking from here
+  if (!nparked)
+    next_tick = now;
+
+  waiter **slot = &wheel[w->deadline % WHEEL_SLOTS];
+  w->tprev = 0;
+  w->tnext = *slot;
+  if (*slot)
+    (*slot)->tprev = w;
+  *slot = w;
+  if (!nparked++)
+    pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&wheel_lock);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void wait_cancel(waiter *w)
+{
+  // Whoever ends a wait holds the list lock until w->wake returns
+  wait_list *l = w->list;
+  if (!l)
+    return;
+  pthread_mutex_lock(&l->lock);
+  if (w->waiting)
+    unlink_waiter(w);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void wait_wake(wait_list *l, uint32_t end)
+{
+  // Publishing is a release store, without the fence this load could go
+  // before it, and miss a waiter that then misses the message as well
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&l->nwaiters, __ATOMIC_SEQ_CST))
+    return;
+  pthread_mutex_lock(&l->lock);
+  waiter *w = l->first;
+  while (w)
+  {
+    waiter *next = w->next;
+    if (w->offset < end)
+    {
+      unlink_waiter(w);
+      w->wake(w);
+    }
+    w = next;
+  }
+  pthread_mutex_unlock(&l->lock);
+}
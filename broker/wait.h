@@ -0,0 +1,63 @@
+/*
+ * Requests waiting for a message to be published.
+ * Each topic has a list of waiters, woken by whoever appends to the topic.
+ * A single timer thread wakes the ones whose time is up, keeping them all
+ * in a timer wheel.
+ */
+
+#ifndef _WAIT_H
+#define _WAIT_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef struct WAITER waiter;
+
+// Called once for each wait, from the thread that ended it
+// The waiter is no longer in any list by then, it can be used again
+typedef void (*wake_fn_t)(waiter *w);
+
+typedef struct WAIT_LIST wait_list;
+struct WAIT_LIST
+{
+  pthread_mutex_t lock; // Held from wait_begin to wait_park or wait_abort
+  waiter *first;
+  int nwaiters; // Waiters in the list, or about to be
+};
+
+void wait_list_init(wait_list *l);
+void wait_list_destroy(wait_list *l);
+
+struct WAITER
+{
+  wake_fn_t wake;
+  uint32_t offset;   // Message we wait for
+  int timed;         // In the wheel, until deadline
+  uint64_t deadline; // Wheel tick when we give up
+
+  wait_list *list; // Of the last wait, only the owner of w changes it
+  int waiting;     // Still in list
+  waiter *prev;
+  waiter *next;
+  waiter *tprev; // Wheel slot
+  waiter *tnext;
+};
+
+// To wait, call wait_begin, check that what we wait for did not happen yet
+// and then either wait_park or wait_abort
+// Nothing can be woken between wait_begin and wait_park, so appends done
+// before the check are seen by it and the ones done after it wake us
+void wait_begin(wait_list *l);
+void wait_abort(wait_list *l);
+
+// w->wake is called once the message at offset is published, or after
+// max_wait_ms (0 to wait as long as it takes)
+void wait_park(wait_list *l, waiter *w, uint32_t offset, uint32_t max_wait_ms);
+
+// Takes w out of its wait without calling w->wake, if it's still waiting
+void wait_cancel(waiter *w);
+
+// Wakes the waiters of messages before end, called after publishing them
+void wait_wake(wait_list *l, uint32_t end);
+
+#endif // _WAIT_H
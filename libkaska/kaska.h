@@ -73,5 +73,106 @@ int commit(char *client, char *topic, int offset);
 // Devuelve el offset y un número negativo en caso de error.
 int commited(char *client, char *topic);
 
+// EXTENSIONES
+
+// Sets how many requests can be waiting for their response at the same
+// time (1 by default: each request waits for the previous response).
+// subscribe() and poll() use it to ask about several topics at once.
+// Returns 0 if OK and a negative value on error.
+int set_pipeline_depth(int depth);
+
+// Sets how long poll() waits for a message to arrive when there is none
+// (0 by default: it returns 0 right away). The broker holds the request,
+// the client does not ask again meanwhile.
+// Returns 0 if OK and a negative value on error.
+int set_poll_wait(int max_wait_ms);
+
+// Sends the nmsgs messages in a single request, msgs[i] of msg_sizes[i]
+// bytes to topics[i]. Consecutive messages to the same topic are appended
+// together, with consecutive offsets.
+// offsets[i] gets the offset of msgs[i], or a negative value if it could
+// not be sent.
+// Returns 0 if OK and a negative value if any message failed.
+int send_msgs(
+    int nmsgs,
+    char **topics,
+    int *msg_sizes,
+    void **msgs,
+    int *offsets);
+
+// Called with the offset a message sent with send_msg_async got, or a
+// negative value if it could not be sent
+typedef void (*send_callback)(void *ctx, int offset);
+
+// Sends the message without waiting for the broker's response: done is
+// called with ctx once it arrives, from within a later call to the library.
+// Callbacks run in the order the messages were sent and must not call the
+// library themselves.
+// The message is sent or copied before returning, its memory can be reused
+// then.
+// Up to set_pipeline_depth() requests can wait for their response, beyond
+// that the call waits for the oldest one.
+// Returns 0 if the message was queued, and then done gets its result, and
+// a negative value on error.
+int send_msg_async(
+    char *topic,
+    int msg_size,
+    void *msg,
+    send_callback done,
+    void *ctx);
+
+// Makes send_msg_async keep the messages of each topic in the library,
+// until the ones of a topic add up to batch_bytes or the oldest one waited
+// linger_ms. Then everything waiting goes to the broker in a single request.
+// Limits are checked on every send_msg_async; a producer that stops sending
+// should call flush(). Callbacks keep the send order within each topic,
+// not across topics. With linger_ms 0 (the default), each message is sent
+// right away.
+// Returns 0 if OK and a negative value on error.
+int set_linger(int linger_ms, int batch_bytes);
+
+// Compresses the batches set_linger() makes with codec (0: none, the
+// default, 1: LZ). The broker stores them compressed and consumers
+// uncompress them in poll(). A batch that does not get smaller goes
+// uncompressed.
+// Returns 0 if OK and a negative value on error.
+int set_compression(int codec);
+
+// Gets the bytes of the messages sent to the topic and the bytes the broker
+// stores for them, which are fewer if they came compressed.
+// Returns 0 if OK and a negative value on error.
+int topic_stats(char *topic, long long *raw_bytes, long long *stored_bytes);
+
+// Sends whatever send_msg_async kept waiting and waits until every request
+// sent has its response, calling the pending send_msg_async callbacks.
+// Returns 0 if OK and a negative value on error.
+int flush(void);
+
+// Sets how much of the topic the broker keeps: up to max_msgs messages,
+// max_bytes stored bytes and messages up to max_age_ms old, 0 for no limit.
+// The oldest messages are dropped, the offsets of the others stay the same.
+// poll() and streams skip the ones dropped, msg_length() gives -2 for them.
+// Returns 0 if OK and a negative value on error.
+int set_retention(
+    char *topic,
+    int max_msgs,
+    long long max_bytes,
+    int max_age_ms);
+
+// Gets the offset of the oldest message the broker keeps for the topic.
+// Returns that offset if OK and a negative value on error.
+int low_offset(char *topic);
+
+// Opens a stream of the messages of the topic from offset: the broker
+// sends them as they arrive, up to window bytes ahead of what stream_poll
+// returned. Streams are independent of subscribe() and poll().
+// Returns the stream number (0, 1...) if OK and a negative value on error.
+int stream_open(char *topic, int offset, int window);
+
+// Waits for the next message of any open stream; the two parameters
+// are output, as in poll().
+// Returns the size of the message and a negative number on error.
+int stream_poll(char **topic, void **msg);
+
 #endif // _KASKA_H
 
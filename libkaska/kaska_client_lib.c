@@ -1,8 +1,10 @@
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <netdb.h>
+#include <time.h>
 
 #include <sys/uio.h>
 #include <sys/types.h>
@@ -13,21 +15,13 @@
 #include "kaska.h"
 #include "map.h"
 
-// This function is called first by all library functions to make sure
-// that a connection is established. It returns a socket descriptor
-// that can be used to send data to broker.
-static int ensure_connected()
+// Opens a new connection to the broker
+// Returns its socket descriptor, -1 on error
+static int connect_broker()
 {
-  static int init = 0; // Initial value is 0
-                       // If non zero, the connection was already established
-  static int sfd;
+  int sfd;
   int status;
 
-  if (init)
-    return sfd;
-
-  init = 1;
-
   char *port = getenv("BROKER_PORT");
   char *hostname = getenv("BROKER_HOST");
 
@@ -71,9 +65,614 @@ static int ensure_connected()
   return sfd;
 }
 
+// This function is called first by all library functions to make sure
+// that a connection is established. It returns a socket descriptor
+// that can be used to send data to broker.
+static int ensure_connected()
+{
+  static int init = 0; // Initial value is 0
+                       // If non zero, the connection was already established
+  static int sfd;
+
+  if (init)
+    return sfd;
+
+  init = 1;
+  sfd = connect_broker();
+  return sfd;
+}
+
+
+// PIPELINE
+//
+// Requests go through a ring of pending requests. A request is written to
+// the socket once someone needs a response (or the ring is full), together
+// with every other request queued before it, and its response is read in
+// order when it arrives. The ring size is the pipeline depth: how many
+// requests can be waiting for a response at the same time. With a depth of
+// 1 every request waits for its response before the next one goes out.
+
+// Called with the response of a request
+// result is the value in the response; for POLL, it's the message length
+// and msg the message, for FETCH_ALL, the number of topics and msg an
+// array with the fetched batch of each one, and for SEND_BATCH, the number
+// of topics and msg an array with the result of each one.
+// The callback then owns msg.
+typedef void (*response_cb)(void *ctx, int arg, int result, void *msg);
+
+typedef struct PENDING pending;
+struct PENDING
+{
+  uint8_t op;
+  uint8_t hdr[21]; // Opcode and fixed size fields, as sent
+  size_t hdr_len;
+  struct iovec body[2]; // Variable size fields, sent from the caller's memory
+  int nbody;
+  response_cb done;
+  void *ctx;
+  int arg;
+  // For send_msg_async
+  send_callback send_done;
+  void *send_ctx;
+};
+
+// Messages received ahead of time, consecutive from some offset on
+typedef struct FETCHED fetched;
+struct FETCHED
+{
+  int count;
+  int next; // First one not handed out yet
+  // Where the topic starts now if the messages asked for were dropped, then
+  // there are none, -1 otherwise
+  int low;
+  struct
+  {
+    void *msg;
+    int len;
+  } m[];
+};
+
+static void release_fetched(fetched *f)
+{
+  if (!f)
+    return;
+  for (int i = f->next; i < f->count; ++i)
+    free(f->m[i].msg);
+  free(f);
+}
+
+static pending *ring;
+static unsigned ring_cap;  // Pipeline depth
+static unsigned ring_head; // Oldest request waiting for its response
+static unsigned ring_sent; // First request not written yet
+static unsigned ring_tail; // Where the next request goes
+
+// Responses are read in chunks, there may be several of them waiting
+#define RBUF_SZ (16 * 1024)
+
+typedef struct READER reader;
+struct READER
+{
+  uint8_t buf[RBUF_SZ];
+  size_t pos;
+  size_t len;
+};
+
+static reader responses;
+
+// Every pending request fails, the connection is no longer usable
+static void fail_pending()
+{
+  while (ring_head != ring_tail)
+  {
+    pending *p = &ring[ring_head++ % ring_cap];
+    if (p->done)
+      p->done(p->ctx, p->arg, -1, 0);
+  }
+  ring_sent = ring_head;
+}
+
+// Writes all of iov, which gets modified
+static int send_all(int sfd, struct iovec *iov, int iov_count)
+{
+  // The socket is blocking, but a signal could still cut a write short,
+  // or stop it before anything went
+  while (iov_count)
+  {
+    ssize_t sent = writev(sfd, iov, iov_count);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0)
+      return -1;
+    while (iov_count && (size_t)sent >= iov->iov_len)
+    {
+      sent -= iov->iov_len;
+      ++iov;
+      --iov_count;
+    }
+    if (iov_count)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+// Writes every request queued and not sent yet
+static int flush_requests(int sfd)
+{
+  while (ring_sent != ring_tail)
+  {
+    struct iovec iov[64 * 3];
+    int iov_count = 0;
+    unsigned last = ring_sent;
+    for (; last != ring_tail && iov_count + 3 <= 64 * 3; ++last)
+    {
+      pending *p = &ring[last % ring_cap];
+      iove_setup(iov, iov_count++, p->hdr_len, p->hdr);
+      for (int i = 0; i < p->nbody; ++i)
+        iov[iov_count++] = p->body[i];
+    }
+    if (send_all(sfd, iov, iov_count) < 0)
+    {
+      fail_pending();
+      return -1;
+    }
+    ring_sent = last;
+  }
+  return 0;
+}
+
+// Copies the next n bytes from the socket to dst, using what was already
+// read first
+static int read_bytes(int sfd, reader *r, void *dst, size_t n)
+{
+  size_t have = r->len - r->pos;
+  if (have >= n)
+  {
+    memcpy(dst, r->buf + r->pos, n);
+    r->pos += n;
+    return 0;
+  }
+  memcpy(dst, r->buf + r->pos, have);
+  r->pos = r->len = 0;
+  n -= have;
+  dst = (uint8_t *)dst + have;
+
+  // Big messages go straight to their destination, small pieces bring
+  // the responses after them along
+  if (n >= RBUF_SZ)
+    return recv(sfd, dst, n, MSG_WAITALL) == (ssize_t)n ? 0 : -1;
+  while (r->len < n)
+  {
+    ssize_t nread = recv(sfd, r->buf + r->len, RBUF_SZ - r->len, 0);
+    if (nread <= 0)
+      return -1;
+    r->len += nread;
+  }
+  memcpy(dst, r->buf, n);
+  r->pos = n;
+  return 0;
+}
+
+// Adds a message at the end of the batch, which grows as needed
+static int fetched_add(fetched **f, int *cap, void *msg, int len)
+{
+  if (!*f || (*f)->count == *cap)
+  {
+    int ncap = *cap ? *cap * 2 : 16;
+    fetched *nf = realloc(*f, sizeof(*nf) + ncap * sizeof(nf->m[0]));
+    if (!nf)
+      return -1;
+    if (!*f)
+    {
+      nf->count = nf->next = 0;
+      nf->low = -1;
+    }
+    *f = nf;
+    *cap = ncap;
+  }
+  (*f)->m[(*f)->count].msg = msg;
+  (*f)->m[(*f)->count].len = len;
+  ++(*f)->count;
+  return 0;
+}
+
+// An empty batch saying the messages from low on are the oldest left
+static fetched *fetched_gone(uint32_t low)
+{
+  fetched *f = malloc(sizeof(*f));
+  if (f)
+  {
+    f->count = f->next = 0;
+    f->low = low;
+  }
+  return f;
+}
+
+// Adds the messages of a packed batch to f, from the first one on
+static int unpack(
+    const uint8_t *batch,
+    size_t batch_len,
+    uint32_t first,
+    fetched **f,
+    int *cap)
+{
+  uint32_t v[2];
+  if (batch_len < PACKED_HDR_SIZE(0))
+    return -1;
+  memcpy(v, batch, 8);
+  uint32_t codec = ntohl(v[0]);
+  uint32_t n = ntohl(v[1]);
+  if (n > (batch_len - PACKED_HDR_SIZE(0)) / 4 || first >= n)
+    return -1;
+  size_t raw_len = 0;
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    memcpy(v, batch + PACKED_HDR_SIZE(i), 4);
+    raw_len += ntohl(v[0]);
+  }
+
+  const uint8_t *data = batch + PACKED_HDR_SIZE(n);
+  size_t data_len = batch_len - PACKED_HDR_SIZE(n);
+  uint8_t *raw = 0;
+  if (codec == CODEC_LZ)
+  {
+    raw = malloc(raw_len ? raw_len : 1);
+    if (!raw || lz_decompress(data, data_len, raw, raw_len) < 0)
+    {
+      free(raw);
+      return -1;
+    }
+    data = raw;
+  }
+  else if (codec != CODEC_NONE || data_len != raw_len)
+    return -1;
+
+  int result = 0;
+  size_t pos = 0;
+  for (uint32_t i = 0; i < n && !result; ++i)
+  {
+    memcpy(v, batch + PACKED_HDR_SIZE(i), 4);
+    uint32_t len = ntohl(v[0]);
+    if (i >= first)
+    {
+      void *m = malloc(len ? len : 1);
+      if (m)
+        memcpy(m, data + pos, len);
+      if (!m || fetched_add(f, cap, m, len) < 0)
+      {
+        free(m);
+        result = -1;
+      }
+    }
+    pos += len;
+  }
+  free(raw);
+  return result;
+}
+
+// Reads a FETCH response
+// Returns the number of messages, with the batch in *f (0 if there are
+// none), -1 if the connection failed
+static int read_fetched(int sfd, fetched **f)
+{
+  // 4 bytes: number of items = N, FETCH_GONE if the offset was dropped
+  // N * 8 bytes: length of each item, and the index of the first message
+  //   wanted if the item is a packed batch (FETCH_PLAIN otherwise)
+  // Then the N items
+  // With FETCH_GONE, 4 bytes: the low offset
+  uint32_t count;
+  *f = 0;
+  if (read_bytes(sfd, &responses, &count, 4) < 0)
+    return -1;
+  count = ntohl(count);
+  if (!count)
+    return 0;
+  if (count == FETCH_GONE)
+  {
+    uint32_t low;
+    if (read_bytes(sfd, &responses, &low, 4) < 0)
+      return -1;
+    *f = fetched_gone(ntohl(low));
+    return 0;
+  }
+  uint32_t *items = malloc(8 * (size_t)count);
+  if (!items || read_bytes(sfd, &responses, items, 8 * (size_t)count) < 0)
+  {
+    free(items);
+    return -1;
+  }
+
+  fetched *b = 0;
+  int cap = 0;
+  int result = 0;
+  for (uint32_t i = 0; i < count && !result; ++i)
+  {
+    uint32_t len = ntohl(items[2 * i]);
+    uint32_t index = ntohl(items[2 * i + 1]);
+    void *data = malloc(len ? len : 1);
+    if (!data || read_bytes(sfd, &responses, data, len) < 0)
+      result = -1;
+    else if (index == FETCH_PLAIN)
+    {
+      if (fetched_add(&b, &cap, data, len) < 0)
+        result = -1;
+      else
+        data = 0;
+    }
+    else if (unpack(data, len, index, &b, &cap) < 0)
+      result = -1;
+    free(data);
+  }
+  free(items);
+  if (result < 0)
+  {
+    release_fetched(b);
+    return -1;
+  }
+  *f = b;
+  return b ? b->count : 0;
+}
+
+// Reads the response of the oldest pending request
+static int read_response(int sfd)
+{
+  pending *p = &ring[ring_head % ring_cap];
+  int result;
+  void *msg = 0;
+
+  // Responses are the same whether topics went by name or by ID
+  switch (p->op & ~OP_BY_ID)
+  {
+  case OP_CREATE_TOPIC:
+  case OP_COMMIT:
+  {
+    // 1 byte status
+    int8_t status;
+    if (read_bytes(sfd, &responses, &status, 1) < 0)
+      goto connection_lost;
+    result = status;
+    break;
+  }
+  case OP_POLL:
+  case OP_POLL_WAIT:
+  {
+    // 4 bytes: msg len, 0 means message at offset for topic does not exist = N
+    // N bytes: msg
+    // POLL_GONE instead if the message was dropped, then 4 bytes: low offset
+    uint32_t msg_len;
+    if (read_bytes(sfd, &responses, &msg_len, 4) < 0)
+      goto connection_lost;
+    msg_len = ntohl(msg_len);
+    if (msg_len == POLL_GONE)
+    {
+      uint32_t low;
+      if (read_bytes(sfd, &responses, &low, 4) < 0)
+        goto connection_lost;
+      msg = fetched_gone(ntohl(low));
+      result = 0;
+      break;
+    }
+    printf("Receiving a message of length: %u\n", msg_len);
+    if (msg_len)
+    {
+      msg = malloc(msg_len);
+      if (!msg || read_bytes(sfd, &responses, msg, msg_len) < 0)
+      {
+        free(msg);
+        goto connection_lost;
+      }
+    }
+    result = msg_len;
+    break;
+  }
+  case OP_SEND_BATCH:
+  case OP_SEND_PACKED:
+  {
+    // 4 bytes for each topic (network order): offset of its first message,
+    // negative for error. arg is how many
+    int32_t *offsets = malloc((p->arg ? p->arg : 1) * sizeof(*offsets));
+    if (!offsets ||
+        read_bytes(sfd, &responses, offsets, p->arg * sizeof(*offsets)) < 0)
+    {
+      free(offsets);
+      goto connection_lost;
+    }
+    for (int i = 0; i < p->arg; ++i)
+      offsets[i] = ntohl(offsets[i]);
+    msg = offsets;
+    result = p->arg;
+    break;
+  }
+  case OP_TOPIC_STATS:
+  {
+    // 8 bytes bytes received (network order), 8 bytes bytes stored
+    // All ones if no such topic
+    uint32_t v[4];
+    uint64_t *stats = malloc(2 * sizeof(*stats));
+    if (!stats || read_bytes(sfd, &responses, v, sizeof(v)) < 0)
+    {
+      free(stats);
+      goto connection_lost;
+    }
+    stats[0] = (uint64_t)ntohl(v[0]) << 32 | ntohl(v[1]);
+    stats[1] = (uint64_t)ntohl(v[2]) << 32 | ntohl(v[3]);
+    result = stats[0] == UINT64_MAX ? -1 : 0;
+    msg = stats;
+    break;
+  }
+  case OP_FETCH_ALL:
+  {
+    // A FETCH response for each topic, in the order they were asked for
+    // arg is how many
+    fetched **fs = calloc(p->arg ? p->arg : 1, sizeof(*fs));
+    if (!fs)
+      goto connection_lost;
+    for (int i = 0; i < p->arg; ++i)
+      if (read_fetched(sfd, &fs[i]) < 0)
+      {
+        while (i--)
+          release_fetched(fs[i]);
+        free(fs);
+        goto connection_lost;
+      }
+    msg = fs;
+    result = p->arg;
+    break;
+  }
+  default:
+  {
+    // 4 bytes value (network order), negative for errors
+    int32_t value;
+    if (read_bytes(sfd, &responses, &value, 4) < 0)
+      goto connection_lost;
+    result = ntohl(value);
+    break;
+  }
+  }
+
+  ++ring_head;
+  if (p->done)
+    p->done(p->ctx, p->arg, result, msg);
+  return 0;
+
+connection_lost:
+  fail_pending();
+  return -1;
+}
+
+// Starts a new request, waiting for the oldest one to be answered if the
+// pipeline is full
+static pending *req_new(int sfd, uint8_t op)
+{
+  if (!ring)
+  {
+    ring = malloc(sizeof(*ring));
+    if (!ring)
+      return 0;
+    ring_cap = 1;
+  }
+  while (ring_tail - ring_head >= ring_cap)
+    if (flush_requests(sfd) < 0 || read_response(sfd) < 0)
+      return 0;
+
+  pending *p = &ring[ring_tail % ring_cap];
+  p->op = op;
+  p->hdr[0] = op;
+  p->hdr_len = 1;
+  p->nbody = 0;
+  return p;
+}
+
+static void req_u32(pending *p, uint32_t v)
+{
+  uint32_t v_net = htonl(v);
+  memcpy(p->hdr + p->hdr_len, &v_net, 4);
+  p->hdr_len += 4;
+}
+
+// The bytes are not copied, they have to stay there until the request
+// is sent
+static void req_ref(pending *p, const void *base, size_t len)
+{
+  iove_setup(p->body, p->nbody++, len, (void *)base);
+}
+
+static void req_queue(pending *p, response_cb done, void *ctx, int arg)
+{
+  p->done = done;
+  p->ctx = ctx;
+  p->arg = arg;
+  ++ring_tail;
+}
+
+// Sends everything and waits until every pending request is answered
+static int drain(int sfd)
+{
+  if (flush_requests(sfd) < 0)
+    return -1;
+  while (ring_head != ring_tail)
+    if (read_response(sfd) < 0)
+      return -1;
+  return 0;
+}
+
+typedef struct SYNC_RESULT sync_result;
+struct SYNC_RESULT
+{
+  int done;
+  int result;
+};
+
+static void sync_done(void *ctx, int arg, int result, void *msg)
+{
+  sync_result *r = ctx;
+  r->done = 1;
+  r->result = result;
+  free(msg);
+}
+
+// Queues the request and waits for its response
+// Returns the value in the response, -1 if the connection failed
+static int req_call(int sfd, pending *p)
+{
+  sync_result r = {0, -1};
+  req_queue(p, sync_done, &r, 0);
+  if (flush_requests(sfd) < 0)
+    return -1;
+  while (!r.done)
+    if (read_response(sfd) < 0)
+      return -1;
+  return r.result;
+}
+
+int set_pipeline_depth(int depth)
+{
+  if (depth < 1)
+    return -1;
+  int sfd = ensure_connected();
+  if (sfd >= 0 && ring && drain(sfd) < 0)
+    return -1;
+  pending *nring = realloc(ring, depth * sizeof(*nring));
+  if (!nring)
+    return -1;
+  ring = nring;
+  ring_cap = depth;
+  ring_head = ring_sent = ring_tail = 0;
+  return 0;
+}
+
+typedef struct SUBSCRIPTION subscription;
+struct SUBSCRIPTION
+{
+  int offset;
+  int32_t id; // Topic ID, requests for it do not carry the name
+  int polling; // A POLL or FETCH request for this topic is pending
+  // Messages from offset on, if they were received by a previous poll()
+  fetched *ahead;
+};
+
+// Most messages of each topic and bytes of all of them a FETCH_ALL brings,
+// the first message comes even if it is bigger
+#define FETCH_MSGS (256)
+#define FETCH_BYTES (1024 * 1024)
+
+// How long poll() lets the broker wait for a message, 0 to return right away
+static uint32_t poll_wait_ms;
+
 static map *sm = 0; // subscription map
 static map_position *sm_pos;
 
+int set_poll_wait(int max_wait_ms)
+{
+  if (max_wait_ms < 0)
+    return -1;
+  poll_wait_ms = max_wait_ms;
+  return 0;
+}
+
 // Crea el tema especificado.
 // Devuelve 0 si OK y un valor negativo en caso de error.
 int create_topic(char *topic)
@@ -88,86 +687,523 @@ int create_topic(char *topic)
   //  1 byte: Opcode
   //  4 bytes: topic name length (network order) = N
   //  N bytes: Null terminated topic name
-  struct iovec iov[3];
+  pending *p = req_new(sfd, OP_CREATE_TOPIC);
+  if (!p)
+    return -1;
+  req_u32(p, topic_len + 1);
+  req_ref(p, topic, topic_len + 1);
+
+  // Response is one byte, OP_CT_*: -1 if the topic exists, -2 if the
+  // broker could not create it
+  int result = req_call(sfd, p);
+  if (result < 0 || result == OP_CT_SUCCESS)
+    return result;
+  return result == OP_CT_EXISTS ? -1 : -2;
+}
+// Devuelve cuántos temas existen en el sistema y un valor negativo
+// en caso de error.
+int ntopics(void)
+{
+  int sfd = ensure_connected();
+  if (sfd < 0)
+    return -1;
+  /* NTOPICS has the following format */
+  //  1 byte: Opcode
+  pending *p = req_new(sfd, OP_NTOPICS);
+  if (!p)
+    return -1;
+
+  // Response
+  // 4 bytes: Number of topics (network order)
+  return req_call(sfd, p);
+}
+
+// SEGUNDA FASE: PRODUCIR/PUBLICAR
+
+// Envía el mensaje al tema especificado; nótese la necesidad
+// de indicar el tamaño ya que puede tener un contenido de tipo binario.
+// Devuelve el offset si OK y un valor negativo en caso de error.
+static pending *send_msg_request(int sfd, char *topic, int msg_size, void *msg)
+{
+  /* SEND_MSG operation format */
+  //  1 byte opcode
+  //  4 bytes topic name len (network order)(null term counted) = N
+  //  4 bytes message length (network order) = M
+  //  N bytes topics
+  //  M bytes message
+  size_t topic_len = strlen(topic);
+
+  pending *p = req_new(sfd, OP_SEND_MSG);
+  if (!p)
+    return 0;
+  req_u32(p, topic_len + 1);
+  req_u32(p, msg_size);
+  req_ref(p, topic, topic_len + 1);
+  req_ref(p, msg, msg_size);
+  return p;
+}
+
+int send_msg(char *topic, int msg_size, void *msg)
+{
+  int sfd = ensure_connected();
+  if (sfd < 0)
+    return -1;
+  pending *p = send_msg_request(sfd, topic, msg_size, msg);
+  if (!p)
+    return -1;
+
+  // Response
+  //  4 bytes offset (network order), negative for error
+  return req_call(sfd, p);
+}
+
+// With a linger time, send_msg_async keeps the messages of each topic as a
+// run of a SEND_BATCH request, until the run gets to batch_bytes or the
+// first message waiting gets to linger_ms. Then the runs of every topic
+// go in a single request.
+
+typedef struct ASYNC_SEND async_send;
+struct ASYNC_SEND
+{
+  send_callback done;
+  void *ctx;
+};
+
+typedef struct ACCUMULATOR accumulator;
+struct ACCUMULATOR
+{
+  // Topic len, number of messages, topic and the messages with their
+  // lengths, as they go in the request
+  uint8_t *run;
+  size_t hdr_len; // Up to the first message
+  size_t len;
+  size_t cap;
+  size_t bytes; // Of the messages
+  int nmsgs;
+  async_send *sends; // Of every message, in order
+  int sends_cap;
+};
+
+// Runs that went in a request, waiting for its response
+typedef struct SHIPMENT shipment;
+struct SHIPMENT
+{
+  int nruns;
+  int *run_msgs; // Messages of each run
+  async_send *sends;
+  // While the request is put together
+  uint8_t *body;
+  size_t body_len;
+  int nmsgs;
+  uint8_t *scratch; // For the messages of a run to be compressed
+  size_t scratch_len;
+};
+
+static uint32_t codec = CODEC_NONE; // For the runs
+static uint32_t linger_ms; // 0 if messages are not held back
+static uint32_t batch_bytes;
+static map *accs; // topic -> accumulator
+static int acc_nmsgs; // Waiting in every accumulator
+static uint64_t acc_since_ms; // When the first of them came
+
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// With a codec, runs go as packed batches: topic len, number of messages,
+// topic, batch len and batch
+static size_t packed_run_bound(accumulator *a)
+{
+  return a->hdr_len + 4 + PACKED_HDR_SIZE(a->nmsgs) + lz_bound(a->bytes);
+}
+
+// Packs the messages of the run into dst, returns the batch length
+// If they do not get any smaller, they go uncompressed
+static size_t pack_run(accumulator *a, uint8_t *dst, uint8_t *scratch)
+{
+  uint32_t v = htonl(a->nmsgs);
+  memcpy(dst + 4, &v, 4);
+  size_t pos = a->hdr_len;
+  size_t raw = 0;
+  for (int i = 0; i < a->nmsgs; ++i)
+  {
+    memcpy(dst + PACKED_HDR_SIZE(i), a->run + pos, 4);
+    memcpy(&v, a->run + pos, 4);
+    memcpy(scratch + raw, a->run + pos + 4, ntohl(v));
+    raw += ntohl(v);
+    pos += 4 + ntohl(v);
+  }
+
+  uint8_t *data = dst + PACKED_HDR_SIZE(a->nmsgs);
+  uint32_t used = CODEC_LZ;
+  size_t data_len = lz_compress(scratch, raw, data);
+  if (data_len >= raw)
+  {
+    used = CODEC_NONE;
+    memcpy(data, scratch, raw);
+    data_len = raw;
+  }
+  v = htonl(used);
+  memcpy(dst, &v, 4);
+  return PACKED_HDR_SIZE(a->nmsgs) + data_len;
+}
 
-  uint8_t op = OP_CREATE_TOPIC;
-  uint32_t topic_len_net = htonl(topic_len + 1);
+static void count_run(void *key, void *value, void *datum)
+{
+  accumulator *a = value;
+  shipment *sh = datum;
+  if (!a->nmsgs)
+    return;
+  ++sh->nruns;
+  sh->body_len += codec != CODEC_NONE ? packed_run_bound(a) : a->len;
+  sh->nmsgs += a->nmsgs;
+  if (a->bytes > sh->scratch_len)
+    sh->scratch_len = a->bytes;
+}
 
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, topic_len + 1, topic);
+static void take_run(void *key, void *value, void *datum)
+{
+  accumulator *a = value;
+  shipment *sh = datum;
+  if (!a->nmsgs)
+    return;
+  uint32_t nmsgs = htonl(a->nmsgs);
+  memcpy(a->run + 4, &nmsgs, 4);
+  uint8_t *dst = sh->body + sh->body_len;
+  if (codec != CODEC_NONE)
+  {
+    memcpy(dst, a->run, a->hdr_len);
+    uint32_t batch_len = pack_run(a, dst + a->hdr_len + 4, sh->scratch);
+    uint32_t v = htonl(batch_len);
+    memcpy(dst + a->hdr_len, &v, 4);
+    sh->body_len += a->hdr_len + 4 + batch_len;
+  }
+  else
+  {
+    memcpy(dst, a->run, a->len);
+    sh->body_len += a->len;
+  }
+  memcpy(sh->sends + sh->nmsgs, a->sends, a->nmsgs * sizeof(*a->sends));
+  sh->nmsgs += a->nmsgs;
+  sh->run_msgs[sh->nruns++] = a->nmsgs;
+
+  // The run starts over with just the topic
+  a->len = a->hdr_len;
+  a->bytes = 0;
+  a->nmsgs = 0;
+}
 
-  if (writev(sfd, iov, 3) < 0)
+static void shipment_done(void *ctx, int nruns, int result, void *offsets)
+{
+  shipment *sh = ctx;
+  int32_t *base = offsets;
+  int m = 0;
+  for (int r = 0; r < sh->nruns; ++r)
+    for (int i = 0; i < sh->run_msgs[r]; ++i, ++m)
+    {
+      int offset = !base ? -1 : base[r] < 0 ? base[r] : base[r] + i;
+      if (sh->sends[m].done)
+        sh->sends[m].done(sh->sends[m].ctx, offset);
+    }
+  free(offsets);
+  free(sh->run_msgs);
+  free(sh->sends);
+  free(sh);
+}
+
+// Sends every message waiting in the accumulators in a single request
+static int ship_runs(int sfd)
+{
+  if (!acc_nmsgs)
+    return 0;
+  shipment *sh = calloc(1, sizeof(*sh));
+  if (!sh)
+    return -1;
+  map_visit(accs, count_run, sh);
+  sh->body = malloc(sh->body_len);
+  sh->run_msgs = malloc(sh->nruns * sizeof(*sh->run_msgs));
+  sh->sends = malloc(sh->nmsgs * sizeof(*sh->sends));
+  if (codec != CODEC_NONE)
+    sh->scratch = malloc(sh->scratch_len ? sh->scratch_len : 1);
+  if (!sh->body || !sh->run_msgs || !sh->sends ||
+      (codec != CODEC_NONE && !sh->scratch))
+  {
+    free(sh->body);
+    free(sh->run_msgs);
+    free(sh->sends);
+    free(sh->scratch);
+    free(sh);
+    return -1;
+  }
+  sh->body_len = sh->nmsgs = sh->nruns = 0;
+  map_visit(accs, take_run, sh);
+  acc_nmsgs = 0;
+  free(sh->scratch);
+
+  // Same format as in send_msgs, or packed batches instead of messages
+  uint8_t *body = sh->body;
+  pending *p =
+      req_new(sfd, codec != CODEC_NONE ? OP_SEND_PACKED : OP_SEND_BATCH);
+  if (!p)
+  {
+    // Nobody gets a response for these
+    shipment_done(sh, sh->nruns, -1, 0);
+    free(body);
+    return -1;
+  }
+  req_u32(p, sh->body_len);
+  req_u32(p, sh->nruns);
+  req_ref(p, body, sh->body_len);
+  req_queue(p, shipment_done, sh, sh->nruns);
+  // The body is not needed once sent, the response may come much later
+  int result = flush_requests(sfd);
+  free(body);
+  return result;
+}
+
+// Keeps a copy of the message in the topic's accumulator
+static int accumulate(
+    char *topic,
+    int msg_size,
+    void *msg,
+    send_callback done,
+    void *ctx,
+    accumulator **acc)
+{
+  if (!accs && !(accs = map_create(key_string, 0))) // No locking
+    return -1;
+  int err = 0;
+  accumulator *a = map_get(accs, topic, &err);
+  if (err)
+  {
+    size_t topic_len = strlen(topic) + 1;
+    char *key = strdup(topic);
+    a = calloc(1, sizeof(*a));
+    if (!key || !a || !(a->run = malloc(8 + topic_len)) ||
+        map_put(accs, key, a) < 0)
+    {
+      if (a)
+        free(a->run);
+      free(a);
+      free(key);
+      return -1;
+    }
+    uint32_t len_net = htonl(topic_len);
+    memcpy(a->run, &len_net, 4);
+    memcpy(a->run + 8, topic, topic_len);
+    a->hdr_len = a->len = a->cap = 8 + topic_len;
+  }
+
+  if (a->len + 4 + msg_size > a->cap)
+  {
+    size_t ncap = a->cap * 2;
+    while (ncap < a->len + 4 + msg_size)
+      ncap *= 2;
+    uint8_t *nrun = realloc(a->run, ncap);
+    if (!nrun)
+      return -1;
+    a->run = nrun;
+    a->cap = ncap;
+  }
+  if (a->nmsgs == a->sends_cap)
+  {
+    int ncap = a->sends_cap ? a->sends_cap * 2 : 16;
+    async_send *nsends = realloc(a->sends, ncap * sizeof(*nsends));
+    if (!nsends)
+      return -1;
+    a->sends = nsends;
+    a->sends_cap = ncap;
+  }
+  uint32_t len_net = htonl(msg_size);
+  memcpy(a->run + a->len, &len_net, 4);
+  memcpy(a->run + a->len + 4, msg, msg_size);
+  a->len += 4 + msg_size;
+  a->bytes += msg_size;
+  a->sends[a->nmsgs].done = done;
+  a->sends[a->nmsgs].ctx = ctx;
+  ++a->nmsgs;
+  if (!acc_nmsgs++)
+    acc_since_ms = now_ms();
+  *acc = a;
+  return 0;
+}
+
+int set_compression(int new_codec)
+{
+  if (new_codec != CODEC_NONE && new_codec != CODEC_LZ)
+    return -1;
+  codec = new_codec;
+  return 0;
+}
+
+int set_linger(int linger, int batch)
+{
+  if (linger < 0 || batch < 0)
+    return -1;
+  // What was waiting goes with the old settings
+  int sfd = ensure_connected();
+  if (acc_nmsgs && (sfd < 0 || ship_runs(sfd) < 0))
+    return -1;
+  linger_ms = linger;
+  batch_bytes = batch;
+  return 0;
+}
+
+// The pending request is still in the ring when its response is handed out
+static void send_async_done(void *ctx, int arg, int result, void *msg)
+{
+  pending *p = ctx;
+  p->send_done(p->send_ctx, result);
+}
+
+int send_msg_async(
+    char *topic,
+    int msg_size,
+    void *msg,
+    send_callback done,
+    void *ctx)
+{
+  int sfd = ensure_connected();
+  if (sfd < 0 || msg_size < 0)
     return -1;
-  // Receive response
-  uint8_t result;
-  if (recv(sfd, &result, sizeof(result), MSG_WAITALL) <= 0)
+  if (linger_ms)
+  {
+    accumulator *a;
+    if (accumulate(topic, msg_size, msg, done, ctx, &a) < 0)
+      return -1;
+    // It is queued, errors from here on reach done
+    if (a->bytes >= batch_bytes || now_ms() - acc_since_ms >= linger_ms)
+      ship_runs(sfd);
+    return 0;
+  }
+
+  pending *p = send_msg_request(sfd, topic, msg_size, msg);
+  if (!p)
     return -1;
-  return -result;
+  p->send_done = done;
+  p->send_ctx = ctx;
+  req_queue(p, done ? send_async_done : 0, p, 0);
+  // The request points to the caller's memory, it goes out right away
+  // From here on, errors reach done
+  flush_requests(sfd);
+  return 0;
 }
-// Devuelve cuántos temas existen en el sistema y un valor negativo
-// en caso de error.
-int ntopics(void)
+
+int flush(void)
 {
   int sfd = ensure_connected();
   if (sfd < 0)
     return -1;
-  /* NTOPICS has the following format */
-  //  1 byte: Opcode
-  uint8_t op = OP_NTOPICS;
-  if (write(sfd, &op, 1) < 0)
-    return -1;
-
-  // Receive response
-  // 4 bytes: Number of topics (network order)
-  uint32_t ntopics_net;
-  if (recv(sfd, &ntopics_net, 4, MSG_WAITALL) <= 0)
-    return -1;
-  uint32_t ntopics = ntohl(ntopics_net);
-  return ntopics;
+  int result = ship_runs(sfd);
+  return drain(sfd) < 0 ? -1 : result;
 }
+typedef struct BATCH_RESULT batch_result;
+struct BATCH_RESULT
+{
+  int done;
+  int32_t *offsets; // Of the first message of each topic, 0 on error
+};
 
-// SEGUNDA FASE: PRODUCIR/PUBLICAR
+static void batch_done(void *ctx, int arg, int result, void *offsets)
+{
+  batch_result *r = ctx;
+  r->done = 1;
+  r->offsets = offsets;
+}
 
-// Envía el mensaje al tema especificado; nótese la necesidad
-// de indicar el tamaño ya que puede tener un contenido de tipo binario.
-// Devuelve el offset si OK y un valor negativo en caso de error.
-int send_msg(char *topic, int msg_size, void *msg)
+int send_msgs(
+    int nmsgs,
+    char **topics,
+    int *msg_sizes,
+    void **msgs,
+    int *offsets)
 {
+  if (nmsgs <= 0)
+    return -1;
   int sfd = ensure_connected();
   if (sfd < 0)
     return -1;
-  /* SEND_MSG operation format */
+  /* SEND_BATCH operation format */
   //  1 byte opcode
-  //  4 bytes topic name len (network order)(null term counted) = N
-  //  4 bytes message length (network order) = M
-  //  N bytes topics
-  //  M bytes message
-
-  uint8_t op = OP_SEND_MSG;
-
-  size_t topic_len = strlen(topic);
-
-  uint32_t topic_len_net = htonl(topic_len + 1);
-  uint32_t msg_len_net = htonl(msg_size);
-
-  struct iovec iov[5];
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, 4, &msg_len_net);
-  iove_setup(iov, 3, topic_len + 1, topic);
-  iove_setup(iov, 4, msg_size, msg);
-
-  if (writev(sfd, iov, 5) < 0)
+  //  4 bytes body len (network order) = B
+  //  4 bytes number of topics (network order)
+  //  B bytes: for each run of messages to the same topic
+  //    4 bytes topic name len (null term counted) = N
+  //    4 bytes number of messages
+  //    N bytes topic
+  //    For each message: 4 bytes message length = M, M bytes message
+  size_t body_len = 0;
+  int ntopics = 0;
+  for (int i = 0; i < nmsgs; ++i)
+  {
+    if (msg_sizes[i] < 0)
+      return -1;
+    if (!i || strcmp(topics[i], topics[i - 1]))
+    {
+      body_len += 8 + strlen(topics[i]) + 1;
+      ++ntopics;
+    }
+    body_len += 4 + msg_sizes[i];
+  }
+  uint8_t *body = malloc(body_len);
+  if (!body)
     return -1;
+  uint8_t *pos = body;
+  for (int i = 0; i < nmsgs;)
+  {
+    int run = 1;
+    while (i + run < nmsgs && !strcmp(topics[i + run], topics[i]))
+      ++run;
+    uint32_t topic_len = strlen(topics[i]) + 1;
+    uint32_t fields[2] = {htonl(topic_len), htonl(run)};
+    memcpy(pos, fields, 8);
+    memcpy(pos + 8, topics[i], topic_len);
+    pos += 8 + topic_len;
+    for (int j = i; j < i + run; ++j)
+    {
+      uint32_t msg_len = htonl(msg_sizes[j]);
+      memcpy(pos, &msg_len, 4);
+      memcpy(pos + 4, msgs[j], msg_sizes[j]);
+      pos += 4 + msg_sizes[j];
+    }
+    i += run;
+  }
 
-  // Receive response
-  int result;
-  if (recv(sfd, &result, 4, MSG_WAITALL) <= 0)
+  batch_result r = {0, 0};
+  pending *p = req_new(sfd, OP_SEND_BATCH);
+  if (p)
+  {
+    req_u32(p, body_len);
+    req_u32(p, ntopics);
+    req_ref(p, body, body_len);
+    req_queue(p, batch_done, &r, ntopics);
+    if (flush_requests(sfd) == 0)
+      while (!r.done && read_response(sfd) == 0)
+        ;
+  }
+  free(body);
+  if (!r.offsets)
     return -1;
-  result = ntohl(result);
+
+  // Response
+  //  4 bytes offset of the first message of each run, negative for error
+  int result = 0;
+  for (int i = 0, t = 0; i < nmsgs; ++t)
+  {
+    int32_t base = r.offsets[t];
+    if (base < 0)
+      result = -1;
+    for (int j = 0; i < nmsgs && (!j || !strcmp(topics[i], topics[i - 1]));
+         ++i, ++j)
+      offsets[i] = base < 0 ? base : base + j;
+  }
+  free(r.offsets);
   return result;
 }
+
 // Devuelve la longitud del mensaje almacenado en ese offset del tema indicado
 // y un valor negativo en caso de error.
 int msg_length(char *topic, int offset)
@@ -184,33 +1220,32 @@ int msg_length(char *topic, int offset)
   //  4 bytes topic len (network order) = N
   //  4 bytes offset(network order)
   //  N bytes topic (with null termination)
-  uint8_t op = OP_MSG_LEN;
-  uint32_t offset_net = htonl(offset);
-
-  uint32_t topic_len_net = htonl(topic_len + 1);
-
-  struct iovec iov[4];
-
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, 4, &offset_net);
-  iove_setup(iov, 3, topic_len + 1, topic);
-
-  if (writev(sfd, iov, 4) < 0)
+  pending *p = req_new(sfd, OP_MSG_LEN);
+  if (!p)
     return -1;
+  req_u32(p, topic_len + 1);
+  req_u32(p, offset);
+  req_ref(p, topic, topic_len + 1);
 
-  // Receive response
+  // Response
   // 4 bytes size(network order), negative for error
-  int msg_size;
-
-  if (recv(sfd, &msg_size, 4, MSG_WAITALL) <= 0)
-    return -1;
-  ;
-
-  msg_size = ntohl(msg_size);
+  return req_call(sfd, p);
+}
 
-  return msg_size;
+static pending *end_offset_request(int sfd, char *topic, size_t topic_len)
+{
+  // END_OFFSET format:
+  //  1 byte opcode
+  //  4 bytes topic len(network order) = N
+  //  N bytes topic
+  pending *p = req_new(sfd, OP_END_OFF);
+  if (!p)
+    return 0;
+  req_u32(p, topic_len + 1);
+  req_ref(p, topic, topic_len + 1);
+  return p;
 }
+
 // Obtiene el último offset asociado a un tema en el broker, que corresponde
 // al del último mensaje enviado más uno y, dado que los mensajes se
 // numeran desde 0, coincide con el número de mensajes asociados a ese tema.
@@ -223,36 +1258,146 @@ int end_offset(char *topic)
   int sfd = ensure_connected();
   if (sfd < 0)
     return -1;
-  // END_OFFSET format:
+  pending *p = end_offset_request(sfd, topic, topic_len);
+  if (!p)
+    return -1;
+
+  // Reponse
+  //  4 bytes: end offset, negative if error
+  return req_call(sfd, p);
+}
+
+int low_offset(char *topic)
+{
+  size_t topic_len = strlen(topic);
+  if (topic_len >= 216)
+    return -1;
+  int sfd = ensure_connected();
+  if (sfd < 0)
+    return -1;
+  // LOW_OFF format:
   //  1 byte opcode
   //  4 bytes topic len(network order) = N
   //  N bytes topic
-  struct iovec iov[3];
-
-  uint8_t op = OP_END_OFF;
-  uint32_t topic_len_net = htonl(topic_len + 1);
+  pending *p = req_new(sfd, OP_LOW_OFF);
+  if (!p)
+    return -1;
+  req_u32(p, topic_len + 1);
+  req_ref(p, topic, topic_len + 1);
 
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, topic_len + 1, topic);
+  // Reponse
+  //  4 bytes: low offset, negative if error
+  return req_call(sfd, p);
+}
 
-  if (writev(sfd, iov, 3) < 0)
+int set_retention(
+    char *topic,
+    int max_msgs,
+    long long max_bytes,
+    int max_age_ms)
+{
+  if (max_msgs < 0 || max_bytes < 0 || max_age_ms < 0)
+    return -1;
+  size_t topic_len = strlen(topic);
+  if (topic_len >= 216)
+    return -1;
+  int sfd = ensure_connected();
+  if (sfd < 0)
     return -1;
+  // SET_RETENTION format:
+  //  1 byte opcode
+  //  4 bytes topic len(network order) = N
+  //  4 bytes max messages, 0 for no limit
+  //  8 bytes max bytes, 0 for no limit
+  //  4 bytes max age (ms), 0 for no limit
+  //  N bytes topic
+  pending *p = req_new(sfd, OP_SET_RETENTION);
+  if (!p)
+    return -1;
+  req_u32(p, topic_len + 1);
+  req_u32(p, max_msgs);
+  req_u32(p, (uint64_t)max_bytes >> 32);
+  req_u32(p, max_bytes);
+  req_u32(p, max_age_ms);
+  req_ref(p, topic, topic_len + 1);
+
+  // Reponse
+  //  4 bytes: 0 if OK, negative if error
+  return req_call(sfd, p);
+}
 
-  // Receive reponse
-  //  4 bytes: end offset, negative if error
-  int end_offset;
+typedef struct STATS_RESULT stats_result;
+struct STATS_RESULT
+{
+  int done;
+  int result;
+  uint64_t stats[2];
+};
 
-  if (recv(sfd, &end_offset, 4, MSG_WAITALL) <= 0)
-    return -1;
+static void stats_done(void *ctx, int arg, int result, void *stats)
+{
+  stats_result *r = ctx;
+  r->done = 1;
+  r->result = result;
+  if (stats)
+    memcpy(r->stats, stats, sizeof(r->stats));
+  free(stats);
+}
 
-  end_offset = ntohl(end_offset);
+int topic_stats(char *topic, long long *raw_bytes, long long *stored_bytes)
+{
+  size_t topic_len = strlen(topic);
+  if (topic_len >= 216)
+    return -1;
+  int sfd = ensure_connected();
+  if (sfd < 0)
+    return -1;
+  // TOPIC_STATS format
+  //  1 byte opcode
+  //  4 bytes topic len = N
+  //  N bytes topic (null term)
+  pending *p = req_new(sfd, OP_TOPIC_STATS);
+  if (!p)
+    return -1;
+  req_u32(p, topic_len + 1);
+  req_ref(p, topic, topic_len + 1);
 
-  return end_offset;
+  stats_result r = {0, -1};
+  req_queue(p, stats_done, &r, 0);
+  if (flush_requests(sfd) < 0)
+    return -1;
+  while (!r.done)
+    if (read_response(sfd) < 0)
+      return -1;
+  if (r.result < 0)
+    return -1;
+  *raw_bytes = r.stats[0];
+  *stored_bytes = r.stats[1];
+  return 0;
 }
 
 // TERCERA FASE: SUBSCRIPCIÓN
 
+static void subscribe_done(void *ctx, int arg, int result, void *msg)
+{
+  subscription *s = ctx;
+  s->offset = result;
+}
+
+static void topic_id_done(void *ctx, int arg, int result, void *msg)
+{
+  subscription *s = ctx;
+  s->id = result;
+}
+
+static void release_subscription(void *key, void *value)
+{
+  subscription *s = value;
+  release_fetched(s->ahead);
+  free(value);
+  free(key);
+}
+
 // Subscribe to the set of received topics. does not allow subscription
 // incremental: all themes must be specified at once.
 // If a topic does not exist or is repeated in the list, it is simply ignored.
@@ -262,12 +1407,21 @@ int subscribe(int ntopics, char **topics)
 {
   if (sm) // We already subscribed to topics, can't subscribe again
     return -1;
+  int sfd = ensure_connected();
+  if (sfd < 0)
+    return -1;
   sm = map_create(key_string, 0); // No locking
   sm_pos = map_alloc_position(sm);
-  int actually_subs = 0; // Does not count duplicates or non existant
+
+  // Every topic gets an entry right away, and the end offset and topic ID
+  // requests of all of them go through the pipeline. The ones the broker
+  // does not know about are removed once all the responses are in.
+  char *added[ntopics];
+  int nadded = 0;
   for (int i = 0; i < ntopics; ++i)
   {
-    if (strlen(topics[i]) >= 216) // If too long, don't bother looking it up
+    size_t topic_len = strlen(topics[i]);
+    if (topic_len >= 216) // If too long, don't bother looking it up
       continue;
     int err = 0;
     // First we check if the topic is already added, if that's the case
@@ -275,22 +1429,45 @@ int subscribe(int ntopics, char **topics)
     map_get(sm, topics[i], &err);
     if (!err)
       continue;
-    int eoff = end_offset(topics[i]);
-    if (eoff < 0)
+    char *dup_topic = strdup(topics[i]);            // free() in release_subscription
+    subscription *s = calloc(1, sizeof(*s));        // free() in release_subscription
+    if (!dup_topic || !s)
+    {
+      free(dup_topic);
+      free(s);
       continue;
-    char *dup_topic = strdup(topics[i]); // free() in release_subscription
-    int *poff = malloc(sizeof(int));     // free() in release_subscription
-    *poff = eoff;
-    map_put(sm, dup_topic, poff);
-    ++actually_subs;
+    }
+    s->offset = -1;
+    s->id = -1;
+    map_put(sm, dup_topic, s);
+    added[nadded++] = dup_topic;
+
+    pending *p = end_offset_request(sfd, dup_topic, topic_len);
+    if (!p)
+      break;
+    req_queue(p, subscribe_done, s, 0);
+    // TOPIC_ID format:
+    //  1 byte opcode
+    //  4 bytes topic len(network order) = N
+    //  N bytes topic
+    if (!(p = req_new(sfd, OP_TOPIC_ID)))
+      break;
+    req_u32(p, topic_len + 1);
+    req_ref(p, dup_topic, topic_len + 1);
+    req_queue(p, topic_id_done, s, 0);
   }
-  return actually_subs;
-}
+  drain(sfd);
 
-static void release_subscription(void *key, void *value)
-{
-  free(value);
-  free(key);
+  int actually_subs = 0; // Does not count duplicates or non existant
+  for (int i = 0; i < nadded; ++i)
+  {
+    subscription *s = map_get(sm, added[i], 0);
+    if (s->offset < 0 || s->id < 0)
+      map_remove_entry(sm, added[i], release_subscription);
+    else
+      ++actually_subs;
+  }
+  return actually_subs;
 }
 
 // Se da de baja de todos los temas suscritos.
@@ -299,6 +1476,10 @@ int unsubscribe(void)
 {
   if (!sm) // Can't unsubscribe if not subscribed already :)
     return -1;
+  // Pending polls still point to the subscriptions
+  int sfd = ensure_connected();
+  if (sfd >= 0)
+    drain(sfd);
   map_free_position(sm_pos);
   map_destroy(sm, release_subscription);
   sm = 0; // subscribe can be called again
@@ -312,10 +1493,10 @@ int position(char *topic)
   if (!sm)
     return -1;
   int err = 0;
-  int *poff = map_get(sm, topic, &err);
+  subscription *s = map_get(sm, topic, &err);
   if (err)
     return -1;
-  return *poff;
+  return s->offset;
 }
 
 // Modifica el offset del cliente para ese tema.
@@ -325,15 +1506,133 @@ int seek(char *topic, int offset)
   if (!sm)
     return -1;
   int err = 0;
-  int *poff = map_get(sm, topic, &err);
+  subscription *s = map_get(sm, topic, &err);
   if (err)
     return -1;
-  *poff = offset;
+  s->offset = offset;
+  // Whatever we had received belongs to the old offset
+  release_fetched(s->ahead);
+  s->ahead = 0;
   return 0;
 }
 
 // CUARTA FASE: LEER MENSAJES
 
+static void fetch_done(void *ctx, int offset, int count, void *batch)
+{
+  subscription *s = ctx;
+  fetched *f = batch;
+  s->polling = 0;
+  // Dropped, we go on from the oldest message left
+  if (f && f->low >= 0 && !s->ahead && s->offset == offset)
+    s->offset = f->low;
+  // Nothing there, or a seek() moved the subscription meanwhile
+  if (count <= 0 || s->ahead || s->offset != offset)
+  {
+    release_fetched(batch);
+    return;
+  }
+  s->ahead = batch;
+}
+
+static void poll_done(void *ctx, int offset, int msg_len, void *msg)
+{
+  fetched *f = 0;
+  if (msg_len <= 0)
+    f = msg; // No message, unless it said it was dropped
+  else if ((f = malloc(sizeof(*f) + sizeof(f->m[0]))))
+  {
+    f->count = 1;
+    f->next = 0;
+    f->low = -1;
+    f->m[0].msg = msg;
+    f->m[0].len = msg_len;
+  }
+  else
+    free(msg);
+  fetch_done(ctx, offset, f ? 1 : 0, f);
+}
+
+static void fetch_all_done(void *ctx, int n, int result, void *batches)
+{
+  subscription **subs = ctx;
+  fetched **fs = batches;
+  for (int i = 0; i < n; ++i)
+  {
+    fetched *f = fs ? fs[i] : 0;
+    fetch_done(subs[i], subs[i]->offset, f ? f->count : 0, f);
+  }
+  free(fs);
+}
+
+// Asks for the messages of the n subscriptions from their offsets on, in
+// a single request, and waits for them
+static int fetch_all(int sfd, subscription **subs, int n)
+{
+  // FETCH_ALL format, by topic ID:
+  //  1 byte: opcode
+  //  4 bytes: body len = B
+  //  4 bytes: number of topics
+  //  4 bytes: max messages for each topic
+  //  4 bytes: max bytes for all of them
+  //  B bytes: for each topic
+  //    4 bytes: topic ID
+  //    4 bytes: offset
+  size_t body_len = 8 * (size_t)n;
+  uint32_t *body = malloc(body_len);
+  if (!body)
+    return -1;
+  for (int i = 0; i < n; ++i)
+  {
+    body[2 * i] = htonl(subs[i]->id);
+    body[2 * i + 1] = htonl(subs[i]->offset);
+  }
+
+  int result = -1;
+  pending *p = req_new(sfd, OP_FETCH_ALL | OP_BY_ID);
+  if (p)
+  {
+    req_u32(p, body_len);
+    req_u32(p, n);
+    req_u32(p, FETCH_MSGS);
+    req_u32(p, FETCH_BYTES);
+    req_ref(p, body, body_len);
+    req_queue(p, fetch_all_done, subs, n);
+    for (int i = 0; i < n; ++i)
+      subs[i]->polling = 1;
+    result = flush_requests(sfd);
+    // The body has to be there until it is sent, and the subscriptions
+    // until the response is in
+    while (!result && subs[0]->polling)
+      result = read_response(sfd);
+  }
+  free(body);
+  return result;
+}
+
+// With max_wait_ms, the broker holds the response until the message is
+// there or the time is up
+static int poll_request(int sfd, subscription *s, uint32_t max_wait_ms)
+{
+  // Send a poll request
+  // POLL format, by topic ID:
+  //  1 byte: opcode
+  //  4 bytes: topic ID
+  //  4 bytes: offset
+  // POLL_WAIT has 4 more bytes after the offset: max wait (ms)
+  pending *p =
+      req_new(sfd, (max_wait_ms ? OP_POLL_WAIT : OP_POLL) | OP_BY_ID);
+  if (!p)
+    return -1;
+  req_u32(p, s->id);
+  req_u32(p, s->offset);
+  if (max_wait_ms)
+    req_u32(p, max_wait_ms);
+  req_queue(p, poll_done, s, s->offset);
+  s->polling = 1;
+  return 0;
+}
+
 // Get the following message for this client; the two parameters
 // are output.
 // Returns the size of the message (0 if there was no message)
@@ -343,70 +1642,103 @@ int poll(char **topic, void **msg)
   if (!sm)
     return -1;
   int sfd = ensure_connected();
-  map_iter *it = map_iter_init(sm, sm_pos);
-  for (; it && map_iter_has_next(it); map_iter_next(it))
+  if (sfd < 0)
+    return -1;
+  int nsubs = map_size(sm);
+  if (nsubs <= 0)
+    return 0;
+
+  // Topics in the order we look at them, starting where the last poll()
+  // found a message
+  char **names = malloc(nsubs * sizeof(*names));
+  subscription **subs = malloc(nsubs * sizeof(*subs));
+  if (!names || !subs)
   {
-    char *ctopic;
-    int *poff;
-    map_iter_value(it, (void const **) &ctopic, (void **) &poff);
-
-    // Send a poll request
-    // POLL format:
-    //  1 byte: opcode
-    //  4 bytes: topic len = N
-    //  4 bytes: offset
-    //  N bytes: topic(with NULL term)
-
-    uint8_t op = OP_POLL;
-    size_t ctopic_len = strlen(ctopic);
-
-    uint32_t topic_len_net = htonl(ctopic_len+1);
-    uint32_t offset_net = htonl(*poff);
-
-    struct iovec iov[4];
+    free(names);
+    free(subs);
+    return -1;
+  }
+  map_iter *it = map_iter_init(sm, sm_pos);
+  int n = 0;
+  for (; it && map_iter_has_next(it) && n < nsubs; map_iter_next(it), ++n)
+    map_iter_value(it, (void const **)&names[n], (void **)&subs[n]);
+  sm_pos = map_iter_exit(it);
 
-    iove_setup(iov, 0, 1, &op);
-    iove_setup(iov, 1, 4, &topic_len_net);
-    iove_setup(iov, 2, 4, &offset_net);
-    iove_setup(iov, 3, ctopic_len + 1, ctopic);
+  // Unless the first topic has messages already here, every topic without
+  // them is fetched in a single request, the messages are kept for the
+  // next calls
+  int found = -1;
+  int result = 0;
+  if (!subs[0]->ahead)
+  {
+    subscription **fetch_subs = malloc(n * sizeof(*fetch_subs));
+    int nfetch = 0;
+    for (int i = 0; fetch_subs && i < n; ++i)
+      if (!subs[i]->ahead && !subs[i]->polling)
+        fetch_subs[nfetch++] = subs[i];
+    if (!fetch_subs || (nfetch && fetch_all(sfd, fetch_subs, nfetch) < 0))
+      result = -1;
+    free(fetch_subs);
+    if (result < 0)
+      goto end;
+  }
+  for (int i = 0; i < n && found < 0; ++i)
+    if (subs[i]->ahead)
+      found = i;
 
-    if (writev(sfd, iov, 4) < 0)
+  // Nothing anywhere, the broker waits for the first topic to get something
+  // If it does not, the next call waits on the next topic
+  if (found < 0 && poll_wait_ms)
+  {
+    if (poll_request(sfd, subs[0], poll_wait_ms) < 0 ||
+        flush_requests(sfd) < 0)
     {
-      sm_pos = map_iter_exit(it);
-      return -1;
+      result = -1;
+      goto end;
     }
-
-    // broker response is of the format:
-    // 4 bytes: msg len, 0 means message at offset for topic does not exist = N
-    // N bytes: msg
-    uint32_t msg_len;
-    if (recv(sfd, &msg_len, 4, MSG_WAITALL) <= 0)
+    while (subs[0]->polling)
+      if (read_response(sfd) < 0)
+      {
+        result = -1;
+        goto end;
+      }
+    if (subs[0]->ahead)
+      found = 0;
+    else
     {
+      it = map_iter_init(sm, sm_pos);
+      if (it)
+        map_iter_next(it);
       sm_pos = map_iter_exit(it);
-      return -1;
     }
-    msg_len = ntohl(msg_len);
-
-    printf("Receiving a message of length: %u\n", msg_len);
+  }
 
-    if (!msg_len)
-      continue;
-    void *msgbuf = malloc(msg_len);
-    if (recv(sfd, msgbuf, msg_len, MSG_WAITALL) <= 0)
+  if (found >= 0)
+  {
+    subscription *s = subs[found];
+    fetched *f = s->ahead;
+    *topic = strdup(names[found]);
+    *msg = f->m[f->next].msg;
+    result = f->m[f->next].len;
+    if (++f->next == f->count)
     {
-      free(msgbuf);
-      sm_pos = map_iter_exit(it);
-      return -1;
+      release_fetched(f);
+      s->ahead = 0;
     }
-    *topic = strdup(ctopic);
-    *msg = msgbuf;
-    ++*poff; // Increment offset so that next time we read from this topic
-             // We read the next message from the broker
+    ++s->offset; // Increment offset so that next time we read from this topic
+                 // We read the next message from the broker
+
+    // Next time we start from this topic
+    it = map_iter_init(sm, sm_pos);
+    for (int i = 0; it && i < found; ++i)
+      map_iter_next(it);
     sm_pos = map_iter_exit(it);
-    return msg_len;
   }
-  sm_pos = map_iter_exit(it);
-  return 0;
+
+end:
+  free(names);
+  free(subs);
+  return result;
 }
 
 // QUINTA FASE: COMMIT OFFSETS
@@ -442,29 +1774,17 @@ int commit(char *client, char *topic, int offset)
   //  4 bytes: offset
   //  N bytes: topic (with Null term)
   //  M bytes: client(with Null term)
-
-  uint8_t op = OP_COMMIT;
-  uint32_t topic_len_net = htonl(topic_len+1);
-  uint32_t client_len_net = htonl(client_len+1);
-  uint32_t offset_net = htonl(offset);
-
-  struct iovec iov[6];
-
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, 4, &client_len_net);
-  iove_setup(iov, 3, 4, &offset_net);
-  iove_setup(iov, 4, topic_len+1, topic);
-  iove_setup(iov, 5, client_len+1, client);
-
-  if(writev(sfd, iov, 6) < 0)
+  pending *p = req_new(sfd, OP_COMMIT);
+  if (!p)
     return -1;
+  req_u32(p, topic_len + 1);
+  req_u32(p, client_len + 1);
+  req_u32(p, offset);
+  req_ref(p, topic, topic_len + 1);
+  req_ref(p, client, client_len + 1);
 
   // Response is just one byte status
-  uint8_t status;
-  if(recv(sfd, &status, 1, MSG_WAITALL) <= 0)
-    return -1;
-  return status;
+  return req_call(sfd, p);
 }
 
 // Cliente obtiene el offset guardado para ese tema.
@@ -490,26 +1810,144 @@ int commited(char *client, char *topic)
   //  4 bytes: client len = M
   //  N bytes: topic (with Null term)
   //  M bytes: client(with Null term)
+  pending *p = req_new(sfd, OP_COMMITED);
+  if (!p)
+    return -1;
+  req_u32(p, topic_len + 1);
+  req_u32(p, client_len + 1);
+  req_ref(p, topic, topic_len + 1);
+  req_ref(p, client, client_len + 1);
+
+  // Response is just 4 bytes offset, negative if error
+  return req_call(sfd, p);
+}
 
-  uint8_t op = OP_COMMITED;
-  uint32_t topic_len_net = htonl(topic_len+1);
-  uint32_t client_len_net = htonl(client_len+1);
+// STREAMS
+//
+// Streams have a connection of their own: the broker pushes their messages
+// whenever they arrive, they would get mixed with the responses to the
+// other requests.
 
-  struct iovec iov[5];
+typedef struct STREAM_SUB stream_sub;
+struct STREAM_SUB
+{
+  char *topic;
+  uint32_t window;   // Bytes the broker can send ahead of us
+  uint32_t consumed; // Bytes received and not given back as credit yet
+};
+
+static int stream_sfd = -1;
+static reader frames;
+static stream_sub *streams;
+static int nstreams;
+
+int stream_open(char *topic, int offset, int window)
+{
+  size_t topic_len = strlen(topic);
+  if (topic_len >= 216 || offset < 0 || window <= 0)
+    return -1;
+  // The broker would just close the stream, but this way the caller knows
+  if (end_offset(topic) < 0)
+    return -1;
+  if (stream_sfd < 0 && (stream_sfd = connect_broker()) < 0)
+    return -1;
 
-  iove_setup(iov, 0, 1, &op);
-  iove_setup(iov, 1, 4, &topic_len_net);
-  iove_setup(iov, 2, 4, &client_len_net);
-  iove_setup(iov, 3, topic_len+1, topic);
-  iove_setup(iov, 4, client_len+1, client);
+  stream_sub *nstreams_arr = realloc(streams, (nstreams + 1) * sizeof(*streams));
+  if (!nstreams_arr)
+    return -1;
+  streams = nstreams_arr;
+  stream_sub *s = &streams[nstreams];
+  s->topic = strdup(topic);
+  if (!s->topic)
+    return -1;
+  s->window = window;
+  s->consumed = 0;
 
-  if(writev(sfd, iov, 5) < 0)
+  // STREAM format:
+  //  1 byte: opcode
+  //  4 bytes: topic len = N
+  //  4 bytes: stream id
+  //  4 bytes: offset
+  //  4 bytes: credit (bytes)
+  //  N bytes: topic (with NULL term)
+  uint8_t hdr[17];
+  uint32_t fields[4] = {
+      htonl(topic_len + 1),
+      htonl(nstreams),
+      htonl(offset),
+      htonl(window)};
+  hdr[0] = OP_STREAM;
+  memcpy(hdr + 1, fields, sizeof(fields));
+  struct iovec iov[2];
+  iove_setup(iov, 0, sizeof(hdr), hdr);
+  iove_setup(iov, 1, topic_len + 1, s->topic);
+  if (send_all(stream_sfd, iov, 2) < 0)
+  {
+    free(s->topic);
     return -1;
+  }
+  // No response, messages start coming
+  return nstreams++;
+}
 
-  // Response is just 4 bytes offset, negative if error
-  int offset;
-  if(recv(sfd, &offset, 4, MSG_WAITALL) <= 0)
+// Gives the bytes consumed back to the broker
+static int send_credit(uint32_t id, uint32_t bytes)
+{
+  // CREDIT format:
+  //  1 byte: opcode
+  //  4 bytes: stream id
+  //  4 bytes: credit (bytes)
+  uint8_t req[9];
+  uint32_t fields[2] = {htonl(id), htonl(bytes)};
+  req[0] = OP_CREDIT;
+  memcpy(req + 1, fields, sizeof(fields));
+  struct iovec iov;
+  iove_setup(&iov, 0, sizeof(req), req);
+  return send_all(stream_sfd, &iov, 1);
+}
+
+int stream_poll(char **topic, void **msg)
+{
+  if (stream_sfd < 0)
     return -1;
-  offset = ntohl(offset);
-  return offset;
+  while (1)
+  {
+    // Frames:
+    //  4 bytes: stream id
+    //  4 bytes: offset
+    //  4 bytes: msg len = N, STREAM_NOTOPIC if the stream was closed
+    //  N bytes: msg
+    uint32_t frame[3];
+    if (read_bytes(stream_sfd, &frames, frame, sizeof(frame)) < 0)
+      return -1;
+    uint32_t id = ntohl(frame[0]);
+    uint32_t msg_len = ntohl(frame[2]);
+    if (id >= (uint32_t)nstreams)
+      return -1;
+    if (msg_len == STREAM_NOTOPIC) // The topic was checked when opened
+      continue;
+
+    void *m = malloc(msg_len ? msg_len : 1);
+    if (!m || read_bytes(stream_sfd, &frames, m, msg_len) < 0)
+    {
+      free(m);
+      return -1;
+    }
+    stream_sub *s = &streams[id];
+    // Half the window is enough to give it back, so the broker does not
+    // stop while we are consuming the other half
+    s->consumed += msg_len;
+    if (s->consumed >= s->window / 2)
+    {
+      if (send_credit(id, s->consumed) < 0)
+      {
+        free(m);
+        return -1;
+      }
+      s->consumed = 0;
+    }
+    *topic = strdup(s->topic);
+    *msg = m;
+    return msg_len;
+  }
 }
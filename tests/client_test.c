@@ -0,0 +1,425 @@
+/*
+ * Client tests: the library API against the broker at BROKER_HOST and
+ * BROKER_PORT, as an application would use it.
+ * Usage: client_test [test...]   (all of them by default)
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "kaska.h"
+
+#define CHECK(cond)                                              \
+  do                                                             \
+  {                                                              \
+    if (!(cond))                                                 \
+    {                                                            \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return -1;                                                 \
+    }                                                            \
+  } while (0)
+
+// Fills msg with bytes that tell offset apart from the other offsets
+static void fill_msg(char *msg, int len, int offset)
+{
+  for (int i = 0; i < len; ++i)
+    msg[i] = (char)(offset * 31 + i);
+}
+
+// Sends n messages of len bytes, filled with fill_msg, from offset on
+static int send_n(char *topic, int offset, int n, int len)
+{
+  char msg[len ? len : 1];
+  for (int i = 0; i < n; ++i)
+  {
+    fill_msg(msg, len, offset + i);
+    CHECK(send_msg(topic, len, msg) == offset + i);
+  }
+  return 0;
+}
+
+// Polls the next message, which has to be the one of offset in topic
+static int poll_check(char *topic, int offset, int len)
+{
+  char *got_topic = 0;
+  void *msg = 0;
+  int got = poll(&got_topic, &msg);
+  CHECK(got == len);
+  CHECK(got_topic && !strcmp(got_topic, topic));
+  char want[len ? len : 1];
+  fill_msg(want, len, offset);
+  CHECK(!memcmp(msg, want, len));
+  free(got_topic);
+  free(msg);
+  return 0;
+}
+
+static int test_topics(void)
+{
+  int before = ntopics();
+  CHECK(before >= 0);
+  CHECK(create_topic("c.topics1") == 0);
+  CHECK(create_topic("c.topics2") == 0);
+  CHECK(create_topic("c.topics1") < 0);
+  CHECK(ntopics() == before + 2);
+  char name[300];
+  memset(name, 'x', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  CHECK(create_topic(name) < 0);
+  return 0;
+}
+
+static int test_send(void)
+{
+  CHECK(create_topic("c.send") == 0);
+  CHECK(end_offset("c.send") == 0);
+  CHECK(send_n("c.send", 0, 10, 33) == 0);
+  CHECK(end_offset("c.send") == 10);
+  CHECK(msg_length("c.send", 3) == 33);
+  CHECK(msg_length("c.send", 10) == 0);
+  CHECK(send_msg("c.none", 1, "x") < 0);
+  CHECK(end_offset("c.none") < 0);
+  return 0;
+}
+
+static int test_subscribe(void)
+{
+  CHECK(create_topic("c.sub1") == 0);
+  CHECK(create_topic("c.sub2") == 0);
+  CHECK(send_n("c.sub1", 0, 5, 20) == 0);
+
+  char *topics[] = {"c.sub1", "c.sub2", "c.none", "c.sub1"};
+  CHECK(subscribe(4, topics) == 2);
+  CHECK(subscribe(1, topics) < 0);
+  // Subscriptions start at the end
+  CHECK(position("c.sub1") == 5);
+  CHECK(position("c.sub2") == 0);
+  CHECK(position("c.none") < 0);
+
+  char *t;
+  void *m;
+  CHECK(poll(&t, &m) == 0);
+  CHECK(send_n("c.sub2", 0, 1, 7) == 0);
+  CHECK(poll_check("c.sub2", 0, 7) == 0);
+  CHECK(seek("c.sub1", 2) == 0);
+  for (int off = 2; off < 5; ++off)
+    CHECK(poll_check("c.sub1", off, 20) == 0);
+  CHECK(poll(&t, &m) == 0);
+  CHECK(position("c.sub1") == 5);
+  CHECK(unsubscribe() == 0);
+  CHECK(unsubscribe() < 0);
+  return 0;
+}
+
+// With a deeper pipeline, a poll asks every topic at once
+static int test_pipeline(void)
+{
+  char *topics[] = {"c.pipe1", "c.pipe2", "c.pipe3"};
+  for (int i = 0; i < 3; ++i)
+  {
+    CHECK(create_topic(topics[i]) == 0);
+    CHECK(send_n(topics[i], 0, 50, 64) == 0);
+  }
+  CHECK(set_pipeline_depth(8) == 0);
+  CHECK(subscribe(3, topics) == 3);
+  for (int i = 0; i < 3; ++i)
+    CHECK(seek(topics[i], 0) == 0);
+  // Each topic is read in order, whatever the order among them
+  int next[3] = {0};
+  for (int n = 0; n < 150; ++n)
+  {
+    char *t;
+    void *m;
+    int len = poll(&t, &m);
+    CHECK(len == 64);
+    int i = 0;
+    while (i < 3 && strcmp(t, topics[i]))
+      ++i;
+    CHECK(i < 3);
+    char want[64];
+    fill_msg(want, 64, next[i]++);
+    CHECK(!memcmp(m, want, 64));
+    free(t);
+    free(m);
+  }
+  char *t;
+  void *m;
+  CHECK(poll(&t, &m) == 0);
+  CHECK(unsubscribe() == 0);
+  CHECK(set_pipeline_depth(1) == 0);
+  return 0;
+}
+
+static int test_commit(void)
+{
+  CHECK(create_topic("c.commit") == 0);
+  CHECK(commited("c.client", "c.commit") < 0);
+  CHECK(commit("c.client", "c.commit", 42) == 0);
+  CHECK(commited("c.client", "c.commit") == 42);
+  CHECK(commit("c.client", "c.commit", 7) == 0);
+  CHECK(commited("c.client", "c.commit") == 7);
+  return 0;
+}
+
+// Receives the next stream message, which has to be the one of offset
+static int stream_check(char *topic, int offset, int len)
+{
+  char *got_topic = 0;
+  void *msg = 0;
+  CHECK(stream_poll(&got_topic, &msg) == len);
+  CHECK(got_topic && !strcmp(got_topic, topic));
+  char want[len ? len : 1];
+  fill_msg(want, len, offset);
+  CHECK(!memcmp(msg, want, len));
+  free(got_topic);
+  free(msg);
+  return 0;
+}
+
+// The window is a few messages, the library gives credit back as they are
+// consumed so everything comes
+static int test_stream(void)
+{
+  CHECK(create_topic("c.stream1") == 0);
+  CHECK(create_topic("c.stream2") == 0);
+  CHECK(send_n("c.stream1", 0, 100, 100) == 0);
+  CHECK(stream_open("c.none", 0, 1000) < 0);
+  CHECK(stream_open("c.stream1", 0, 300) == 0);
+  CHECK(stream_open("c.stream2", 0, 300) == 1);
+  for (int off = 0; off < 100; ++off)
+    CHECK(stream_check("c.stream1", off, 100) == 0);
+  CHECK(send_n("c.stream2", 0, 20, 100) == 0);
+  for (int off = 0; off < 20; ++off)
+    CHECK(stream_check("c.stream2", off, 100) == 0);
+  return 0;
+}
+
+// send_msgs appends consecutive messages of a topic together, and each
+// message gets its own offset
+static int test_send_msgs(void)
+{
+  CHECK(create_topic("c.batch1") == 0);
+  CHECK(create_topic("c.batch2") == 0);
+  char *topics[6] = {"c.batch1", "c.batch1", "c.batch2", "c.none",
+                     "c.batch1", "c.batch2"};
+  int want[6] = {0, 1, 0, -1, 2, 1};
+  int sizes[6];
+  void *msgs[6];
+  char bufs[6][40];
+  for (int i = 0; i < 6; ++i)
+  {
+    sizes[i] = 10 + i;
+    fill_msg(bufs[i], sizes[i], want[i]);
+    msgs[i] = bufs[i];
+  }
+  int offsets[6];
+  CHECK(send_msgs(6, topics, sizes, msgs, offsets) < 0);
+  for (int i = 0; i < 6; ++i)
+    CHECK(want[i] < 0 ? offsets[i] < 0 : offsets[i] == want[i]);
+  fill_msg(bufs[0], sizes[0], 3);
+  fill_msg(bufs[1], sizes[1], 4);
+  CHECK(send_msgs(2, topics, sizes, msgs, offsets) == 0);
+  CHECK(offsets[0] == 3 && offsets[1] == 4);
+
+  // One topic at a time, the order among topics is up to poll()
+  int lens1[5] = {10, 11, 14, 10, 11};
+  CHECK(subscribe(1, &topics[0]) == 1);
+  CHECK(seek("c.batch1", 0) == 0);
+  for (int off = 0; off < 5; ++off)
+    CHECK(poll_check("c.batch1", off, lens1[off]) == 0);
+  CHECK(unsubscribe() == 0);
+  CHECK(subscribe(1, &topics[2]) == 1);
+  CHECK(seek("c.batch2", 0) == 0);
+  CHECK(poll_check("c.batch2", 0, 12) == 0);
+  CHECK(poll_check("c.batch2", 1, 15) == 0);
+  CHECK(unsubscribe() == 0);
+  return 0;
+}
+
+// Where the offsets send_msg_async gets go
+typedef struct SENT sent;
+struct SENT
+{
+  int next; // Index of the next callback
+  int offsets[1000];
+};
+
+static void async_done(void *ctx, int offset)
+{
+  sent *s = ctx;
+  s->offsets[s->next++] = offset;
+}
+
+// Messages kept by the linger go in compressed batches, and they read back
+// one by one. Random ones stay as they are
+static int test_packed(void)
+{
+  CHECK(create_topic("c.packed") == 0);
+  CHECK(create_topic("c.packed_random") == 0);
+  CHECK(set_pipeline_depth(4) == 0);
+  CHECK(set_linger(5000, 8192) == 0);
+  CHECK(set_compression(1) == 0);
+  static sent done;
+  done.next = 0;
+  const int n = 1000;
+  char msg[200];
+  for (int i = 0; i < n; ++i)
+  {
+    int len = i % 200;
+    memset(msg, 'a' + i % 26, len);
+    CHECK(send_msg_async("c.packed", len, msg, async_done, &done) == 0);
+  }
+  CHECK(flush() == 0);
+  CHECK(done.next == n);
+  for (int i = 0; i < n; ++i)
+    CHECK(done.offsets[i] == i);
+
+  unsigned seed = 1;
+  done.next = 0;
+  for (int i = 0; i < 100; ++i)
+  {
+    for (int j = 0; j < 100; ++j)
+      msg[j] = rand_r(&seed);
+    CHECK(send_msg_async("c.packed_random", 100, msg, async_done, &done) ==
+          0);
+  }
+  CHECK(flush() == 0);
+  CHECK(done.next == 100 && done.offsets[99] == 99);
+  CHECK(set_linger(0, 0) == 0);
+  CHECK(set_compression(0) == 0);
+  CHECK(set_pipeline_depth(1) == 0);
+
+  long long raw, stored;
+  CHECK(topic_stats("c.packed", &raw, &stored) == 0);
+  CHECK(raw == n / 200 * (199 * 200 / 2));
+  CHECK(stored < raw / 4);
+  CHECK(topic_stats("c.packed_random", &raw, &stored) == 0);
+  CHECK(raw == 100 * 100 && stored >= raw);
+
+  char *topics[] = {"c.packed"};
+  CHECK(subscribe(1, topics) == 1);
+  CHECK(seek("c.packed", 0) == 0);
+  for (int i = 0; i < n; ++i)
+  {
+    char *t;
+    void *m;
+    int len = i % 200;
+    CHECK(poll(&t, &m) == len);
+    memset(msg, 'a' + i % 26, len);
+    CHECK(!memcmp(m, msg, len));
+    free(t);
+    free(m);
+  }
+  CHECK(unsubscribe() == 0);
+  char *random[] = {"c.packed_random"};
+  CHECK(subscribe(1, random) == 1);
+  CHECK(seek("c.packed_random", 0) == 0);
+  seed = 1;
+  for (int i = 0; i < 100; ++i)
+  {
+    char *t;
+    void *m;
+    CHECK(poll(&t, &m) == 100);
+    for (int j = 0; j < 100; ++j)
+      msg[j] = rand_r(&seed);
+    CHECK(!memcmp(m, msg, 100));
+    free(t);
+    free(m);
+  }
+  CHECK(unsubscribe() == 0);
+  return 0;
+}
+
+// A subscription below what retention keeps goes on from the oldest
+// message left, and so does a stream
+static int test_retention(void)
+{
+  CHECK(create_topic("c.retention") == 0);
+  CHECK(set_retention("c.retention", 5, 0, 0) == 0);
+  CHECK(set_retention("c.retention", -1, 0, 0) < 0);
+  CHECK(set_retention("c.none", 5, 0, 0) < 0);
+  CHECK(send_n("c.retention", 0, 20, 50) == 0);
+
+  // The reaper goes by every second
+  for (int i = 0; i < 100 && low_offset("c.retention") != 15; ++i)
+    usleep(50000);
+  CHECK(low_offset("c.retention") == 15);
+  CHECK(low_offset("c.none") < 0);
+  CHECK(msg_length("c.retention", 3) == -2);
+  CHECK(msg_length("c.retention", 15) == 50);
+
+  char *topics[] = {"c.retention"};
+  CHECK(subscribe(1, topics) == 1);
+  CHECK(seek("c.retention", 2) == 0);
+  // Finding out it is gone may take a poll of its own
+  char *t = 0;
+  void *m = 0;
+  int got = 0;
+  for (int i = 0; i < 3 && !got; ++i)
+    CHECK((got = poll(&t, &m)) >= 0);
+  CHECK(got == 50 && !strcmp(t, "c.retention"));
+  char want[50];
+  fill_msg(want, 50, 15);
+  CHECK(!memcmp(m, want, 50));
+  free(t);
+  free(m);
+  CHECK(position("c.retention") == 16);
+  for (int off = 16; off < 20; ++off)
+    CHECK(poll_check("c.retention", off, 50) == 0);
+  CHECK(unsubscribe() == 0);
+
+  int id = stream_open("c.retention", 0, 1000);
+  CHECK(id >= 0);
+  for (int off = 15; off < 20; ++off)
+    CHECK(stream_check("c.retention", off, 50) == 0);
+
+  // Names the broker could not take are turned down here
+  char name[300];
+  memset(name, 'x', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  long long raw, stored;
+  CHECK(low_offset(name) < 0);
+  CHECK(set_retention(name, 5, 0, 0) < 0);
+  CHECK(topic_stats(name, &raw, &stored) < 0);
+  return 0;
+}
+
+typedef struct TEST test;
+struct TEST
+{
+  const char *name;
+  int (*run)(void);
+};
+
+static const test tests[] = {
+    {"topics", test_topics},
+    {"send", test_send},
+    {"subscribe", test_subscribe},
+    {"pipeline", test_pipeline},
+    {"commit", test_commit},
+    {"stream", test_stream},
+    {"send_msgs", test_send_msgs},
+    {"packed", test_packed},
+    {"retention", test_retention},
+};
+
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+  for (size_t i = 0; i < NTESTS; ++i)
+  {
+    int wanted = argc == 1;
+    for (int j = 1; j < argc; ++j)
+      wanted |= !strcmp(argv[j], tests[i].name);
+    if (!wanted)
+      continue;
+    int result = tests[i].run();
+    printf("%s client %s\n", result ? "FAIL" : "ok  ", tests[i].name);
+    failed += !!result;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1 @@
+../broker/comun.c
\ No newline at end of file
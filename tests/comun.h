@@ -0,0 +1 @@
+../broker/comun.h
\ No newline at end of file
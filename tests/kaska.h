@@ -0,0 +1 @@
+../libkaska/kaska.h
\ No newline at end of file
@@ -0,0 +1,185 @@
+/*
+ * LZ codec tests: inputs of every kind compress within lz_bound and come
+ * back as they were, and broken input is turned down without writing past
+ * the output.
+ * Usage: lz_test
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "comun.h"
+
+// Bytes after the output that must stay as they are
+#define GUARD (64)
+#define GUARD_BYTE (0xA5)
+
+#define CHECK(cond)                                              \
+  do                                                             \
+  {                                                              \
+    if (!(cond))                                                 \
+    {                                                            \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return -1;                                                 \
+    }                                                            \
+  } while (0)
+
+static uint32_t rnd_state = 12345;
+
+static uint32_t rnd(void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+static int guard_intact(const uint8_t *p)
+{
+  for (int i = 0; i < GUARD; ++i)
+    if (p[i] != GUARD_BYTE)
+      return 0;
+  return 1;
+}
+
+// Compresses and decompresses src, *packed gets the compressed size
+static int round_trip(const uint8_t *src, size_t len, size_t *packed)
+{
+  size_t bound = lz_bound(len);
+  uint8_t *dst = malloc(bound + GUARD);
+  uint8_t *back = malloc(len + GUARD);
+  CHECK(dst && back);
+  memset(dst, GUARD_BYTE, bound + GUARD);
+  memset(back, GUARD_BYTE, len + GUARD);
+  size_t n = lz_compress(src, len, dst);
+  CHECK(n <= bound);
+  CHECK(guard_intact(dst + bound));
+  CHECK(lz_decompress(dst, n, back, len) == 0);
+  CHECK(!memcmp(src, back, len));
+  CHECK(guard_intact(back + len));
+  // It must be exactly that long
+  if (len)
+    CHECK(lz_decompress(dst, n, back, len - 1) < 0);
+  CHECK(guard_intact(back + len));
+  free(dst);
+  free(back);
+  if (packed)
+    *packed = n;
+  return 0;
+}
+
+static int test_small(void)
+{
+  uint8_t buf[300];
+  for (size_t len = 0; len <= sizeof(buf); ++len)
+  {
+    for (size_t i = 0; i < len; ++i)
+      buf[i] = rnd() % 4; // Some matches, some not
+    CHECK(round_trip(buf, len, 0) == 0);
+  }
+  return 0;
+}
+
+// Random bytes do not get smaller, they take little more than they are
+static int test_incompressible(void)
+{
+  size_t sizes[] = {15, 16, 270, 271, 4096, 65536 + 3, 1 << 20};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+  {
+    uint8_t *buf = malloc(sizes[k]);
+    CHECK(buf);
+    for (size_t i = 0; i < sizes[k]; ++i)
+      buf[i] = rnd();
+    size_t packed;
+    CHECK(round_trip(buf, sizes[k], &packed) == 0);
+    CHECK(packed >= sizes[k]);
+    free(buf);
+  }
+  return 0;
+}
+
+// Runs and repeated text, with matches longer than a length byte and
+// overlapping what they copy
+static int test_compressible(void)
+{
+  size_t len = 1 << 20;
+  uint8_t *buf = malloc(len);
+  CHECK(buf);
+  size_t packed;
+
+  memset(buf, 0, len);
+  CHECK(round_trip(buf, len, &packed) == 0);
+  CHECK(packed < len / 100);
+
+  const char *line = "{\"id\": 1234, \"topic\": \"sensors\", \"value\": 0.5}\n";
+  for (size_t i = 0; i < len; ++i)
+    buf[i] = line[i % strlen(line)];
+  CHECK(round_trip(buf, len, &packed) == 0);
+  CHECK(packed < len / 10);
+
+  // Repeats further back than a match can reach, with noise among them
+  for (size_t i = 0; i < len; ++i)
+    buf[i] = i % 100000 < 70000 ? (uint8_t)(i * 7 % 251) : rnd();
+  CHECK(round_trip(buf, len, 0) == 0);
+  free(buf);
+  return 0;
+}
+
+// Whatever comes in, it does not write past dst_len
+static int test_garbage(void)
+{
+  uint8_t src[64];
+  uint8_t dst[256 + GUARD];
+  for (int k = 0; k < 100000; ++k)
+  {
+    size_t len = rnd() % sizeof(src);
+    for (size_t i = 0; i < len; ++i)
+      src[i] = rnd();
+    size_t dst_len = rnd() % 256;
+    memset(dst, GUARD_BYTE, sizeof(dst));
+    lz_decompress(src, len, dst, dst_len);
+    CHECK(guard_intact(dst + dst_len));
+  }
+
+  // Cut short anywhere, it is turned down unless all that is missing is
+  // the empty last sequence
+  uint8_t text[1000];
+  for (size_t i = 0; i < sizeof(text); ++i)
+    text[i] = "abcabcabd"[i % 9] + i / 100;
+  uint8_t packed[lz_bound(sizeof(text))];
+  size_t n = lz_compress(text, sizeof(text), packed);
+  uint8_t back[sizeof(text)];
+  for (size_t cut = 0; cut < n; ++cut)
+    CHECK(lz_decompress(packed, cut, back, sizeof(text)) < 0 ||
+          !memcmp(back, text, sizeof(text)));
+  return 0;
+}
+
+typedef struct TEST test;
+struct TEST
+{
+  const char *name;
+  int (*run)(void);
+};
+
+static const test tests[] = {
+    {"small", test_small},
+    {"incompressible", test_incompressible},
+    {"compressible", test_compressible},
+    {"garbage", test_garbage},
+};
+
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+int main(void)
+{
+  int failed = 0;
+  for (size_t i = 0; i < NTESTS; ++i)
+  {
+    int result = tests[i].run();
+    printf("%s lz %s\n", result ? "FAIL" : "ok  ", tests[i].name);
+    failed += !!result;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,1143 @@
+/*
+ * Protocol tests: requests are built by hand and sent over a socket, so
+ * they can be pipelined, split and timed in ways the library never does.
+ * The broker is the one at BROKER_HOST and BROKER_PORT.
+ * Usage: proto_test [test...]   (all of them by default)
+ *        proto_test ready       waits for the broker to accept connections
+ *        proto_test fill topic from n
+ *                               sends n messages to topic from offset from,
+ *                               creating it if from is 0
+ *        proto_test recovered topic n
+ *                               the topic has to have n messages, as fill
+ *                               sent them, around a broker restart
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "comun.h"
+
+// How long a response can take before the test fails
+#define RECV_TIMEOUT_S (5)
+
+#define CHECK(cond)                                              \
+  do                                                             \
+  {                                                              \
+    if (!(cond))                                                 \
+    {                                                            \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return -1;                                                 \
+    }                                                            \
+  } while (0)
+
+// A request being built, sent in one go
+typedef struct REQUEST request;
+struct REQUEST
+{
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+};
+
+static void req_bytes(request *r, const void *data, size_t len)
+{
+  if (r->len + len > r->cap)
+  {
+    r->cap = r->cap ? r->cap : 256;
+    while (r->cap < r->len + len)
+      r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+    if (!r->buf)
+    {
+      perror("realloc");
+      exit(2);
+    }
+  }
+  memcpy(r->buf + r->len, data, len);
+  r->len += len;
+}
+
+static void req_op(request *r, uint8_t op)
+{
+  req_bytes(r, &op, 1);
+}
+
+static void req_u32(request *r, uint32_t v)
+{
+  uint32_t v_net = htonl(v);
+  req_bytes(r, &v_net, 4);
+}
+
+// Topic names go with their null termination
+static void req_str(request *r, const char *s)
+{
+  req_bytes(r, s, strlen(s) + 1);
+}
+
+static void req_free(request *r)
+{
+  free(r->buf);
+  r->buf = 0;
+  r->len = r->cap = 0;
+}
+
+static int connect_broker(void)
+{
+  char *port = getenv("BROKER_PORT");
+  char *hostname = getenv("BROKER_HOST");
+  if (!port || !hostname)
+  {
+    fprintf(stderr, "BROKER_HOST and BROKER_PORT must be set\n");
+    return -1;
+  }
+  struct addrinfo hints;
+  struct addrinfo *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, port, &hints, &res) != 0)
+    return -1;
+  int sfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sfd >= 0 && connect(sfd, res->ai_addr, res->ai_addrlen) < 0)
+  {
+    close(sfd);
+    sfd = -1;
+  }
+  freeaddrinfo(res);
+  if (sfd < 0)
+    return -1;
+  // Nothing the tests expect takes this long, a missing response fails
+  // instead of hanging
+  struct timeval tv = {RECV_TIMEOUT_S, 0};
+  int one = 1;
+  setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return sfd;
+}
+
+static int send_bytes(int sfd, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  while (len)
+  {
+    ssize_t n = send(sfd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int req_send(int sfd, request *r)
+{
+  int result = send_bytes(sfd, r->buf, r->len);
+  req_free(r);
+  return result;
+}
+
+static int recv_bytes(int sfd, void *dst, size_t len)
+{
+  uint8_t *p = dst;
+  while (len)
+  {
+    ssize_t n = recv(sfd, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Returns 0 and sets *v, -1 if it did not come
+static int recv_u32(int sfd, uint32_t *v)
+{
+  uint32_t v_net;
+  if (recv_bytes(sfd, &v_net, 4) < 0)
+    return -1;
+  *v = ntohl(v_net);
+  return 0;
+}
+
+// Whether something arrives (or the connection closes) within ms
+static int arrives(int sfd, int ms)
+{
+  struct pollfd pfd = {sfd, POLLIN, 0};
+  return poll(&pfd, 1, ms) > 0;
+}
+
+// Whether the broker closed the connection
+static int closed(int sfd)
+{
+  uint8_t b;
+  return arrives(sfd, RECV_TIMEOUT_S * 1000) && recv(sfd, &b, 1, 0) == 0;
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Fills msg with bytes that tell offset apart from the other offsets
+static void fill_msg(uint8_t *msg, size_t len, uint32_t offset)
+{
+  for (size_t i = 0; i < len; ++i)
+    msg[i] = (uint8_t)(offset * 31 + i);
+}
+
+static void create_topic_req(request *r, const char *topic)
+{
+  req_op(r, OP_CREATE_TOPIC);
+  req_u32(r, strlen(topic) + 1);
+  req_str(r, topic);
+}
+
+static void send_msg_req(request *r, const char *topic, const void *msg,
+                         uint32_t len)
+{
+  req_op(r, OP_SEND_MSG);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, len);
+  req_str(r, topic);
+  req_bytes(r, msg, len);
+}
+
+static void poll_req(request *r, uint8_t op, const char *topic, uint32_t offset)
+{
+  req_op(r, op);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, offset);
+  req_str(r, topic);
+}
+
+static int create_topic(int sfd, const char *topic)
+{
+  request r = {0};
+  create_topic_req(&r, topic);
+  uint8_t result;
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_bytes(sfd, &result, 1) == 0);
+  CHECK(result == OP_CT_SUCCESS);
+  return 0;
+}
+
+// Sends n messages of len bytes, filled with fill_msg, from offset on
+static int send_msgs(int sfd, const char *topic, uint32_t offset, int n,
+                     uint32_t len)
+{
+  request r = {0};
+  uint8_t msg[len ? len : 1];
+  for (int i = 0; i < n; ++i)
+  {
+    fill_msg(msg, len, offset + i);
+    send_msg_req(&r, topic, msg, len);
+  }
+  CHECK(req_send(sfd, &r) == 0);
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t got;
+    CHECK(recv_u32(sfd, &got) == 0);
+    CHECK(got == offset + i);
+  }
+  return 0;
+}
+
+// Receives a POLL response, which has to be the message of offset with len
+// bytes
+static int recv_polled(int sfd, uint32_t offset, uint32_t len)
+{
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == len);
+  uint8_t msg[len ? len : 1];
+  uint8_t want[len ? len : 1];
+  fill_msg(want, len, offset);
+  CHECK(recv_bytes(sfd, msg, len) == 0);
+  CHECK(!memcmp(msg, want, len));
+  return 0;
+}
+
+static int test_send_poll(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.send_poll") == 0);
+  CHECK(send_msgs(sfd, "p.send_poll", 0, 3, 100) == 0);
+
+  request r = {0};
+  for (uint32_t off = 0; off < 4; ++off)
+    poll_req(&r, OP_POLL, "p.send_poll", off);
+  CHECK(req_send(sfd, &r) == 0);
+  for (uint32_t off = 0; off < 3; ++off)
+    CHECK(recv_polled(sfd, off, 100) == 0);
+  uint32_t len;
+  CHECK(recv_u32(sfd, &len) == 0);
+  CHECK(len == 0); // Nothing there yet
+
+  // Topics that are not there
+  poll_req(&r, OP_POLL, "p.none", 0);
+  send_msg_req(&r, "p.none", "x", 1);
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t v;
+  CHECK(recv_u32(sfd, &v) == 0);
+  CHECK(v == 0);
+  CHECK(recv_u32(sfd, &v) == 0);
+  CHECK((int32_t)v == OP_SM_NOTOPIC);
+  close(sfd);
+  return 0;
+}
+
+// A large message for a topic that is not there is answered before all of
+// it arrives, and the rest of it is not taken for requests
+static int test_send_notopic(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  static uint8_t msg[256 * 1024];
+  request r = {0};
+  send_msg_req(&r, "p.none", msg, sizeof(msg));
+  size_t half = r.len - sizeof(msg) / 2;
+  CHECK(send_bytes(sfd, r.buf, half) == 0);
+  uint32_t v;
+  CHECK(recv_u32(sfd, &v) == 0);
+  CHECK((int32_t)v == OP_SM_NOTOPIC);
+  CHECK(send_bytes(sfd, r.buf + half, r.len - half) == 0);
+  req_free(&r);
+
+  poll_req(&r, OP_POLL, "p.none", 0);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_u32(sfd, &v) == 0);
+  CHECK(v == 0);
+  close(sfd);
+  return 0;
+}
+
+// Requests that come a byte at a time are put together before running
+static int test_split(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.split") == 0);
+  uint8_t msg[300];
+  fill_msg(msg, sizeof(msg), 0);
+  request r = {0};
+  send_msg_req(&r, "p.split", msg, sizeof(msg));
+  poll_req(&r, OP_POLL, "p.split", 0);
+  for (size_t i = 0; i < r.len; ++i)
+  {
+    CHECK(send_bytes(sfd, r.buf + i, 1) == 0);
+    if (i % 64 == 0)
+      usleep(1000);
+  }
+  req_free(&r);
+  uint32_t off;
+  CHECK(recv_u32(sfd, &off) == 0);
+  CHECK(off == 0);
+  CHECK(recv_polled(sfd, 0, sizeof(msg)) == 0);
+  close(sfd);
+  return 0;
+}
+
+// Many requests written at once are all answered, in order
+static int test_pipelined(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.pipelined") == 0);
+  const int n = 2000;
+  CHECK(send_msgs(sfd, "p.pipelined", 0, n, 40) == 0);
+  request r = {0};
+  for (int i = 0; i < n; ++i)
+    poll_req(&r, OP_POLL, "p.pipelined", i);
+  CHECK(req_send(sfd, &r) == 0);
+  for (int i = 0; i < n; ++i)
+    CHECK(recv_polled(sfd, i, 40) == 0);
+  close(sfd);
+  return 0;
+}
+
+// Unknown opcodes and names without their termination drop the connection
+static int test_malformed(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  uint8_t bad = 0x7F;
+  CHECK(send_bytes(sfd, &bad, 1) == 0);
+  CHECK(closed(sfd));
+  close(sfd);
+
+  sfd = connect_broker();
+  CHECK(sfd >= 0);
+  request r = {0};
+  req_op(&r, OP_END_OFF);
+  req_u32(&r, 3);
+  req_bytes(&r, "abc", 3);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(closed(sfd));
+  close(sfd);
+  return 0;
+}
+
+static void poll_wait_req(request *r, const char *topic, uint32_t offset,
+                          uint32_t max_wait_ms)
+{
+  req_op(r, OP_POLL_WAIT);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, offset);
+  req_u32(r, max_wait_ms);
+  req_str(r, topic);
+}
+
+// A POLL_WAIT with nothing to get answers with nothing once its time is up,
+// and right away if the message is there
+static int test_poll_wait_timeout(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.wait_timeout") == 0);
+  request r = {0};
+  poll_wait_req(&r, "p.wait_timeout", 0, 300);
+  long start = now_ms();
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t len;
+  CHECK(recv_u32(sfd, &len) == 0);
+  long took = now_ms() - start;
+  CHECK(len == 0);
+  // The timer goes in ticks, it may be a tick early
+  CHECK(took >= 280 && took < 3000);
+
+  CHECK(send_msgs(sfd, "p.wait_timeout", 0, 1, 10) == 0);
+  poll_wait_req(&r, "p.wait_timeout", 0, 3000);
+  start = now_ms();
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_polled(sfd, 0, 10) == 0);
+  CHECK(now_ms() - start < 1000);
+  close(sfd);
+  return 0;
+}
+
+// A message sent to the topic wakes the POLL_WAIT waiting for it
+static int test_poll_wait_wake(void)
+{
+  int waiting = connect_broker();
+  int sending = connect_broker();
+  CHECK(waiting >= 0 && sending >= 0);
+  CHECK(create_topic(sending, "p.wait_wake") == 0);
+  CHECK(send_msgs(sending, "p.wait_wake", 0, 2, 50) == 0);
+
+  // Waits for the next one
+  request r = {0};
+  poll_wait_req(&r, "p.wait_wake", 2, 4000);
+  CHECK(req_send(waiting, &r) == 0);
+  CHECK(!arrives(waiting, 200));
+  long start = now_ms();
+  CHECK(send_msgs(sending, "p.wait_wake", 2, 1, 50) == 0);
+  CHECK(recv_polled(waiting, 2, 50) == 0);
+  CHECK(now_ms() - start < 2000);
+  close(waiting);
+  close(sending);
+  return 0;
+}
+
+// Requests pipelined after a POLL_WAIT wait for it, in a single read of
+// more than the initial input buffer, and then they all run in order
+static int test_poll_wait_pipelined(void)
+{
+  int waiting = connect_broker();
+  int sending = connect_broker();
+  CHECK(waiting >= 0 && sending >= 0);
+  CHECK(create_topic(sending, "p.wait_pipe") == 0);
+  CHECK(create_topic(sending, "p.wait_pipe_after") == 0);
+
+  // Under the smallest read a loop does (16 KiB in io_uring mode), so it
+  // comes in a single one
+  const int n = 40;
+  const uint32_t len = 250;
+  request r = {0};
+  poll_wait_req(&r, "p.wait_pipe", 0, 4000);
+  uint8_t msg[len];
+  for (int i = 0; i < n; ++i)
+  {
+    fill_msg(msg, len, i);
+    send_msg_req(&r, "p.wait_pipe_after", msg, len);
+  }
+  CHECK(r.len > 8192 && r.len < 16384);
+  CHECK(req_send(waiting, &r) == 0);
+  CHECK(!arrives(waiting, 200));
+
+  CHECK(send_msgs(sending, "p.wait_pipe", 0, 1, 20) == 0);
+  CHECK(recv_polled(waiting, 0, 20) == 0);
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t off;
+    CHECK(recv_u32(waiting, &off) == 0);
+    CHECK(off == (uint32_t)i);
+  }
+  // And they are all there as sent
+  for (int i = 0; i < n; ++i)
+    poll_req(&r, OP_POLL, "p.wait_pipe_after", i);
+  CHECK(req_send(sending, &r) == 0);
+  for (int i = 0; i < n; ++i)
+    CHECK(recv_polled(sending, i, len) == 0);
+  close(waiting);
+  close(sending);
+  return 0;
+}
+
+static void stream_req(request *r, const char *topic, uint32_t id,
+                       uint32_t offset, uint32_t credit)
+{
+  req_op(r, OP_STREAM);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, id);
+  req_u32(r, offset);
+  req_u32(r, credit);
+  req_str(r, topic);
+}
+
+static void credit_req(request *r, uint32_t id, uint32_t credit)
+{
+  req_op(r, OP_CREDIT);
+  req_u32(r, id);
+  req_u32(r, credit);
+}
+
+// Receives a stream frame, which has to be the message of offset with len
+// bytes
+static int recv_frame(int sfd, uint32_t id, uint32_t offset, uint32_t len)
+{
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == id);
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == offset);
+  uint8_t msg[len];
+  uint8_t want[len];
+  fill_msg(want, len, offset);
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == len);
+  CHECK(recv_bytes(sfd, msg, len) == 0);
+  CHECK(!memcmp(msg, want, len));
+  return 0;
+}
+
+// A stream pushes messages while it has credit, a message can take it
+// below zero, and CREDIT lets it go on
+static int test_stream_credit(void)
+{
+  int streaming = connect_broker();
+  int sending = connect_broker();
+  CHECK(streaming >= 0 && sending >= 0);
+  CHECK(create_topic(sending, "p.stream") == 0);
+  CHECK(send_msgs(sending, "p.stream", 0, 10, 100) == 0);
+
+  // 250 bytes of credit: 0, 1 and 2, and then it is at -50
+  request r = {0};
+  stream_req(&r, "p.stream", 7, 0, 250);
+  CHECK(req_send(streaming, &r) == 0);
+  for (uint32_t off = 0; off < 3; ++off)
+    CHECK(recv_frame(streaming, 7, off, 100) == 0);
+  CHECK(!arrives(streaming, 300));
+
+  // Back to 50, one more
+  credit_req(&r, 7, 100);
+  CHECK(req_send(streaming, &r) == 0);
+  CHECK(recv_frame(streaming, 7, 3, 100) == 0);
+  CHECK(!arrives(streaming, 300));
+
+  // The rest, and new messages as they come
+  credit_req(&r, 7, 1000);
+  CHECK(req_send(streaming, &r) == 0);
+  for (uint32_t off = 4; off < 10; ++off)
+    CHECK(recv_frame(streaming, 7, off, 100) == 0);
+  CHECK(!arrives(streaming, 200));
+  CHECK(send_msgs(sending, "p.stream", 10, 1, 100) == 0);
+  CHECK(recv_frame(streaming, 7, 10, 100) == 0);
+
+  // Credit for a stream that is not there does nothing
+  credit_req(&r, 8, 1000);
+  CHECK(req_send(streaming, &r) == 0);
+  CHECK(!arrives(streaming, 200));
+  close(streaming);
+  close(sending);
+  return 0;
+}
+
+// A stream of a topic that is not there gets a single frame saying so,
+// and other requests are not taken once there are streams
+static int test_stream_notopic(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  request r = {0};
+  stream_req(&r, "p.none", 3, 0, 1000);
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t frame[3];
+  CHECK(recv_u32(sfd, &frame[0]) == 0 && frame[0] == 3);
+  CHECK(recv_u32(sfd, &frame[1]) == 0 && frame[1] == 0);
+  CHECK(recv_u32(sfd, &frame[2]) == 0 && frame[2] == STREAM_NOTOPIC);
+  close(sfd);
+
+  sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.stream_only") == 0);
+  stream_req(&r, "p.stream_only", 0, 0, 1000);
+  poll_req(&r, OP_POLL, "p.stream_only", 0);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(closed(sfd));
+  close(sfd);
+  return 0;
+}
+
+static void fetch_req(request *r, const char *topic, uint32_t offset,
+                      uint32_t max_msgs, uint32_t max_bytes)
+{
+  req_op(r, OP_FETCH);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, offset);
+  req_u32(r, max_msgs);
+  req_u32(r, max_bytes);
+  req_str(r, topic);
+}
+
+// Receives a FETCH response, which has to be the n plain messages of len
+// bytes from offset on
+static int recv_fetched(int sfd, uint32_t offset, uint32_t n, uint32_t len)
+{
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == n);
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    CHECK(recv_u32(sfd, &got) == 0);
+    CHECK(got == len);
+    CHECK(recv_u32(sfd, &got) == 0);
+    CHECK(got == FETCH_PLAIN);
+  }
+  uint8_t msg[len ? len : 1];
+  uint8_t want[len ? len : 1];
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    fill_msg(want, len, offset + i);
+    CHECK(recv_bytes(sfd, msg, len) == 0);
+    CHECK(!memcmp(msg, want, len));
+  }
+  return 0;
+}
+
+// A FETCH gets up to max_msgs, as many as fit in max_bytes but at least
+// one, and never more than the broker's own limit
+static int test_fetch_limits(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.fetch") == 0);
+  CHECK(send_msgs(sfd, "p.fetch", 0, 20, 100) == 0);
+
+  request r = {0};
+  fetch_req(&r, "p.fetch", 0, 5, 100000);
+  fetch_req(&r, "p.fetch", 5, 100, 350);
+  fetch_req(&r, "p.fetch", 8, 100, 10);
+  fetch_req(&r, "p.fetch", 15, 100, 100000);
+  fetch_req(&r, "p.fetch", 20, 100, 100000);
+  fetch_req(&r, "p.fetch", 1000, 100, 100000);
+  fetch_req(&r, "p.none", 0, 100, 100000);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_fetched(sfd, 0, 5, 100) == 0);
+  CHECK(recv_fetched(sfd, 5, 3, 100) == 0);
+  CHECK(recv_fetched(sfd, 8, 1, 100) == 0);
+  CHECK(recv_fetched(sfd, 15, 5, 100) == 0);
+  CHECK(recv_fetched(sfd, 20, 0, 100) == 0);
+  CHECK(recv_fetched(sfd, 1000, 0, 100) == 0);
+  CHECK(recv_fetched(sfd, 0, 0, 100) == 0);
+  // Each one answered once
+  CHECK(!arrives(sfd, 100));
+
+  CHECK(create_topic(sfd, "p.fetch_many") == 0);
+  CHECK(send_msgs(sfd, "p.fetch_many", 0, 1100, 8) == 0);
+  fetch_req(&r, "p.fetch_many", 0, 5000, 1 << 30);
+  fetch_req(&r, "p.fetch_many", 1024, 5000, 1 << 30);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_fetched(sfd, 0, 1024, 8) == 0);
+  CHECK(recv_fetched(sfd, 1024, 76, 8) == 0);
+  close(sfd);
+  return 0;
+}
+
+static void fetch_all_req(request *r, int ntopics, const char **topics,
+                          const uint32_t *offsets, uint32_t max_msgs,
+                          uint32_t max_bytes)
+{
+  uint32_t body_len = 0;
+  for (int i = 0; i < ntopics; ++i)
+    body_len += 8 + strlen(topics[i]) + 1;
+  req_op(r, OP_FETCH_ALL);
+  req_u32(r, body_len);
+  req_u32(r, ntopics);
+  req_u32(r, max_msgs);
+  req_u32(r, max_bytes);
+  for (int i = 0; i < ntopics; ++i)
+  {
+    req_u32(r, strlen(topics[i]) + 1);
+    req_u32(r, offsets[i]);
+    req_str(r, topics[i]);
+  }
+}
+
+// FETCH_ALL answers a FETCH for each topic, max_msgs for each one and
+// max_bytes for all of them
+static int test_fetch_all(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  const char *topics[] = {"p.fetch_all1", "p.none", "p.fetch_all2",
+                          "p.fetch_all3"};
+  for (int i = 0; i < 4; ++i)
+    if (i != 1)
+    {
+      CHECK(create_topic(sfd, topics[i]) == 0);
+      CHECK(send_msgs(sfd, topics[i], 0, 10, 100) == 0);
+    }
+
+  request r = {0};
+  uint32_t offsets[] = {0, 0, 2, 9};
+  fetch_all_req(&r, 4, topics, offsets, 4, 100000);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_fetched(sfd, 0, 4, 100) == 0);
+  CHECK(recv_fetched(sfd, 0, 0, 100) == 0);
+  CHECK(recv_fetched(sfd, 2, 4, 100) == 0);
+  CHECK(recv_fetched(sfd, 9, 1, 100) == 0);
+
+  // The first one takes 500 bytes, the next one gets a message even if it
+  // does not fit in what is left, and then there is nothing for the last
+  uint32_t more[] = {0, 0, 0, 0};
+  fetch_all_req(&r, 4, topics, more, 10, 550);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_fetched(sfd, 0, 5, 100) == 0);
+  CHECK(recv_fetched(sfd, 0, 0, 100) == 0);
+  CHECK(recv_fetched(sfd, 0, 1, 100) == 0);
+  CHECK(recv_fetched(sfd, 0, 0, 100) == 0);
+  CHECK(!arrives(sfd, 100));
+  close(sfd);
+  return 0;
+}
+
+// A run of a SEND_BATCH: n messages to topic, the one of each offset being
+// len(offset) bytes, filled with fill_msg
+typedef struct RUN run;
+struct RUN
+{
+  const char *topic;
+  uint32_t offset;
+  uint32_t n;
+};
+
+// Lengths vary, and there is an empty one
+static uint32_t batch_len(uint32_t offset)
+{
+  return offset == 2 ? 0 : 10 + offset * 7;
+}
+
+static void send_batch_req(request *r, int nruns, const run *runs)
+{
+  uint32_t body_len = 0;
+  for (int i = 0; i < nruns; ++i)
+  {
+    body_len += 8 + strlen(runs[i].topic) + 1;
+    for (uint32_t j = 0; j < runs[i].n; ++j)
+      body_len += 4 + batch_len(runs[i].offset + j);
+  }
+  req_op(r, OP_SEND_BATCH);
+  req_u32(r, body_len);
+  req_u32(r, nruns);
+  for (int i = 0; i < nruns; ++i)
+  {
+    req_u32(r, strlen(runs[i].topic) + 1);
+    req_u32(r, runs[i].n);
+    req_str(r, runs[i].topic);
+    for (uint32_t j = 0; j < runs[i].n; ++j)
+    {
+      uint32_t len = batch_len(runs[i].offset + j);
+      uint8_t msg[len ? len : 1];
+      fill_msg(msg, len, runs[i].offset + j);
+      req_u32(r, len);
+      req_bytes(r, msg, len);
+    }
+  }
+}
+
+// SEND_BATCH appends each run to its topic, with consecutive offsets, and
+// they read back as sent
+static int test_send_batch(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.batch1") == 0);
+  CHECK(create_topic(sfd, "p.batch2") == 0);
+
+  run runs[] = {
+      {"p.batch1", 0, 3},
+      {"p.batch2", 0, 5},
+      {"p.none", 0, 1},
+      {"p.batch1", 3, 2},
+  };
+  request r = {0};
+  send_batch_req(&r, 4, runs);
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0 && got == 0);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 0);
+  CHECK(recv_u32(sfd, &got) == 0 && (int32_t)got == OP_SM_NOTOPIC);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 3);
+
+  for (uint32_t off = 0; off < 5; ++off)
+  {
+    poll_req(&r, OP_POLL, "p.batch1", off);
+    poll_req(&r, OP_POLL, "p.batch2", off);
+  }
+  CHECK(req_send(sfd, &r) == 0);
+  for (uint32_t off = 0; off < 5; ++off)
+  {
+    CHECK(recv_polled(sfd, off, batch_len(off)) == 0);
+    CHECK(recv_polled(sfd, off, batch_len(off)) == 0);
+  }
+
+  // A run that says it has more messages than there are drops the
+  // connection
+  req_op(&r, OP_SEND_BATCH);
+  req_u32(&r, 8 + 9 + 4 + 1);
+  req_u32(&r, 1);
+  req_u32(&r, 9);
+  req_u32(&r, 2);
+  req_str(&r, "p.batch1");
+  req_u32(&r, 1);
+  req_bytes(&r, "x", 1);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(closed(sfd));
+  close(sfd);
+  return 0;
+}
+
+// Packs n messages from offset on in a batch with codec, they are ten
+// times as long as send_batch_req would send them and their bytes repeat,
+// so LZ makes them smaller
+// Returns the bytes of the messages
+static size_t packed_batch(request *b, uint32_t codec, uint32_t offset,
+                           uint32_t n)
+{
+  request raw = {0};
+  req_u32(b, codec);
+  req_u32(b, n);
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    uint32_t len = batch_len(offset + i) * 10;
+    uint8_t msg[len ? len : 1];
+    for (uint32_t j = 0; j < len; ++j)
+      msg[j] = (uint8_t)(offset + i + j % 10);
+    req_u32(b, len);
+    req_bytes(&raw, msg, len);
+  }
+  if (codec == CODEC_LZ)
+  {
+    uint8_t *lz = malloc(lz_bound(raw.len));
+    if (!lz)
+      exit(2);
+    req_bytes(b, lz, lz_compress(raw.buf, raw.len, lz));
+    free(lz);
+  }
+  else
+    req_bytes(b, raw.buf, raw.len);
+  size_t raw_len = raw.len;
+  req_free(&raw);
+  return raw_len;
+}
+
+static int recv_packed_msg(int sfd, uint32_t offset)
+{
+  uint32_t len = batch_len(offset) * 10;
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0);
+  CHECK(got == len);
+  uint8_t msg[len ? len : 1];
+  CHECK(recv_bytes(sfd, msg, len) == 0);
+  for (uint32_t j = 0; j < len; ++j)
+    CHECK(msg[j] == (uint8_t)(offset + j % 10));
+  return 0;
+}
+
+// SEND_PACKED stores each batch as it comes, a message at each offset:
+// POLL gets them unpacked, and FETCH gets the batches as they were sent
+static int test_send_packed(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.packed") == 0);
+  CHECK(send_msgs(sfd, "p.packed", 0, 1, 10) == 0);
+
+  request lz = {0};
+  request none = {0};
+  request bad = {0};
+  size_t raw = packed_batch(&lz, CODEC_LZ, 1, 5);
+  CHECK(lz.len < PACKED_HDR_SIZE(5) + raw / 2);
+  packed_batch(&none, CODEC_NONE, 6, 3);
+  packed_batch(&bad, CODEC_NONE, 9, 2);
+  bad.len -= 1; // Not all of its messages are there
+  const request *batches[] = {&lz, &bad, &none};
+  const char *topics[] = {"p.packed", "p.packed", "p.packed"};
+  uint32_t nmsgs[] = {5, 2, 3};
+  uint32_t body_len = 0;
+  for (int i = 0; i < 3; ++i)
+    body_len += 8 + strlen(topics[i]) + 1 + 4 + batches[i]->len;
+  request r = {0};
+  req_op(&r, OP_SEND_PACKED);
+  req_u32(&r, body_len);
+  req_u32(&r, 3);
+  for (int i = 0; i < 3; ++i)
+  {
+    req_u32(&r, strlen(topics[i]) + 1);
+    req_u32(&r, nmsgs[i]);
+    req_str(&r, topics[i]);
+    req_u32(&r, batches[i]->len);
+    req_bytes(&r, batches[i]->buf, batches[i]->len);
+  }
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t got;
+  CHECK(recv_u32(sfd, &got) == 0 && got == 1);
+  CHECK(recv_u32(sfd, &got) == 0 && (int32_t)got == OP_SM_FAIL);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 6);
+
+  for (uint32_t off = 1; off < 9; ++off)
+    poll_req(&r, OP_POLL, "p.packed", off);
+  CHECK(req_send(sfd, &r) == 0);
+  for (uint32_t off = 1; off < 9; ++off)
+    CHECK(recv_packed_msg(sfd, off) == 0);
+
+  // From the second message of the first batch: both batches, once each
+  fetch_req(&r, "p.packed", 2, 100, 100000);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 2);
+  CHECK(recv_u32(sfd, &got) == 0 && got == lz.len);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 1);
+  CHECK(recv_u32(sfd, &got) == 0 && got == none.len);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 0);
+  uint8_t back[lz.len + none.len];
+  CHECK(recv_bytes(sfd, back, sizeof(back)) == 0);
+  CHECK(!memcmp(back, lz.buf, lz.len));
+  CHECK(!memcmp(back + lz.len, none.buf, none.len));
+
+  // max bytes counts what is sent: each batch once, as it is packed
+  fetch_req(&r, "p.packed", 2, 100, lz.len + none.len);
+  fetch_req(&r, "p.packed", 2, 100, lz.len + none.len - 1);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 2);
+  CHECK(recv_u32(sfd, &got) == 0 && got == lz.len);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 1);
+  CHECK(recv_u32(sfd, &got) == 0 && got == none.len);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 0);
+  CHECK(recv_bytes(sfd, back, sizeof(back)) == 0);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 1);
+  CHECK(recv_u32(sfd, &got) == 0 && got == lz.len);
+  CHECK(recv_u32(sfd, &got) == 0 && got == 1);
+  CHECK(recv_bytes(sfd, back, lz.len) == 0);
+  CHECK(!memcmp(back, lz.buf, lz.len));
+  req_free(&lz);
+  req_free(&none);
+  req_free(&bad);
+  close(sfd);
+  return 0;
+}
+
+static void retention_req(request *r, const char *topic, uint32_t max_msgs)
+{
+  req_op(r, OP_SET_RETENTION);
+  req_u32(r, strlen(topic) + 1);
+  req_u32(r, max_msgs);
+  req_u32(r, 0); // No byte or age limit
+  req_u32(r, 0);
+  req_u32(r, 0);
+  req_str(r, topic);
+}
+
+// Asks the low offset of topic
+static int low_offset(int sfd, const char *topic, uint32_t *low)
+{
+  request r = {0};
+  req_op(&r, OP_LOW_OFF);
+  req_u32(&r, strlen(topic) + 1);
+  req_str(&r, topic);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_u32(sfd, low) == 0);
+  return 0;
+}
+
+// What the reaper drops is answered as gone, with the offset to go on from
+static int test_retention(void)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  CHECK(create_topic(sfd, "p.retention") == 0);
+  request r = {0};
+  retention_req(&r, "p.retention", 5);
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t v;
+  CHECK(recv_u32(sfd, &v) == 0 && v == 0);
+  CHECK(send_msgs(sfd, "p.retention", 0, 20, 100) == 0);
+
+  // The reaper goes by every second
+  uint32_t low = 0;
+  long until = now_ms() + 5000;
+  while (low != 15 && now_ms() < until)
+  {
+    CHECK(low_offset(sfd, "p.retention", &low) == 0);
+    usleep(50000);
+  }
+  CHECK(low == 15);
+
+  poll_req(&r, OP_POLL, "p.retention", 3);
+  poll_req(&r, OP_POLL, "p.retention", 15);
+  fetch_req(&r, "p.retention", 0, 100, 100000);
+  fetch_req(&r, "p.retention", 14, 100, 100000);
+  fetch_req(&r, "p.retention", 15, 100, 100000);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_u32(sfd, &v) == 0 && v == POLL_GONE);
+  CHECK(recv_u32(sfd, &v) == 0 && v == 15);
+  CHECK(recv_polled(sfd, 15, 100) == 0);
+  for (int i = 0; i < 2; ++i)
+  {
+    CHECK(recv_u32(sfd, &v) == 0 && v == FETCH_GONE);
+    CHECK(recv_u32(sfd, &v) == 0 && v == 15);
+  }
+  CHECK(recv_fetched(sfd, 15, 5, 100) == 0);
+
+  // The ones kept are still the newest ones
+  CHECK(send_msgs(sfd, "p.retention", 20, 1, 100) == 0);
+  poll_req(&r, OP_POLL, "p.retention", 20);
+  CHECK(req_send(sfd, &r) == 0);
+  CHECK(recv_polled(sfd, 20, 100) == 0);
+  close(sfd);
+  return 0;
+}
+
+typedef struct TEST test;
+struct TEST
+{
+  const char *name;
+  int (*run)(void);
+};
+
+static const test tests[] = {
+    {"send_poll", test_send_poll},
+    {"send_notopic", test_send_notopic},
+    {"split", test_split},
+    {"pipelined", test_pipelined},
+    {"malformed", test_malformed},
+    {"poll_wait_timeout", test_poll_wait_timeout},
+    {"poll_wait_wake", test_poll_wait_wake},
+    {"poll_wait_pipelined", test_poll_wait_pipelined},
+    {"stream_credit", test_stream_credit},
+    {"stream_notopic", test_stream_notopic},
+    {"fetch_limits", test_fetch_limits},
+    {"fetch_all", test_fetch_all},
+    {"send_batch", test_send_batch},
+    {"send_packed", test_send_packed},
+    {"retention", test_retention},
+};
+
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+// Waits up to 10s for the broker to take connections
+static int ready(void)
+{
+  long until = now_ms() + 10000;
+  while (now_ms() < until)
+  {
+    int sfd = connect_broker();
+    if (sfd >= 0)
+    {
+      close(sfd);
+      return 0;
+    }
+    usleep(20000);
+  }
+  fprintf(stderr, "broker not ready\n");
+  return 1;
+}
+
+// Messages fill sends, so a segment record takes RECOVER_LEN + 8 bytes
+#define RECOVER_LEN (100)
+
+static int fill(const char *topic, uint32_t from, int n)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  if (!from)
+    CHECK(create_topic(sfd, topic) == 0);
+  CHECK(send_msgs(sfd, topic, from, n, RECOVER_LEN) == 0);
+  close(sfd);
+  return 0;
+}
+
+static int recovered(const char *topic, uint32_t n)
+{
+  int sfd = connect_broker();
+  CHECK(sfd >= 0);
+  request r = {0};
+  req_op(&r, OP_END_OFF);
+  req_u32(&r, strlen(topic) + 1);
+  req_str(&r, topic);
+  CHECK(req_send(sfd, &r) == 0);
+  uint32_t end;
+  CHECK(recv_u32(sfd, &end) == 0);
+  CHECK(end == n);
+  // Within what the broker gives in a FETCH
+  for (uint32_t off = 0; off < n; off += 1000)
+  {
+    uint32_t want = n - off < 1000 ? n - off : 1000;
+    fetch_req(&r, topic, off, want, 1 << 30);
+    CHECK(req_send(sfd, &r) == 0);
+    CHECK(recv_fetched(sfd, off, want, RECOVER_LEN) == 0);
+  }
+  close(sfd);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 2 && !strcmp(argv[1], "ready"))
+    return ready();
+  if (argc == 5 && !strcmp(argv[1], "fill"))
+    return fill(argv[2], atoi(argv[3]), atoi(argv[4])) ? 1 : 0;
+  if (argc == 4 && !strcmp(argv[1], "recovered"))
+    return recovered(argv[2], atoi(argv[3])) ? 1 : 0;
+  int failed = 0;
+  for (size_t i = 0; i < NTESTS; ++i)
+  {
+    int wanted = argc == 1;
+    for (int j = 1; j < argc; ++j)
+      wanted |= !strcmp(argv[j], tests[i].name);
+    if (!wanted)
+      continue;
+    int result = tests[i].run();
+    printf("%s proto %s\n", result ? "FAIL" : "ok  ", tests[i].name);
+    failed += !!result;
+  }
+  return failed ? 1 : 0;
+}
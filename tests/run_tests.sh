@@ -0,0 +1,148 @@
+#!/bin/sh
+# Runs the codec tests, and the protocol and client tests against a broker
+# started in each connection mode and with its topics stored in files,
+# written with calls or mapped, which have to come back when it is killed
+# and started again. The broker has to be built already, with URING=1 for
+# the io_uring mode, which is skipped otherwise.
+# Usage: ./run_tests.sh [first_port]
+
+cd "$(dirname "$0")" || exit 1
+
+BROKER=../broker/broker
+# Each broker started gets the next one, a port the last one held may take
+# a while to be free again
+port=${1:-29100}
+# Whole suites, in case something hangs
+LIMIT=120
+
+work=$(mktemp -d)
+pid=
+trap 'test -n "$pid" && kill -9 $pid 2>/dev/null; rm -rf "$work"' EXIT
+export BROKER_HOST=localhost
+failed=0
+
+fail() {
+  echo "FAIL $*"
+  failed=$((failed + 1))
+}
+
+# Starts the broker with the given options on the next port
+start() {
+  port=$((port + 1))
+  export BROKER_PORT=$port
+  mkdir -p "$work/commits"
+  $BROKER "$@" $port "$work/commits" >"$work/broker.log" 2>&1 &
+  pid=$!
+  if ! ./proto_test ready; then
+    tail -20 "$work/broker.log"
+    return 1
+  fi
+}
+
+# Stops it, it must still be there
+stop() {
+  if ! kill $pid 2>/dev/null; then
+    fail "broker exited"
+    tail -20 "$work/broker.log"
+  fi
+  wait $pid 2>/dev/null
+  pid=
+}
+
+# Stops it with no chance to clean up, as a crash would
+crash() {
+  kill -9 $pid 2>/dev/null
+  wait $pid 2>/dev/null
+  pid=
+}
+
+# Writes the bytes of printf format $2 at byte $3 of file $1
+poke() {
+  printf "$2" | dd of="$1" bs=1 seek="$3" conv=notrunc 2>/dev/null
+}
+
+# Runs every test against a broker started with the given options, -s
+# stores the topics in $work/store, which the broker creates
+suite() {
+  echo "== $*"
+  rm -rf "$work/commits" "$work/store"
+  if ! start "$@"; then
+    fail "broker $* did not start"
+    return
+  fi
+  timeout $LIMIT ./proto_test || fail "proto_test $*"
+  timeout $LIMIT ./client_test || fail "client_test $*"
+  stop
+}
+
+# No broker needed
+./lz_test || fail lz_test
+
+modes="thread epoll pool"
+if $BROKER -m uring 2>&1 | grep -q "without io_uring"; then
+  echo "broker built without io_uring, skipping that mode"
+else
+  modes="$modes uring"
+fi
+
+# A stored topic comes back after the broker is killed, even with a record
+# torn or damaged at the end of its file, and goes on from there
+recovery() {
+  echo "== recovery $*"
+  rm -rf "$work/commits" "$work/store"
+  # The only topic, in the first directory. A record is 8 bytes of header
+  # and the 100 of a message fill sends
+  seg="$work/store/topic-0/0000000000.log"
+  rec=108
+  set -- "$@" -s "$work/store"
+  if ! start "$@"; then
+    fail "broker $* did not start"
+    return
+  fi
+  ./proto_test fill p.recover 0 50 || fail "fill $*"
+  crash
+
+  # The header of a 100 byte record and a few bytes of it
+  poke "$seg" '\000\000\000\144\000\000\000\000abc' $((50 * rec))
+  start "$@" || fail "broker $* did not restart"
+  grep -q "not valid" "$work/broker.log" || fail "torn record not seen $*"
+  ./proto_test recovered p.recover 50 || fail "torn record $*"
+  ./proto_test fill p.recover 50 10 || fail "fill after torn record $*"
+  crash
+
+  # The last byte of the last record
+  poke "$seg" 'X' $((60 * rec - 1))
+  start "$@" || fail "broker $* did not restart"
+  grep -q "not valid" "$work/broker.log" || fail "bad record not seen $*"
+  ./proto_test recovered p.recover 59 || fail "bad record $*"
+  ./proto_test fill p.recover 59 1 || fail "fill after bad record $*"
+  stop
+
+  # Nothing to drop, the zeros after the records of a mapped file included
+  start "$@" || fail "broker $* did not restart"
+  grep -q "not valid" "$work/broker.log" && fail "clean file dropped $*"
+  ./proto_test recovered p.recover 60 || fail "clean restart $*"
+  stop
+}
+
+for mode in $modes; do
+  suite -m $mode
+done
+# Every socket sharing the port is accepted on, whatever the loops
+for mode in $modes; do
+  [ $mode = thread ] || suite -m $mode -l 1 -a 3
+done
+
+# Synced now and then, and only when a file is full. Mapped files are as
+# long as a whole segment from the start, zeros after the last record
+for engine in file mmap; do
+  suite -m epoll -s "$work/store" -e $engine -f 100,0,50
+  recovery -m epoll -e $engine -f 1,0,0
+  recovery -m epoll -e $engine
+done
+
+if [ $failed -ne 0 ]; then
+  echo "$failed failed"
+  exit 1
+fi
+echo "all passed"